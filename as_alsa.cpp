@@ -26,6 +26,8 @@
 #include "as_alsa.h"
 
 #if defined(HAVE_ALSA)
+# include <poll.h>
+
 static bool alsa_atexit_set = false;
 
 void alsa_atexit(void) {
@@ -39,9 +41,46 @@ void alsa_atexit_init(void) {
     }
 }
 
+static bool alsa_option_bool(const char *s) {
+    if (s == NULL || *s == 0)
+        return true;
+    if (!strcmp(s,"on") || !strcmp(s,"yes") || !strcmp(s,"true"))
+        return true;
+
+    return atoi(s) != 0;
+}
+
+/* 0 means "leave it to the driver" */
+static bool alsa_option_uint(const char *s,unsigned int &v) {
+    char *e = NULL;
+    unsigned long r;
+
+    if (s == NULL || *s == 0 || !strcmp(s,"default")) {
+        v = 0;
+        return true;
+    }
+
+    r = strtoul(s,&e,10);
+    if (e == NULL || *e != 0 || r > 0x7FFFFFFFul)
+        return false;
+
+    v = (unsigned int)r;
+    return true;
+}
+
+static std::string alsa_option_uint_str(unsigned int v) {
+    char tmp[32];
+
+    if (v == 0u)
+        return "default";
+
+    sprintf(tmp,"%u",v);
+    return tmp;
+}
+
 class AudioSourceALSA : public AudioSource {
 public:
-    AudioSourceALSA() : alsa_pcm(NULL), alsa_pcm_hw_params(NULL), alsa_device_string("default"), bytes_per_frame(0), samples_per_frame(0), isUserOpen(false) {
+    AudioSourceALSA() : alsa_pcm(NULL), alsa_pcm_hw_params(NULL), alsa_device_string("default"), bytes_per_frame(0), samples_per_frame(0), isUserOpen(false), alsa_want_mmap(false), alsa_mmap(false), alsa_mmap_offset(0), alsa_mmap_frames(0), alsa_want_period_us(0), alsa_want_buffer_us(0), alsa_want_periods(0), alsa_period_frames(0), alsa_buffer_frames(0), alsa_periods(0), alsa_status(NULL), alsa_frames_read(0), alsa_xruns(0), alsa_tstamp_monotonic(false), alsa_link(false), alsa_linked(false), alsa_link_master(NULL) {
         chosen_format.bits_per_sample = 0;
         chosen_format.sample_rate = 0;
         chosen_format.format_tag = 0;
@@ -49,6 +88,85 @@ public:
     }
     virtual ~AudioSourceALSA() { alsa_force_close(); }
 public:
+    virtual int EnumOptions(std::vector<AudioOptionPair> &names) {
+        AudioOptionPair p;
+
+        names.clear();
+
+        /* if open, report what we actually got */
+        p.name = "mmap";
+        p.value = (IsOpen() ? alsa_mmap : alsa_want_mmap) ? "1" : "0";
+        names.push_back(p);
+
+        if (IsOpen() && chosen_format.sample_rate != 0) {
+            p.name = "period_us";
+            p.value = alsa_option_uint_str((unsigned int)(((unsigned long long)alsa_period_frames * 1000000ull) / (unsigned long long)chosen_format.sample_rate));
+            names.push_back(p);
+
+            p.name = "buffer_us";
+            p.value = alsa_option_uint_str((unsigned int)(((unsigned long long)alsa_buffer_frames * 1000000ull) / (unsigned long long)chosen_format.sample_rate));
+            names.push_back(p);
+
+            p.name = "periods";
+            p.value = alsa_option_uint_str(alsa_periods);
+            names.push_back(p);
+
+            p.name = "period_frames";
+            p.value = alsa_option_uint_str((unsigned int)alsa_period_frames);
+            names.push_back(p);
+
+            p.name = "buffer_frames";
+            p.value = alsa_option_uint_str((unsigned int)alsa_buffer_frames);
+            names.push_back(p);
+        }
+        else {
+            p.name = "period_us";
+            p.value = alsa_option_uint_str(alsa_want_period_us);
+            names.push_back(p);
+
+            p.name = "buffer_us";
+            p.value = alsa_option_uint_str(alsa_want_buffer_us);
+            names.push_back(p);
+
+            p.name = "periods";
+            p.value = alsa_option_uint_str(alsa_want_periods);
+            names.push_back(p);
+        }
+
+        return 0;
+    }
+    virtual int SetOption(const char *name,const char *value) {
+        if (IsOpen())
+            return -EBUSY;
+        if (name == NULL)
+            return -EINVAL;
+
+        if (!strcmp(name,"mmap")) {
+            alsa_want_mmap = alsa_option_bool(value);
+            alsa_close();
+            return 0;
+        }
+        else if (!strcmp(name,"period_us")) {
+            if (!alsa_option_uint(value,alsa_want_period_us))
+                return -EINVAL;
+
+            return 0;
+        }
+        else if (!strcmp(name,"buffer_us")) {
+            if (!alsa_option_uint(value,alsa_want_buffer_us))
+                return -EINVAL;
+
+            return 0;
+        }
+        else if (!strcmp(name,"periods")) {
+            if (!alsa_option_uint(value,alsa_want_periods))
+                return -EINVAL;
+
+            return 0;
+        }
+
+        return -ENOENT;
+    }
     virtual int SelectDevice(const char *str) {
         if (!IsOpen()) {
             std::string sel = (str != NULL && *str != 0) ? str : "default";
@@ -130,15 +248,41 @@ public:
                 alsa_close();
                 return -1;
             }
+            alsa_apply_buffering();
             if (snd_pcm_hw_params(alsa_pcm,alsa_pcm_hw_params) < 0) {
                 alsa_close();
                 return -1;
             }
+            alsa_read_buffering();
+            alsa_apply_sw_params();
+            if (snd_pcm_status_malloc(&alsa_status) < 0) {
+                alsa_close();
+                return -1;
+            }
+            alsa_frames_read = 0;
+            alsa_xruns = 0;
             if (snd_pcm_prepare(alsa_pcm) < 0) {
                 alsa_close();
                 return -1;
             }
-            if (snd_pcm_start(alsa_pcm) < 0) {
+            alsa_linked = false;
+            if (alsa_link_master != NULL) {
+                int err = -EBADFD;
+
+                if (alsa_link_master->alsa_pcm == NULL || (err=snd_pcm_link(alsa_link_master->alsa_pcm,alsa_pcm)) < 0)
+                    fprintf(stderr,"ALSA warning: Unable to link %s to %s, it will start on its own, %s\n",
+                        alsa_device_string.c_str(),alsa_link_master->alsa_device_string.c_str(),snd_strerror(err));
+                else
+                    alsa_linked = true;
+            }
+            /* a linked group stays prepared until WaitForData() starts all of it at once */
+            if (!alsa_link) {
+                if (snd_pcm_start(alsa_pcm) < 0) {
+                    alsa_close();
+                    return -1;
+                }
+            }
+            if (!alsa_get_poll_descriptors()) {
                 alsa_close();
                 return -1;
             }
@@ -222,13 +366,18 @@ public:
             int err;
 
             if (samples > 0) {
-                r = snd_pcm_readi(alsa_pcm,buffer,samples);
+                if (alsa_mmap)
+                    r = snd_pcm_mmap_readi(alsa_pcm,buffer,samples);
+                else
+                    r = snd_pcm_readi(alsa_pcm,buffer,samples);
                 if (r >= 0) {
+                    alsa_frames_read += (unsigned long long)r;
                     return (int)((unsigned int)r * chosen_format.bytes_per_frame);
                 }
                 else if (r < 0) {
                     if (r == -EPIPE) {
                         fprintf(stderr,"ALSA warning: PCM underrun\n");
+                        alsa_xruns++;
                         if ((err=snd_pcm_prepare(alsa_pcm)) < 0)
                             fprintf(stderr,"ALSA warning: Failure to re-prepare the device after underrun, %s\n",snd_strerror(err));
                     }
@@ -244,16 +393,201 @@ public:
             return 0;
         }
 
+        return -EINVAL;
+    }
+    virtual int ReadBegin(const void* &ptr,unsigned int bytes) {
+        ptr = NULL;
+
+        if (IsOpen()) {
+            const snd_pcm_channel_area_t *areas = NULL;
+            snd_pcm_uframes_t offset = 0,frames;
+            snd_pcm_sframes_t avail;
+            int err;
+
+            if (!alsa_mmap)
+                return -ENOSPC;
+
+            assert(alsa_mmap_frames == 0); /* ReadEnd() first! */
+
+            avail = snd_pcm_avail_update(alsa_pcm);
+            if (avail < 0) {
+                if (avail == -EPIPE) {
+                    fprintf(stderr,"ALSA warning: PCM underrun\n");
+                    alsa_xruns++;
+                    if ((err=snd_pcm_prepare(alsa_pcm)) < 0)
+                        fprintf(stderr,"ALSA warning: Failure to re-prepare the device after underrun, %s\n",snd_strerror(err));
+                    else if ((err=snd_pcm_start(alsa_pcm)) < 0) /* mmap capture does not start on its own */
+                        fprintf(stderr,"ALSA warning: Failure to restart the device after underrun, %s\n",snd_strerror(err));
+
+                    return 0;
+                }
+                else if (avail == -EAGAIN) {
+                    return 0;
+                }
+
+                return (int)avail;
+            }
+
+            frames = (snd_pcm_uframes_t)(bytes / chosen_format.bytes_per_frame);
+            if (frames > (snd_pcm_uframes_t)avail)
+                frames = (snd_pcm_uframes_t)avail;
+            if (frames == 0)
+                return 0;
+
+            if ((err=snd_pcm_mmap_begin(alsa_pcm,&areas,&offset,&frames)) < 0)
+                return err;
+
+            /* interleaved: channel 0 starts the frame, and frames are packed */
+            if (areas[0].first != 0u || areas[0].step != (chosen_format.bytes_per_frame * 8u)) {
+                fprintf(stderr,"ALSA: mmap buffer is not packed interleaved audio\n");
+                snd_pcm_mmap_commit(alsa_pcm,offset,0);
+                return -EINVAL;
+            }
+
+            ptr = (const unsigned char*)areas[0].addr + ((size_t)offset * (size_t)chosen_format.bytes_per_frame);
+            alsa_mmap_offset = offset;
+            alsa_mmap_frames = frames;
+            return (int)((unsigned int)frames * chosen_format.bytes_per_frame);
+        }
+
+        return -EINVAL;
+    }
+    virtual int ReadEnd(unsigned int bytes) {
+        if (IsOpen()) {
+            snd_pcm_uframes_t frames = (snd_pcm_uframes_t)(bytes / chosen_format.bytes_per_frame);
+            snd_pcm_sframes_t r;
+            int err;
+
+            if (!alsa_mmap)
+                return -ENOSPC;
+
+            assert(frames <= alsa_mmap_frames);
+            alsa_mmap_frames = 0;
+
+            r = snd_pcm_mmap_commit(alsa_pcm,alsa_mmap_offset,frames);
+            if (r == -EPIPE) {
+                /* the device overran the data while we were looking at it */
+                fprintf(stderr,"ALSA warning: PCM underrun\n");
+                alsa_xruns++;
+                if ((err=snd_pcm_prepare(alsa_pcm)) < 0)
+                    fprintf(stderr,"ALSA warning: Failure to re-prepare the device after underrun, %s\n",snd_strerror(err));
+                else if ((err=snd_pcm_start(alsa_pcm)) < 0)
+                    fprintf(stderr,"ALSA warning: Failure to restart the device after underrun, %s\n",snd_strerror(err));
+
+                return 0;
+            }
+            else if (r < 0) {
+                return (int)r;
+            }
+            else if ((snd_pcm_uframes_t)r != frames) {
+                return -EIO;
+            }
+
+            alsa_frames_read += (unsigned long long)frames;
+            return 0;
+        }
+
+        return -EINVAL;
+    }
+    virtual int ReadTimestamped(void *buffer,unsigned int bytes,AudioTimestamp &ts) {
+        if (IsOpen()) {
+            int rd = 0;
+
+            /* the next frame Read() returns is the oldest one the device is holding */
+            alsa_timestamp_next(ts);
+            ts.frame = alsa_frames_read;
+
+            if (bytes != 0)
+                rd = Read(buffer,bytes);
+
+            return rd;
+        }
+
+        return -EINVAL;
+    }
+    virtual int Link(AudioSource *master) {
+        AudioSourceALSA *m = dynamic_cast<AudioSourceALSA*>(master);
+
+        if (m == NULL || m == this)
+            return -ENOSPC;
+        if (IsOpen() || m->IsOpen())
+            return -EBUSY;
+
+        /* snd_pcm_link() in Open(), once both are prepared */
+        alsa_link_master = m;
+        alsa_link = true;
+        m->alsa_link = true;
+        return 0;
+    }
+    virtual bool IsLinked(void) {
+        return IsOpen() && alsa_linked;
+    }
+    virtual unsigned long Xruns(void) {
+        return alsa_xruns;
+    }
+    virtual int WaitForData(int timeout_ms) {
+        if (IsOpen()) {
+            unsigned short revents = 0;
+            snd_pcm_state_t st;
+            int err;
+
+            /* let Read() deal with overruns, and kick the device if it was re-prepared */
+            st = snd_pcm_state(alsa_pcm);
+            if (st == SND_PCM_STATE_XRUN || st == SND_PCM_STATE_SUSPENDED)
+                return 1;
+            if (st == SND_PCM_STATE_PREPARED) {
+                if ((err=snd_pcm_start(alsa_pcm)) < 0)
+                    return err;
+            }
+
+            /* poll() wakes up when avail_min (one period by default) is ready */
+            if (alsa_pollfd.empty())
+                return AudioSource::WaitForData(timeout_ms);
+
+            err = poll(&alsa_pollfd[0],(nfds_t)alsa_pollfd.size(),timeout_ms);
+            if (err < 0)
+                return (errno == EINTR) ? 0 : -errno;
+            if (err == 0)
+                return 0;
+
+            if ((err=snd_pcm_poll_descriptors_revents(alsa_pcm,&alsa_pollfd[0],(unsigned int)alsa_pollfd.size(),&revents)) < 0)
+                return err;
+            if (revents & (POLLERR|POLLNVAL))
+                return 1; /* Read() will report the problem */
+            if (revents & POLLIN)
+                return 1;
+
+            return 0;
+        }
+
         return -EINVAL;
     }
 private:
     snd_pcm_t*			        alsa_pcm;
     snd_pcm_hw_params_t*		alsa_pcm_hw_params;
     std::string                 alsa_device_string;
+    std::vector<struct pollfd>  alsa_pollfd;
     AudioFormat                 chosen_format;
     unsigned int                bytes_per_frame;
     unsigned int                samples_per_frame;
     bool                        isUserOpen;
+    bool                        alsa_want_mmap;
+    bool                        alsa_mmap;
+    snd_pcm_uframes_t           alsa_mmap_offset;
+    snd_pcm_uframes_t           alsa_mmap_frames;
+    unsigned int                alsa_want_period_us;
+    unsigned int                alsa_want_buffer_us;
+    unsigned int                alsa_want_periods;
+    snd_pcm_uframes_t           alsa_period_frames;
+    snd_pcm_uframes_t           alsa_buffer_frames;
+    unsigned int                alsa_periods;
+    snd_pcm_status_t*           alsa_status;
+    unsigned long long          alsa_frames_read;
+    unsigned long               alsa_xruns;             /* overruns since Open(), see Xruns() */
+    bool                        alsa_tstamp_monotonic;
+    bool                        alsa_link;              /* in a linked group, Open() leaves it to WaitForData() to start */
+    bool                        alsa_linked;            /* snd_pcm_link() to the master worked */
+    AudioSourceALSA*            alsa_link_master;       /* the one to snd_pcm_link() to */
 private:
     bool format_is_valid(const AudioFormat &fmt) {
         if (fmt.format_tag == AFMT_PCMU || fmt.format_tag == AFMT_PCMS) {
@@ -446,6 +780,100 @@ private:
 
         return false;
     }
+    /* Buffer first, then period (aplay does it the other way around), so that when the two can't
+     * both be had the buffer length, which is the headroom against losing audio, is the one kept.
+     * The _near() calls settle on whatever the hardware can do, so a request that cannot be met
+     * exactly is not an error. */
+    void alsa_apply_buffering(void) {
+        unsigned int v;
+        int dir,err;
+
+        if (alsa_want_buffer_us != 0u) {
+            v = alsa_want_buffer_us; dir = 0;
+            if ((err=snd_pcm_hw_params_set_buffer_time_near(alsa_pcm,alsa_pcm_hw_params,&v,&dir)) < 0)
+                fprintf(stderr,"ALSA warning: Unable to set buffer time %uus, %s\n",alsa_want_buffer_us,snd_strerror(err));
+        }
+        if (alsa_want_period_us != 0u) {
+            v = alsa_want_period_us; dir = 0;
+            if ((err=snd_pcm_hw_params_set_period_time_near(alsa_pcm,alsa_pcm_hw_params,&v,&dir)) < 0)
+                fprintf(stderr,"ALSA warning: Unable to set period time %uus, %s\n",alsa_want_period_us,snd_strerror(err));
+        }
+        if (alsa_want_periods != 0u) {
+            v = alsa_want_periods; dir = 0;
+            if ((err=snd_pcm_hw_params_set_periods_near(alsa_pcm,alsa_pcm_hw_params,&v,&dir)) < 0)
+                fprintf(stderr,"ALSA warning: Unable to set %u periods, %s\n",alsa_want_periods,snd_strerror(err));
+        }
+    }
+    /* what the driver gave us */
+    void alsa_read_buffering(void) {
+        int dir = 0;
+
+        alsa_period_frames = 0;
+        alsa_buffer_frames = 0;
+        alsa_periods = 0;
+
+        snd_pcm_hw_params_get_period_size(alsa_pcm_hw_params,&alsa_period_frames,&dir);
+        snd_pcm_hw_params_get_buffer_size(alsa_pcm_hw_params,&alsa_buffer_frames);
+        dir = 0;
+        snd_pcm_hw_params_get_periods(alsa_pcm_hw_params,&alsa_periods,&dir);
+    }
+    /* have ALSA timestamp the buffer pointer on the monotonic clock */
+    void alsa_apply_sw_params(void) {
+        snd_pcm_sw_params_t *sw = NULL;
+
+        alsa_tstamp_monotonic = false;
+
+        if (snd_pcm_sw_params_malloc(&sw) < 0)
+            return;
+
+        if (snd_pcm_sw_params_current(alsa_pcm,sw) >= 0) {
+            snd_pcm_sw_params_set_tstamp_mode(alsa_pcm,sw,SND_PCM_TSTAMP_ENABLE);
+            if (snd_pcm_sw_params_set_tstamp_type(alsa_pcm,sw,SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0)
+                alsa_tstamp_monotonic = true;
+
+            if (snd_pcm_sw_params(alsa_pcm,sw) < 0) {
+                fprintf(stderr,"ALSA warning: Unable to enable timestamps, capture times will be estimated\n");
+                alsa_tstamp_monotonic = false;
+            }
+        }
+
+        snd_pcm_sw_params_free(sw);
+    }
+    /* When was the oldest frame still in the buffer captured? The hardware timestamp is
+     * when the buffer pointer was last updated, and delay is how many frames had been
+     * captured by then that we have not read yet. */
+    void alsa_timestamp_next(AudioTimestamp &ts) {
+        const uint64_t now_mono = monotonic_clock_us();
+        const uint64_t now_wall = wall_clock_us();
+        snd_htimestamp_t ht;
+        snd_pcm_sframes_t delay;
+        uint64_t ht_us,age;
+
+        if (alsa_status == NULL || snd_pcm_status(alsa_pcm,alsa_status) < 0) {
+            TimestampEstimate(ts,0,chosen_format.sample_rate);
+            return;
+        }
+
+        delay = snd_pcm_status_get_delay(alsa_status);
+        if (delay < 0) delay = 0;
+
+        snd_pcm_status_get_htstamp(alsa_status,&ht);
+        ht_us = ((uint64_t)ht.tv_sec * (uint64_t)1000000ul) + ((uint64_t)ht.tv_nsec / (uint64_t)1000ul);
+
+        if (ht_us == 0) {
+            /* no hardware timestamp, go by the clock now */
+            TimestampEstimate(ts,(unsigned long long)delay,chosen_format.sample_rate);
+            return;
+        }
+
+        /* older ALSA cannot do monotonic timestamps, so it is the wall clock */
+        if (!alsa_tstamp_monotonic)
+            ht_us = (now_wall > ht_us && now_mono > (now_wall - ht_us)) ? (now_mono - (now_wall - ht_us)) : now_mono;
+
+        age = (uint64_t)(((unsigned long long)delay * 1000000ull) / (unsigned long long)chosen_format.sample_rate);
+        ts.mono_us = (ht_us > age) ? (ht_us - age) : 0;
+        ts.wall_us = (now_mono >= ts.mono_us && now_wall > (now_mono - ts.mono_us)) ? (now_wall - (now_mono - ts.mono_us)) : now_wall;
+    }
     void alsa_force_close(void) {
         Close();
         alsa_close();
@@ -470,8 +898,40 @@ private:
                 alsa_close();
                 return false;
             }
-            if ((err=snd_pcm_hw_params_set_access(alsa_pcm,alsa_pcm_hw_params,SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-                alsa_close();
+
+            /* mmap access lets the caller work directly in the DMA buffer (ReadBegin/ReadEnd).
+             * Not every device or plugin can do it, so fall back to read/write access. */
+            alsa_mmap = false;
+            if (alsa_want_mmap) {
+                if ((err=snd_pcm_hw_params_set_access(alsa_pcm,alsa_pcm_hw_params,SND_PCM_ACCESS_MMAP_INTERLEAVED)) >= 0)
+                    alsa_mmap = true;
+                else
+                    fprintf(stderr,"ALSA: mmap access not supported by this device, using read/write access\n");
+            }
+
+            if (!alsa_mmap) {
+                if ((err=snd_pcm_hw_params_set_access(alsa_pcm,alsa_pcm_hw_params,SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+                    alsa_close();
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+    bool alsa_get_poll_descriptors(void) {
+        int count;
+
+        alsa_pollfd.clear();
+
+        count = snd_pcm_poll_descriptors_count(alsa_pcm);
+        if (count < 0)
+            return false;
+
+        if (count > 0) {
+            alsa_pollfd.resize((size_t)count);
+            if (snd_pcm_poll_descriptors(alsa_pcm,&alsa_pollfd[0],(unsigned int)count) != count) {
+                alsa_pollfd.clear();
                 return false;
             }
         }
@@ -479,6 +939,13 @@ private:
         return true;
     }
     void alsa_close(void) {
+        if (alsa_status != NULL) {
+            snd_pcm_status_free(alsa_status);
+            alsa_status = NULL;
+        }
+        alsa_pollfd.clear();
+        alsa_mmap_frames = 0;
+        alsa_mmap = false;
         if (alsa_pcm_hw_params != NULL) {
             snd_pcm_hw_params_free(alsa_pcm_hw_params);
             alsa_pcm_hw_params = NULL;
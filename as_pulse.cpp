@@ -22,78 +22,202 @@
 #include "ausrcls.h"
 #include "dbfs.h"
 #include "autocut.h"
+#include "audring.h"
 
 #include "as_pulse.h"
 
 #if defined(HAVE_PULSE)
 # include <endian.h>
+# include <pthread.h>
+# include <atomic>
 
 static bool pulse_atexit_set = false;
 
+/* The mainloop runs on its own thread. Anything done to the context or a stream from
+ * any other thread must be done with the mainloop lock held. */
 static pa_context*                  pulse_context = NULL;
-static pa_mainloop*                 pulse_mainloop = NULL;
+static pa_threaded_mainloop*        pulse_mainloop = NULL;
 static pa_mainloop_api*             pulse_mainloop_api = NULL;
 static bool                         pulse_context_connected = false;
 
-void pulse_idle(void) {
-    if (pulse_mainloop == NULL || pulse_mainloop_api == NULL)
-        return;
+/* Nothing waits on the server forever. Every wait below gives up after this long. */
+static unsigned int                 pulse_timeout_ms = 5000;
+static pa_time_event*               pulse_deadline_event = NULL;
+static bool                         pulse_deadline_hit = false;
 
-    pa_mainloop_prepare(pulse_mainloop,100);
-    pa_mainloop_poll(pulse_mainloop);
-    pa_mainloop_dispatch(pulse_mainloop);
+/* startup timing, in milliseconds */
+static monotonic_clock_t            pulse_connect_begin = 0;
+static monotonic_clock_t            pulse_connect_time = 0;
+
+void pulse_lock(void) {
+    if (pulse_mainloop != NULL)
+        pa_threaded_mainloop_lock(pulse_mainloop);
 }
 
-bool pulse_open_global_connect(void) {
-    if (pulse_context == NULL)
-        return false;
+void pulse_unlock(void) {
+    if (pulse_mainloop != NULL)
+        pa_threaded_mainloop_unlock(pulse_mainloop);
+}
 
-    if (!pulse_context_connected) {
-        if (pa_context_connect(pulse_context, NULL, (pa_context_flags_t)0, NULL) < 0)
-            return false;
+/* mainloop thread: something changed that a waiter might care about */
+static void pulse_context_state_cb(pa_context *ctx,void *userdata) {
+    (void)ctx;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop,0);
+}
 
-        /* wait for connection. */
-        {
-            pa_context_state_t st;
+static void pulse_operation_state_cb(pa_operation *op,void *userdata) {
+    (void)op;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop,0);
+}
 
-            do {
-                pulse_idle();
+static void pulse_deadline_cb(pa_mainloop_api *api,pa_time_event *ev,const struct timeval *tv,void *userdata) {
+    (void)api;
+    (void)ev;
+    (void)tv;
+    (void)userdata;
+    pulse_deadline_hit = true;
+    pa_threaded_mainloop_signal(pulse_mainloop,0);
+}
 
-                st = pa_context_get_state(pulse_context);
-                if (st == PA_CONTEXT_CONNECTING ||
-                    st == PA_CONTEXT_AUTHORIZING ||
-                    st == PA_CONTEXT_SETTING_NAME) {
-                    usleep(1000);
-                }
-                else if (st == PA_CONTEXT_READY) {
-                    break;
-                }
-                else {
-                    return false;
-                }
-            } while(1);
-        }
+/* call with the lock held. arms a timer that wakes up pa_threaded_mainloop_wait() */
+void pulse_deadline_stop(void) {
+    if (pulse_deadline_event != NULL) {
+        pulse_mainloop_api->time_free(pulse_deadline_event);
+        pulse_deadline_event = NULL;
+    }
+}
 
-        pulse_context_connected = true;
+void pulse_deadline_start(void) {
+    struct timeval tv;
+
+    pulse_deadline_stop();
+    pulse_deadline_hit = false;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv,(pa_usec_t)pulse_timeout_ms * (pa_usec_t)1000u);
+    pulse_deadline_event = pulse_mainloop_api->time_new(pulse_mainloop_api,&tv,pulse_deadline_cb,NULL);
+}
+
+/* call with the lock held. waits for an operation to finish, then releases it */
+bool pulse_wait_operation(pa_operation *op,const char *what) {
+    pa_operation_state_t st;
+    monotonic_clock_t t = monotonic_clock();
+
+    if (op == NULL)
+        return false;
+
+    pa_operation_set_state_callback(op,pulse_operation_state_cb,NULL);
+
+    pulse_deadline_start();
+    while ((st=pa_operation_get_state(op)) == PA_OPERATION_RUNNING && !pulse_deadline_hit)
+        pa_threaded_mainloop_wait(pulse_mainloop);
+    pulse_deadline_stop();
+
+    if (st == PA_OPERATION_RUNNING) {
+        fprintf(stderr,"PulseAudio: Timed out after %lums waiting for %s\n",(unsigned long)(monotonic_clock() - t),what);
+        pa_operation_cancel(op);
     }
 
-    return true;
+    pa_operation_set_state_callback(op,NULL,NULL);
+    pa_operation_unref(op);
+    return (st == PA_OPERATION_DONE);
 }
 
-bool pulse_open_global(void) {
+/* Start the mainloop and begin connecting to the server, but do not wait for it.
+ * The connection comes up in the background while the caller does other setup. */
+bool pulse_open_global_begin(void) {
     if (pulse_mainloop == NULL) {
-        if ((pulse_mainloop=pa_mainloop_new()) == NULL)
+        if ((pulse_mainloop=pa_threaded_mainloop_new()) == NULL)
             return false;
+        if (pa_threaded_mainloop_start(pulse_mainloop) < 0) {
+            pa_threaded_mainloop_free(pulse_mainloop);
+            pulse_mainloop = NULL;
+            return false;
+        }
     }
     if (pulse_mainloop_api == NULL) {
-        if ((pulse_mainloop_api=pa_mainloop_get_api(pulse_mainloop)) == NULL)
+        if ((pulse_mainloop_api=pa_threaded_mainloop_get_api(pulse_mainloop)) == NULL)
             return false;
     }
     if (pulse_context == NULL) {
-        if ((pulse_context=pa_context_new(pulse_mainloop_api,NULL)) == NULL)
+        pulse_lock();
+
+        if ((pulse_context=pa_context_new(pulse_mainloop_api,NULL)) == NULL) {
+            pulse_unlock();
+            return false;
+        }
+
+        pa_context_set_state_callback(pulse_context,pulse_context_state_cb,NULL);
+
+        pulse_connect_begin = monotonic_clock();
+        pulse_connect_time = 0;
+        if (pa_context_connect(pulse_context, NULL, (pa_context_flags_t)0, NULL) < 0) {
+            pa_context_set_state_callback(pulse_context,NULL,NULL);
+            pa_context_unref(pulse_context);
+            pulse_context = NULL;
+            pulse_unlock();
+            return false;
+        }
+
+        pulse_unlock();
+    }
+
+    return true;
+}
+
+void pulse_close_global(void);
+
+bool pulse_open_global_connect(void) {
+    if (pulse_context == NULL)
+        return false;
+
+    if (!pulse_context_connected) {
+        pa_context_state_t st;
+
+        pulse_lock();
+
+        /* wait for connection. */
+        pulse_deadline_start();
+        do {
+            st = pa_context_get_state(pulse_context);
+            if (st == PA_CONTEXT_READY || st == PA_CONTEXT_FAILED || st == PA_CONTEXT_TERMINATED)
+                break;
+            if (pulse_deadline_hit)
+                break;
+
+            pa_threaded_mainloop_wait(pulse_mainloop);
+        } while(1);
+        pulse_deadline_stop();
+
+        pulse_connect_time = monotonic_clock() - pulse_connect_begin;
+
+        if (st != PA_CONTEXT_READY) {
+            if (st == PA_CONTEXT_FAILED || st == PA_CONTEXT_TERMINATED)
+                fprintf(stderr,"PulseAudio: Unable to connect to server after %lums, %s\n",
+                    (unsigned long)pulse_connect_time,pa_strerror(pa_context_errno(pulse_context)));
+            else
+                fprintf(stderr,"PulseAudio: Timed out after %lums connecting to server\n",(unsigned long)pulse_connect_time);
+
+            pulse_unlock();
+
+            /* start over from scratch next time */
+            pulse_close_global();
             return false;
+        }
+
+        pulse_unlock();
+        pulse_context_connected = true;
     }
 
+    return true;
+}
+
+bool pulse_open_global(void) {
+    if (!pulse_open_global_begin())
+        return false;
+
     if (!pulse_open_global_connect())
         return false;
 
@@ -103,13 +227,17 @@ bool pulse_open_global(void) {
 void pulse_close_global(void) {
     pulse_context_connected = false;
     if (pulse_context != NULL) {
+        pulse_lock();
+        pulse_deadline_stop();
+        pa_context_set_state_callback(pulse_context,NULL,NULL);
         pa_context_disconnect(pulse_context);
         pa_context_unref(pulse_context);
         pulse_context = NULL;
+        pulse_unlock();
     }
     if (pulse_mainloop != NULL) {
-        pa_signal_done();
-        pa_mainloop_free(pulse_mainloop);
+        pa_threaded_mainloop_stop(pulse_mainloop);
+        pa_threaded_mainloop_free(pulse_mainloop);
         pulse_mainloop = NULL;
     }
     pulse_mainloop_api = NULL;
@@ -128,15 +256,69 @@ void pulse_atexit_init(void) {
 
 class AudioSourcePULSE : public AudioSource {
 public:
-    AudioSourcePULSE() : pulse_stream(NULL), bytes_per_frame(0), samples_per_frame(0), isUserOpen(false), pending_data(NULL), pending_data_read(NULL), pending_data_fence(NULL) {
+    AudioSourcePULSE() : pulse_stream(NULL), bytes_per_frame(0), samples_per_frame(0), isUserOpen(false), pulse_out(&pulse_ring), pulse_dropped(&ring_dropped), ring_waited(0), ring_dropped(0), stream_xruns(0), stream_failed(false), stream_time(0), anchor_frame_end(0), anchor_mono_us(0) {
         pasampspec.format = PA_SAMPLE_INVALID;
         chosen_format.bits_per_sample = 0;
         chosen_format.sample_rate = 0;
         chosen_format.format_tag = 0;
         chosen_format.channels = 0;
+        pthread_mutex_init(&ring_mutex,NULL);
+        pthread_cond_init(&ring_cond,NULL);
+
+        /* get the server connection going now, it will be needed shortly */
+        pulse_atexit_init();
+        pulse_open_global_begin();
+    }
+    virtual ~AudioSourcePULSE() {
+        pulse_force_close();
+        pthread_cond_destroy(&ring_cond);
+        pthread_mutex_destroy(&ring_mutex);
     }
-    virtual ~AudioSourcePULSE() { pulse_force_close(); }
 public:
+    virtual int EnumOptions(std::vector<AudioOptionPair> &names) {
+        AudioOptionPair p;
+        char tmp[32];
+
+        names.clear();
+
+        p.name = "timeout_ms";
+        sprintf(tmp,"%u",pulse_timeout_ms);
+        p.value = tmp;
+        names.push_back(p);
+
+        /* how long startup took */
+        if (pulse_context_connected) {
+            p.name = "connect_ms";
+            sprintf(tmp,"%lu",(unsigned long)pulse_connect_time);
+            p.value = tmp;
+            names.push_back(p);
+        }
+        if (pulse_stream != NULL) {
+            p.name = "stream_ms";
+            sprintf(tmp,"%lu",(unsigned long)stream_time);
+            p.value = tmp;
+            names.push_back(p);
+        }
+
+        return 0;
+    }
+    virtual int SetOption(const char *name,const char *value) {
+        if (name == NULL || value == NULL)
+            return -EINVAL;
+
+        if (!strcmp(name,"timeout_ms")) {
+            char *e = NULL;
+            unsigned long v = strtoul(value,&e,10);
+
+            if (e == NULL || *e != 0 || v < 100ul || v > 600000ul)
+                return -EINVAL;
+
+            pulse_timeout_ms = (unsigned int)v;
+            return 0;
+        }
+
+        return -ENOENT;
+    }
     virtual int SelectDevice(const char *str) {
         if (!IsOpen()) {
             std::string sel = (str != NULL && *str != 0) ? str : "";
@@ -207,7 +389,6 @@ public:
         names.push_back(ent);
     }
     virtual int EnumDevices(std::vector<AudioDevicePair> &names) {
-        pa_operation_state past;
         pa_operation *pa;
 
         pulse_atexit_init();
@@ -218,28 +399,33 @@ public:
 
         assert(pulse_context != NULL);
 
+        pulse_lock();
+
         /* audio sources */
         pa = pa_context_get_source_info_list(pulse_context,cb_source,(void*)(&names));
-        if (pa == NULL)
+        if (pa == NULL) {
+            pulse_unlock();
             return -ENOMEM;
+        }
 
-        while ((past=pa_operation_get_state(pa)) == PA_OPERATION_RUNNING)
-            pulse_idle();
-
-        if (past != PA_OPERATION_DONE)
+        if (!pulse_wait_operation(pa,"source list")) {
+            pulse_unlock();
             return -ENODEV;
+        }
 
         /* audio sink inputs */
         pa = pa_context_get_sink_input_info_list(pulse_context,cb_sink_inputs,(void*)(&names));
-        if (pa == NULL)
+        if (pa == NULL) {
+            pulse_unlock();
             return -ENOMEM;
+        }
 
-        while ((past=pa_operation_get_state(pa)) == PA_OPERATION_RUNNING)
-            pulse_idle();
-
-        if (past != PA_OPERATION_DONE)
+        if (!pulse_wait_operation(pa,"sink input list")) {
+            pulse_unlock();
             return -ENODEV;
+        }
 
+        pulse_unlock();
         return 0;
     }
     virtual bool IsOpen(void) { return (pulse_stream != NULL) && isUserOpen; }
@@ -248,7 +434,11 @@ public:
 
     virtual int Open(void) {
         if (!IsOpen()) {
-            if (!pulse_open())
+            /* SetFormat() already set up the stream, corked. Just start it. */
+            if (pulse_stream != NULL && !pulse_uncork())
+                pulse_close();
+
+            if (pulse_stream == NULL && !pulse_open(false))
                 return -1;
 
             isUserOpen = true;
@@ -281,15 +471,17 @@ public:
         if (!format_is_valid(tmp))
             return -EINVAL;
 
+        /* The stream is left connected but corked, so that Open() only has to uncork it
+         * instead of setting up the whole stream again. */
+        pulse_close();
         chosen_format = tmp;
-        if (!pulse_open()) {
+        if (!pulse_open(true)) {
             pulse_close();
             chosen_format.format_tag = 0;
             return -ENODEV;
         }
 
         chosen_format.updateFrameInfo();
-        pulse_close();
         return 0;
     }
     virtual int GetFormat(struct AudioFormat &fmt) {
@@ -316,7 +508,8 @@ public:
         if (!format_is_valid(fmt))
             return -EINVAL;
 
-        if (!pulse_open()) {
+        pulse_close();
+        if (!pulse_open(true)) {
             pulse_close();
             return -ENODEV;
         }
@@ -327,96 +520,229 @@ public:
     }
     virtual int GetAvailable(void) {
         if (IsOpen()) {
-            return 0;
+            return (int)pulse_out->Level();
         }
 
         return 0;
     }
     virtual int Read(void *buffer,unsigned int bytes) {
         if (IsOpen()) {
-            unsigned char *d = (unsigned char*)buffer;
-            int rd = 0,lrd = 0;
+            size_t rd;
 
             bytes -= bytes % chosen_format.bytes_per_frame;
 
-            while (bytes > 0) {
-                assert(pulse_stream != NULL);
+            rd = pulse_out->Read(buffer,bytes);
+            if (rd == 0 && stream_failed)
+                return -EIO;
 
-                if (pending_data == NULL) {
-                    const void *ptr = NULL;
-                    size_t len = 0;
+            return (int)rd;
+        }
 
-                    if (pa_stream_peek(pulse_stream,&ptr,&len) < 0)
-                        return -EIO;
-                    if (ptr == NULL && len == 0)
-                        break;
+        return -EINVAL;
+    }
+    virtual int ReadBegin(const void* &ptr,unsigned int bytes) {
+        ptr = NULL;
 
-                    /* NTS: ptr == NULL and len > 0 if a "hole" */
-                    if (len > 0) {
-                        if (!pending_data_alloc(len))
-                            return -ENOMEM;
+        if (IsOpen()) {
+            const unsigned char *p;
+            size_t len;
 
-                        memcpy(pending_data,ptr,len);
-                    }
+            len = pulse_out->ReadSpan(p);
+            if (len > bytes) len = bytes;
+            len -= len % chosen_format.bytes_per_frame;
+            if (len == 0 && stream_failed)
+                return -EIO;
 
-                    pa_stream_drop(pulse_stream);
-                }
+            ptr = p;
+            return (int)len;
+        }
 
-                if (pending_data != NULL && pending_data_read < pending_data_fence) {
-                    unsigned int proc = (unsigned int)(pending_data_fence - pending_data_read);
-                    if (proc > bytes) proc = bytes;
-                    proc -= proc % chosen_format.bytes_per_frame;
-                    if (proc > 0) {
-                        memcpy(d,pending_data_read,proc);
-                        pending_data_read += proc;
-                        lrd = (int)proc;
-                        rd += (int)proc;
-                        bytes -= proc;
-                        d += proc;
-
-                        assert(pending_data_read <= pending_data_fence);
-                        if (pending_data_read >= pending_data_fence)
-                            pending_data_free();
-                    }
-                    else {
-                        assert(pending_data_read <= pending_data_fence);
-                    }
-                }
+        return -EINVAL;
+    }
+    virtual int ReadEnd(unsigned int bytes) {
+        if (IsOpen()) {
+            pulse_out->ReadCommit(bytes);
+            return 0;
+        }
 
-                if (lrd == 0)
-                    break;
+        return -EINVAL;
+    }
+    virtual int ReadTimestamped(void *buffer,unsigned int bytes,AudioTimestamp &ts) {
+        if (IsOpen()) {
+            const unsigned long long bpf = chosen_format.bytes_per_frame;
+            unsigned long long frame_end;
+            uint64_t mono,age;
+            int rd = 0;
+
+            ts.frame = (unsigned long long)pulse_out->TotalRead() / bpf;
+
+            pthread_mutex_lock(&ring_mutex);
+            frame_end = anchor_frame_end;
+            mono = anchor_mono_us;
+            pthread_mutex_unlock(&ring_mutex);
+
+            if (mono != 0 && frame_end >= ts.frame) {
+                /* count back from the newest frame the server gave us */
+                const uint64_t now_mono = monotonic_clock_us();
+                const uint64_t now_wall = wall_clock_us();
+
+                age = (uint64_t)(((frame_end - ts.frame) * 1000000ull) / (unsigned long long)chosen_format.sample_rate);
+                ts.mono_us = (mono > age) ? (mono - age) : 0;
+                ts.wall_us = (now_mono >= ts.mono_us && now_wall > (now_mono - ts.mono_us)) ? (now_wall - (now_mono - ts.mono_us)) : now_wall;
+            }
+            else {
+                TimestampEstimate(ts,(unsigned long long)pulse_out->Level() / bpf,chosen_format.sample_rate);
             }
 
-            if (rd == 0)
-                pulse_idle();
+            if (bytes != 0)
+                rd = Read(buffer,bytes);
 
             return rd;
         }
 
+        return -EINVAL;
+    }
+    virtual int WaitForData(int timeout_ms) {
+        if (IsOpen()) {
+            struct timespec ts;
+
+            pthread_mutex_lock(&ring_mutex);
+            if (!ring_ready() && !stream_failed && timeout_ms > 0) {
+                clock_gettime(CLOCK_REALTIME,&ts);
+                ts.tv_sec += timeout_ms / 1000;
+                ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000l;
+                if (ts.tv_nsec >= 1000000000l) {
+                    ts.tv_nsec -= 1000000000l;
+                    ts.tv_sec++;
+                }
+
+                pthread_cond_timedwait(&ring_cond,&ring_mutex,&ts);
+            }
+            pthread_mutex_unlock(&ring_mutex);
+
+            if (stream_failed)
+                return -EIO;
+
+            if (!ring_ready())
+                return 0;
+
+            ring_waited = pulse_out->TotalWritten();
+            return 1;
+        }
+
+        return -EINVAL;
+    }
+    virtual unsigned long Xruns(void) {
+        return stream_xruns.load();
+    }
+    /* the read callback copies out of PulseAudio anyway, so it may as well copy into the caller's ring */
+    virtual int SetCaptureRing(AudioRing *ring,std::atomic<unsigned long long> *dropped) {
+        if (IsOpen()) {
+            AudioRing *to = (ring != NULL) ? ring : &pulse_ring;
+
+            pulse_lock();
+
+            /* what came in before goes along, so that the caller gets all of it from the start */
+            if (ring != NULL && pulse_out == &pulse_ring) {
+                const unsigned char *p;
+                size_t len;
+
+                while ((len=pulse_ring.ReadSpan(p)) != 0) {
+                    const size_t wd = to->Write(p,len);
+                    if (wd < len && dropped != NULL) *dropped += (unsigned long long)(len - wd);
+                    pulse_ring.ReadCommit(len);
+                }
+            }
+
+            pulse_out = to;
+            pulse_dropped = (ring != NULL && dropped != NULL) ? dropped : &ring_dropped;
+            ring_waited = to->TotalWritten();
+
+            /* the anchor counts frames in the ring, and is only still right if the audio came along */
+            pthread_mutex_lock(&ring_mutex);
+            anchor_frame_end = (unsigned long long)to->TotalWritten() / (unsigned long long)chosen_format.bytes_per_frame;
+            if (ring == NULL) anchor_mono_us = 0;
+            pthread_mutex_unlock(&ring_mutex);
+
+            pulse_unlock();
+            return 0;
+        }
+
         return -EINVAL;
     }
 private:
-    /* arrrrgh PulseAudio why doesn't your API just allow me to ask for some number of samples? */
-    void pending_data_free(void) {
-        if (pending_data != NULL) {
-            delete[] pending_data;
-            pending_data = NULL;
-        }
-        pending_data_read = NULL;
-        pending_data_fence = NULL;
-    }
-    bool pending_data_alloc(const size_t len) { /* this ASSUMES you've already consumed the existing data! */
-        pending_data_free();
-        if (len != 0) {
-            if (len > (8*1024*1024)) return false;
-            pending_data = new(std::nothrow) unsigned char[len];
-            if (pending_data == NULL) return false;
-            pending_data_read = pending_data;
-            pending_data_fence = pending_data + len;
-            return true;
+    /* something to read, or with SetCaptureRing(), something written since WaitForData() last said so */
+    bool ring_ready(void) {
+        if (pulse_out != &pulse_ring)
+            return pulse_out->TotalWritten() != ring_waited;
+
+        return pulse_out->Level() != 0;
+    }
+    /* mainloop thread: PulseAudio hands us fragments of whatever size it likes, copy them
+     * straight from the peek pointer into the ring so that Read() can take any amount. */
+    static void cb_stream_read(pa_stream *s,size_t nbytes,void *userdata) {
+        AudioSourcePULSE *self = (AudioSourcePULSE*)userdata;
+        const void *ptr;
+        size_t len,wd;
+
+        (void)nbytes;
+        assert(self != NULL);
+
+        do {
+            ptr = NULL;
+            len = 0;
+
+            if (pa_stream_peek(s,&ptr,&len) < 0)
+                break;
+            if (ptr == NULL && len == 0)
+                break;
+
+            /* NTS: ptr == NULL and len > 0 if a "hole" */
+            if (ptr != NULL && len > 0) {
+                wd = self->pulse_out->Write(ptr,len);
+                if (wd < len) *(self->pulse_dropped) += (unsigned long long)(len - wd);
+            }
+            else if (len > 0) {
+                self->stream_xruns++;
+            }
+
+            pa_stream_drop(s);
+        } while (1);
+
+        /* the newest frame in the ring was captured "latency" ago */
+        {
+            pa_usec_t lat = 0;
+            int neg = 0;
+
+            if (pa_stream_get_latency(s,&lat,&neg) < 0 || neg)
+                lat = 0;
+
+            pthread_mutex_lock(&self->ring_mutex);
+            if (self->chosen_format.bytes_per_frame != 0) {
+                self->anchor_frame_end = (unsigned long long)self->pulse_out->TotalWritten() / (unsigned long long)self->chosen_format.bytes_per_frame;
+                self->anchor_mono_us = monotonic_clock_us() - (uint64_t)lat;
+            }
+            pthread_mutex_unlock(&self->ring_mutex);
         }
 
-        return true;
+        self->ring_signal();
+    }
+    static void cb_stream_state(pa_stream *s,void *userdata) {
+        AudioSourcePULSE *self = (AudioSourcePULSE*)userdata;
+        pa_stream_state_t st = pa_stream_get_state(s);
+
+        assert(self != NULL);
+        if (st == PA_STREAM_FAILED || st == PA_STREAM_TERMINATED) {
+            self->stream_failed = true;
+            self->ring_signal();
+        }
+
+        pa_threaded_mainloop_signal(pulse_mainloop,0);
+    }
+    void ring_signal(void) {
+        pthread_mutex_lock(&ring_mutex);
+        pthread_cond_signal(&ring_cond);
+        pthread_mutex_unlock(&ring_mutex);
     }
 private:
     pa_sample_spec              pasampspec;
@@ -426,9 +752,18 @@ private:
     unsigned int                bytes_per_frame;
     unsigned int                samples_per_frame;
     bool                        isUserOpen;
-    unsigned char*              pending_data;
-    unsigned char*              pending_data_read;
-    unsigned char*              pending_data_fence;
+    AudioRing                   pulse_ring;
+    AudioRing*                  pulse_out;          /* pulse_ring, or the one given to SetCaptureRing() */
+    std::atomic<unsigned long long>* pulse_dropped; /* ring_dropped, or the one given to SetCaptureRing() */
+    uint64_t                    ring_waited;        /* pulse_out->TotalWritten() when WaitForData() last returned 1 */
+    std::atomic<unsigned long long> ring_dropped;
+    std::atomic<unsigned long>  stream_xruns;       /* holes in the stream, see Xruns() */
+    std::atomic<bool>           stream_failed;
+    monotonic_clock_t           stream_time;
+    unsigned long long          anchor_frame_end;   /* protected by ring_mutex */
+    uint64_t                    anchor_mono_us;
+    pthread_mutex_t             ring_mutex;
+    pthread_cond_t              ring_cond;
 private:
     bool format_is_valid(const AudioFormat &fmt) {
         if (fmt.sample_rate == 0)
@@ -457,7 +792,19 @@ private:
         Close();
         pulse_close();
     }
-    bool pulse_open(void) { // does NOT start capture
+    bool pulse_uncork(void) {
+        bool ok;
+
+        pulse_lock();
+        ok = pulse_wait_operation(pa_stream_cork(pulse_stream,0,NULL,NULL),"stream uncork");
+        pulse_unlock();
+
+        return ok;
+    }
+    bool pulse_open(bool corked) { // does NOT start capture, unless !corked
+        /* timing updates, so pa_stream_get_latency() can timestamp what we capture */
+        pa_stream_flags_t flags = (pa_stream_flags_t)(PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE | (corked ? PA_STREAM_START_CORKED : PA_STREAM_NOFLAGS));
+        monotonic_clock_t t;
         pa_buffer_attr pba;
 
         pulse_atexit_init();
@@ -502,11 +849,37 @@ private:
         assert(pulse_mainloop != NULL);
         assert(pulse_mainloop_api != NULL);
 
+        t = monotonic_clock();
+        pulse_lock();
+
         if ((pulse_stream=pa_stream_new(pulse_context,"permanentrecord",&pasampspec,NULL)) == NULL) {
+            pulse_unlock();
             pulse_close();
             return false;
         }
 
+        /* one copy from PulseAudio into this, no allocation per fragment */
+        {
+            const size_t bpf = (chosen_format.bits_per_sample / 8u) * (unsigned int)chosen_format.channels;
+
+            if (!pulse_ring.Alloc(bpf * (size_t)chosen_format.sample_rate * 2u)) { /* 2 seconds */
+                pulse_unlock();
+                pulse_close();
+                return false;
+            }
+        }
+
+        pulse_out = &pulse_ring;
+        pulse_dropped = &ring_dropped;
+        ring_waited = 0;
+        ring_dropped = 0;
+        stream_xruns = 0;
+        stream_failed = false;
+        anchor_frame_end = 0;
+        anchor_mono_us = 0;
+        pa_stream_set_state_callback(pulse_stream,cb_stream_state,(void*)this);
+        pa_stream_set_read_callback(pulse_stream,cb_stream_read,(void*)this);
+
         memset(&pba,0,sizeof(pba));
         pba.maxlength = (uint32_t)(-1);
         pba.tlength = (uint32_t)(-1);
@@ -520,51 +893,75 @@ private:
 
             if (pa_stream_set_monitor_stream(pulse_stream,idx) < 0) {
                 fprintf(stderr,"Unable to set monitor stream %d\n",(int)idx);
+                pulse_unlock();
                 pulse_close();
                 return false;
             }
-            if (pa_stream_connect_record(pulse_stream,NULL,&pba,(pa_stream_flags_t)(PA_STREAM_DONT_MOVE | PA_STREAM_ADJUST_LATENCY)) < 0) {
+            if (pa_stream_connect_record(pulse_stream,NULL,&pba,(pa_stream_flags_t)(flags | PA_STREAM_DONT_MOVE | PA_STREAM_ADJUST_LATENCY)) < 0) {
                 fprintf(stderr,"Unable to connect record\n");
+                pulse_unlock();
                 pulse_close();
                 return false;
             }
         }
         else {
-            if (pa_stream_connect_record(pulse_stream,pulse_device_string.empty() ? NULL : pulse_device_string.c_str(),&pba,(pa_stream_flags_t)(PA_STREAM_ADJUST_LATENCY)) < 0) {
+            if (pa_stream_connect_record(pulse_stream,pulse_device_string.empty() ? NULL : pulse_device_string.c_str(),&pba,(pa_stream_flags_t)(flags | PA_STREAM_ADJUST_LATENCY)) < 0) {
+                pulse_unlock();
                 pulse_close();
                 return false;
             }
         }
-        pulse_idle();
 
+        /* the state callback wakes us up */
         {
             pa_stream_state_t st;
 
+            pulse_deadline_start();
             do {
-                pulse_idle();
                 st = pa_stream_get_state(pulse_stream);
-                if (st == PA_STREAM_CREATING) {
-                    usleep(10000);
-                }
-                else if (st == PA_STREAM_READY) {
+                if (st == PA_STREAM_READY || st == PA_STREAM_FAILED || st == PA_STREAM_TERMINATED)
                     break;
-                }
-                else {
-                    pulse_close();
-                    return false;
-                }
+                if (pulse_deadline_hit)
+                    break;
+
+                pa_threaded_mainloop_wait(pulse_mainloop);
             } while (1);
+            pulse_deadline_stop();
+
+            stream_time = monotonic_clock() - t;
+
+            if (st != PA_STREAM_READY) {
+                if (st == PA_STREAM_FAILED || st == PA_STREAM_TERMINATED)
+                    fprintf(stderr,"PulseAudio: Unable to set up record stream after %lums, %s\n",
+                        (unsigned long)stream_time,pa_strerror(pa_context_errno(pulse_context)));
+                else
+                    fprintf(stderr,"PulseAudio: Timed out after %lums setting up record stream\n",(unsigned long)stream_time);
+
+                pulse_unlock();
+                pulse_close();
+                return false;
+            }
         }
 
+        pulse_unlock();
         return true;
     }
     void pulse_close(void) {
-        pending_data_free();
         if (pulse_stream != NULL) {
-            pa_stream_flush(pulse_stream,NULL,NULL);
+            pulse_lock();
+            pa_stream_set_read_callback(pulse_stream,NULL,NULL);
+            pa_stream_set_state_callback(pulse_stream,NULL,NULL);
+            pa_stream_disconnect(pulse_stream);
             pa_stream_unref(pulse_stream);
             pulse_stream = NULL;
+            pulse_unlock();
+
+            if (ring_dropped != 0ull)
+                fprintf(stderr,"PulseAudio: %llu bytes dropped, capture ring was full\n",ring_dropped.load());
         }
+        pulse_out = &pulse_ring;
+        pulse_dropped = &ring_dropped;
+        pulse_ring.Free();
         pasampspec.format = PA_SAMPLE_INVALID;
     }
 };
@@ -573,4 +970,3 @@ AudioSource* AudioSourcePULSE_Alloc(void) {
     return new AudioSourcePULSE();
 }
 #endif
-
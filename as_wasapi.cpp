@@ -253,7 +253,7 @@ public:
         if (wfx->wFormatTag == 0x0001/*WAVE_FORMAT_PCM*/) {
             if (wfx->wBitsPerSample < 8 || wfx->wBitsPerSample > 32)
                 return false;
-            if (wfx->nChannels < 1 || wfx->nChannels > 8)
+            if (wfx->nChannels < 1 || wfx->nChannels > 255) /* uint8_t limit */
                 return false;
             if (wfx->nSamplesPerSec < 1000 || wfx->nSamplesPerSec > 192000)
                 return false;
@@ -275,7 +275,7 @@ public:
             if (!memcmp(&wext->SubFormat,&windows_KSDATAFORMAT_SUBTYPE_PCM,sizeof(GUID))) {
                 if (wfx->wBitsPerSample < 8 || wfx->wBitsPerSample > 32)
                     return false;
-                if (wfx->nChannels < 1 || wfx->nChannels > 8)
+                if (wfx->nChannels < 1 || wfx->nChannels > 255) /* uint8_t limit */
                     return false;
                 if (wfx->nSamplesPerSec < 1000 || wfx->nSamplesPerSec > 192000)
                     return false;
@@ -0,0 +1,1239 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <new>
+#include <deque>
+
+#include "common.h"
+#include "monclock.h"
+#include "asyncout.h"
+
+#if defined(HAVE_PTHREADS) && !defined(_WIN32)
+# define ASYNCOUT_HAVE_THREAD
+#endif
+
+/* io_uring through the raw system calls, so there is no liburing dependency. WRITEV rather
+ * than WRITE so that it works on the first kernels to have io_uring at all (5.1) */
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+# include <linux/io_uring.h>
+# if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#  define ASYNCOUT_HAVE_URING
+# endif
+#endif
+
+#if !defined(_WIN32)
+# include <sys/mman.h>
+# define ASYNCOUT_HAVE_MMAP
+#endif
+
+#define ASYNCOUT_PAGE_SIZE          ((size_t)4096u)
+#define ASYNCOUT_MAX_DEPTH          64u
+#define ASYNCOUT_MMAP_WINDOW        ((size_t)8u * (size_t)1024u * (size_t)1024u) /* at least */
+
+#if defined(HAVE_PTHREADS)
+# define ASYNCOUT_LOCK()            pthread_mutex_lock(&mutex)
+# define ASYNCOUT_UNLOCK()          pthread_mutex_unlock(&mutex)
+#else
+# define ASYNCOUT_LOCK()            do { } while (0)
+# define ASYNCOUT_UNLOCK()          do { } while (0)
+#endif
+
+static unsigned char *asyncout_buffer_alloc(size_t sz) {
+#if defined(_MSC_VER)
+    return (unsigned char*)_aligned_malloc(sz,ASYNCOUT_PAGE_SIZE);
+#else
+    void *p = NULL;
+
+    if (posix_memalign(&p,ASYNCOUT_PAGE_SIZE,sz) != 0)
+        return NULL;
+
+    return (unsigned char*)p;
+#endif
+}
+
+static void asyncout_buffer_free(unsigned char *p) {
+#if defined(_MSC_VER)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static unsigned int asyncout_pool_threads = 2;
+
+#if defined(ASYNCOUT_HAVE_THREAD)
+/* One pool of writer threads for every output. Each job is one buffer at an explicit file
+ * offset, so the order they finish in does not matter. */
+struct asyncout_job {
+    AsyncOutput*            o;
+    unsigned int            slot;
+    int                     fd;
+    const unsigned char*    buf;
+    size_t                  len;
+    off_t                   off;
+};
+
+static pthread_mutex_t                  asyncout_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t                   asyncout_pool_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<asyncout_job>         asyncout_pool_jobs;
+static unsigned int                     asyncout_pool_running = 0;
+
+static void *asyncout_pool_proc(void *arg) {
+    (void)arg;
+
+    while (1) {
+        asyncout_job j;
+        size_t done = 0;
+        int err = 0;
+
+        pthread_mutex_lock(&asyncout_pool_mutex);
+        while (asyncout_pool_jobs.empty())
+            pthread_cond_wait(&asyncout_pool_cond,&asyncout_pool_mutex);
+        j = asyncout_pool_jobs.front();
+        asyncout_pool_jobs.pop_front();
+        pthread_mutex_unlock(&asyncout_pool_mutex);
+
+        while (done < j.len) {
+            const ssize_t wd = pwrite(j.fd,j.buf + done,j.len - done,j.off + (off_t)done);
+
+            if (wd < 0) {
+                if (errno == EINTR) continue;
+                err = -errno;
+                break;
+            }
+            if (wd == 0) {
+                err = -ENOSPC;
+                break;
+            }
+
+            done += (size_t)wd;
+        }
+
+        /* the output may be gone the moment this returns */
+        j.o->_complete(j.slot,err,monotonic_clock_us());
+    }
+
+    return NULL;
+}
+
+/* the threads live as long as the program */
+static bool asyncout_pool_start(void) {
+    bool ok;
+
+    pthread_mutex_lock(&asyncout_pool_mutex);
+    while (asyncout_pool_running < asyncout_pool_threads) {
+        pthread_t t;
+
+        if (pthread_create(&t,NULL,asyncout_pool_proc,NULL) != 0)
+            break;
+
+        pthread_detach(t);
+        asyncout_pool_running++;
+    }
+    ok = (asyncout_pool_running != 0);
+    pthread_mutex_unlock(&asyncout_pool_mutex);
+
+    return ok;
+}
+#endif
+
+#if defined(ASYNCOUT_HAVE_URING)
+struct AsyncOutputRing {
+    int                     fd;
+    unsigned int*           sq_head;
+    unsigned int*           sq_tail;
+    unsigned int*           sq_mask;
+    unsigned int*           sq_array;
+    unsigned int*           cq_head;
+    unsigned int*           cq_tail;
+    unsigned int*           cq_mask;
+    struct io_uring_sqe*    sqes;
+    struct io_uring_cqe*    cqes;
+    void*                   sq_map;
+    void*                   cq_map;
+    size_t                  sq_map_size;
+    size_t                  cq_map_size;
+    size_t                  sqes_size;
+    struct iovec*           iov;                /* one per slot */
+};
+
+static void asyncout_ring_free(AsyncOutputRing *r) {
+    if (r == NULL) return;
+
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes,r->sqes_size);
+    if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+        munmap(r->cq_map,r->cq_map_size);
+    if (r->sq_map != NULL && r->sq_map != MAP_FAILED)
+        munmap(r->sq_map,r->sq_map_size);
+    if (r->fd >= 0)
+        close(r->fd);
+
+    delete[] r->iov;
+    delete r;
+}
+
+/* NULL and errno set if io_uring is not there (old kernel, seccomp, sysctl kernel.io_uring_disabled) */
+static AsyncOutputRing *asyncout_ring_alloc(unsigned int entries) {
+    struct io_uring_params p;
+    AsyncOutputRing *r;
+    int err;
+
+    r = new(std::nothrow) AsyncOutputRing;
+    if (r == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(r,0,sizeof(*r));
+
+    memset(&p,0,sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup,entries,&p);
+    if (r->fd < 0) {
+        err = errno;
+        delete r;
+        errno = err;
+        return NULL;
+    }
+
+    r->sq_map_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+    r->cq_map_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->sq_map_size < r->cq_map_size) r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    r->sq_map = mmap(NULL,r->sq_map_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,(off_t)IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    }
+    else {
+        r->cq_map = mmap(NULL,r->cq_map_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,(off_t)IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) goto fail;
+    }
+
+    r->sqes = (struct io_uring_sqe*)mmap(NULL,r->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,(off_t)IORING_OFF_SQES);
+    if ((void*)r->sqes == MAP_FAILED) goto fail;
+
+    r->sq_head  = (unsigned int*)((unsigned char*)r->sq_map + p.sq_off.head);
+    r->sq_tail  = (unsigned int*)((unsigned char*)r->sq_map + p.sq_off.tail);
+    r->sq_mask  = (unsigned int*)((unsigned char*)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int*)((unsigned char*)r->sq_map + p.sq_off.array);
+    r->cq_head  = (unsigned int*)((unsigned char*)r->cq_map + p.cq_off.head);
+    r->cq_tail  = (unsigned int*)((unsigned char*)r->cq_map + p.cq_off.tail);
+    r->cq_mask  = (unsigned int*)((unsigned char*)r->cq_map + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)((unsigned char*)r->cq_map + p.cq_off.cqes);
+
+    r->iov = new(std::nothrow) struct iovec[entries];
+    if (r->iov == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    return r;
+fail:
+    err = errno;
+    asyncout_ring_free(r);
+    errno = err;
+    return NULL;
+}
+
+static int asyncout_ring_enter(AsyncOutputRing *r,unsigned int submit,unsigned int wait) {
+    while (1) {
+        const long ret = syscall(__NR_io_uring_enter,r->fd,submit,wait,wait != 0u ? (unsigned int)IORING_ENTER_GETEVENTS : 0u,NULL,0);
+
+        if (ret >= 0) return (int)ret;
+        if (errno != EINTR) return -errno;
+    }
+}
+
+/* queue one write of 'len' bytes at file offset 'off', tagged with the slot number */
+static int asyncout_ring_write(AsyncOutputRing *r,int fd,unsigned int slot,unsigned char *buf,size_t len,off_t off) {
+    const unsigned int tail = *r->sq_tail;
+    const unsigned int idx = tail & *r->sq_mask;
+    struct io_uring_sqe *e = &r->sqes[idx];
+
+    r->iov[slot].iov_base = buf;
+    r->iov[slot].iov_len = len;
+
+    memset(e,0,sizeof(*e));
+    e->opcode = (uint8_t)IORING_OP_WRITEV;
+    e->fd = fd;
+    e->addr = (uint64_t)((uintptr_t)(&r->iov[slot]));
+    e->len = 1;
+    e->off = (uint64_t)off;
+    e->user_data = (uint64_t)slot;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail,tail + 1u,__ATOMIC_RELEASE);
+
+    return asyncout_ring_enter(r,1,0);
+}
+#else
+struct AsyncOutputRing {
+    int                     dummy;
+};
+#endif
+
+AsyncOutput::AsyncOutput() : fd(-1), backend(ASYNCOUT_SYNC), buf_size(0), depth(0), slots(NULL), cur(0), cur_len(0), cur_since(0), pos(0), inflight(0), error(0), ring(NULL), wb_every(0), wb_prev(0), wb_next(0), map(NULL), map_off(0), map_start(0) {
+    memset(&stats,0,sizeof(stats));
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&cond,NULL);
+#endif
+}
+
+AsyncOutput::~AsyncOutput() {
+    Close();
+#if defined(HAVE_PTHREADS)
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+/* Start appending to 'fd' at file offset 'pos', which must also be where the file pointer is.
+ * If the backend asked for can't be had, the next one down is used, see Backend(). */
+bool AsyncOutput::Open(int fd,off_t pos,size_t buffer_size,unsigned int depth,int backend) {
+    unsigned int i;
+
+    if (IsOpen() || fd < 0 || buffer_size == 0)
+        return false;
+
+    buffer_size = (buffer_size + ASYNCOUT_PAGE_SIZE - 1u) & (~(ASYNCOUT_PAGE_SIZE - 1u));
+    if (depth < 1u) depth = 1u;
+    if (depth > ASYNCOUT_MAX_DEPTH) depth = ASYNCOUT_MAX_DEPTH;
+    if (backend < 0 || backend >= ASYNCOUT_MAX) backend = ASYNCOUT_SYNC;
+
+    /* one in flight plus one to fill is the least that overlaps anything */
+    if (backend != ASYNCOUT_SYNC && depth < 2u) depth = 2u;
+
+    if (backend == ASYNCOUT_MMAP) {
+#if defined(ASYNCOUT_HAVE_MMAP)
+        if (buffer_size < ASYNCOUT_MMAP_WINDOW) buffer_size = ASYNCOUT_MMAP_WINDOW;
+
+        this->fd = fd;
+        this->backend = backend;
+        this->buf_size = buffer_size;
+        this->depth = 0;
+        this->pos = pos;
+        wb_prev = wb_next = pos;
+        cur = 0;
+        cur_len = 0;
+        cur_since = 0;
+        inflight = 0;
+        error = 0;
+        memset(&stats,0,sizeof(stats));
+
+        if (_map(pos) == 0)
+            return true;
+
+        {
+            static bool warned = false;
+
+            if (!warned) {
+                fprintf(stderr,"Unable to map the output file (%s), writing it normally instead\n",strerror(-error));
+                warned = true;
+            }
+        }
+
+        this->fd = -1;
+#endif
+        backend = ASYNCOUT_SYNC;
+    }
+
+    if (backend == ASYNCOUT_URING) {
+#if defined(ASYNCOUT_HAVE_URING)
+        ring = asyncout_ring_alloc(depth);
+        if (ring == NULL) {
+            static bool warned = false;
+
+            if (!warned) {
+                fprintf(stderr,"io_uring not available (%s), writing from threads instead\n",strerror(errno));
+                warned = true;
+            }
+
+            backend = ASYNCOUT_THREAD;
+        }
+#else
+        backend = ASYNCOUT_THREAD;
+#endif
+    }
+
+    if (backend == ASYNCOUT_THREAD) {
+#if defined(ASYNCOUT_HAVE_THREAD)
+        if (!asyncout_pool_start())
+            backend = ASYNCOUT_SYNC;
+#else
+        backend = ASYNCOUT_SYNC;
+#endif
+    }
+
+    /* write() happens in place, a second buffer would never be used */
+    if (backend == ASYNCOUT_SYNC)
+        depth = 1u;
+
+    slots = new(std::nothrow) AsyncOutputSlot[depth];
+    if (slots == NULL) {
+        _free();
+        return false;
+    }
+    for (i=0;i < depth;i++) {
+        memset(&slots[i],0,sizeof(slots[i]));
+        slots[i].buf = asyncout_buffer_alloc(buffer_size);
+        if (slots[i].buf == NULL) {
+            this->depth = i;
+            _free();
+            return false;
+        }
+    }
+
+    this->fd = fd;
+    this->backend = backend;
+    this->buf_size = buffer_size;
+    this->depth = depth;
+    this->pos = pos;
+    wb_prev = wb_next = pos;
+    cur = 0;
+    cur_len = 0;
+    cur_since = 0;
+    inflight = 0;
+    error = 0;
+    memset(&stats,0,sizeof(stats));
+    return true;
+}
+
+/* write out everything and let go of the buffers. does not close the file descriptor.
+ * Stats() stays valid until the next Open() */
+int AsyncOutput::Close(void) {
+    int r;
+
+    if (!IsOpen())
+        return 0;
+
+    r = Drain();
+#if defined(ASYNCOUT_HAVE_MMAP)
+    if (map != NULL) {
+        _unmap();
+
+        /* the window went past the end of the data, and the file with it */
+        if (ftruncate(fd,pos) < 0 && error == 0) error = -errno;
+        lseek(fd,pos,SEEK_SET);
+        if (r == 0) r = error;
+    }
+#endif
+    _writeback(true);
+    _free();
+    return r;
+}
+
+void AsyncOutput::_free(void) {
+    unsigned int i;
+
+    if (slots != NULL) {
+        for (i=0;i < depth;i++) {
+            if (slots[i].buf != NULL)
+                asyncout_buffer_free(slots[i].buf);
+        }
+
+        delete[] slots;
+        slots = NULL;
+    }
+
+#if defined(ASYNCOUT_HAVE_URING)
+    asyncout_ring_free(ring);
+#endif
+    ring = NULL;
+    fd = -1;
+    cur_len = 0;
+}
+
+bool AsyncOutput::IsOpen(void) const {
+    return (fd >= 0);
+}
+
+/* room left in the current buffer, to put data in directly and then Commit(). At least 'want'
+ * bytes (a whole sample frame, say) unless the buffer is smaller than that: a buffer with less
+ * than that left is sent off, or the mapping moved up, first. */
+unsigned char *AsyncOutput::Reserve(size_t &avail,size_t want) {
+    avail = 0;
+    if (!IsOpen())
+        return NULL;
+    if (want > buf_size)
+        want = buf_size;
+
+    if (backend == ASYNCOUT_MMAP) {
+        if (map == NULL && error != 0)
+            return NULL;
+        if (map == NULL || (pos + (off_t)want) > (map_off + (off_t)buf_size)) {
+            if (_map(pos) < 0) {
+                fprintf(stderr,"Output map error at offset %llu, %s\n",(unsigned long long)pos,strerror(-error));
+                return NULL;
+            }
+        }
+
+        avail = (size_t)((map_off + (off_t)buf_size) - pos);
+        return map + (size_t)(pos - map_off);
+    }
+
+    /* nothing more is written after an error, see Submit() */
+    if (error != 0)
+        return NULL;
+
+    if ((buf_size - cur_len) < want) {
+        if (Submit(false) < 0)
+            return NULL;
+        /* less than a page was carried over, but still not enough room */
+        if ((buf_size - cur_len) < want && Submit(true) < 0)
+            return NULL;
+    }
+
+    avail = buf_size - cur_len;
+    return slots[cur].buf + cur_len;
+}
+
+void AsyncOutput::Commit(size_t len) {
+    if (backend == ASYNCOUT_MMAP) {
+        assert((pos + (off_t)len) <= (map_off + (off_t)buf_size));
+        pos += (off_t)len;
+        return;
+    }
+
+    assert((cur_len + len) <= buf_size);
+    if (len == 0) return;
+
+    if (cur_len == 0) cur_since = monotonic_clock_us();
+    cur_len += len;
+    pos += (off_t)len;
+}
+
+/* returns 0, or the first write error so far */
+int AsyncOutput::Append(const void *buf,size_t len) {
+    const unsigned char *s = (const unsigned char*)buf;
+
+    while (len > 0) {
+        size_t avail;
+        unsigned char *d = Reserve(avail);
+
+        if (d == NULL) return error != 0 ? error : -EINVAL;
+        if (avail > len) avail = len;
+
+        memcpy(d,s,avail);
+        Commit(avail);
+        len -= avail;
+        s += avail;
+    }
+
+    return error;
+}
+
+/* Hand the current buffer to the backend and move on to a free one. Unless 'all', only up to the
+ * last page boundary in the file goes, and the rest (less than a page) is carried over, so that
+ * the writes stay page aligned.
+ *
+ * After a write error nothing more is issued and the error is returned from then on. Part of a
+ * failed buffer may be in the file already, and the file pointer past it, so writing that buffer
+ * again (or anything after it) would put data in the file twice or in the wrong place. */
+int AsyncOutput::Submit(bool all) {
+    unsigned int next;
+    size_t todo,rest;
+    int r;
+
+    if (!IsOpen())
+        return -EINVAL;
+    if (error != 0 || cur_len == 0)
+        return error;
+
+    todo = cur_len;
+    if (!all) {
+        const off_t start = pos - (off_t)cur_len;
+        const off_t end = pos & (~((off_t)ASYNCOUT_PAGE_SIZE - (off_t)1));
+
+        if (end <= start)
+            return error;
+
+        todo = (size_t)(end - start);
+    }
+
+    {
+        AsyncOutputSlot &s = slots[cur];
+
+        s.len = todo;
+        s.done = 0;
+        s.off = pos - (off_t)cur_len;
+    }
+
+    if ((r=_issue(cur)) < 0)
+        return r;
+    if ((r=_acquire(next)) < 0)
+        return r;
+
+    /* the backend only reads the part being written, so the tail can be copied out while it works */
+    rest = cur_len - todo;
+    if (rest != 0) {
+        if (next == cur)
+            memmove(slots[cur].buf,slots[cur].buf + todo,rest);
+        else
+            memcpy(slots[next].buf,slots[cur].buf + todo,rest);
+
+        cur_since = monotonic_clock_us();
+    }
+
+    cur = next;
+    cur_len = rest;
+
+    _writeback(false);
+    return error;
+}
+
+/* Submit(true) if the oldest byte buffered has been waiting at least 'ms' */
+int AsyncOutput::SubmitIfOlder(unsigned int ms) {
+    if (!IsOpen())
+        return -EINVAL;
+
+    _reap(false);
+    _writeback(false);
+
+    if (cur_len != 0 && (monotonic_clock_us() - cur_since) >= ((uint64_t)ms * (uint64_t)1000u))
+        return Submit(true);
+
+    return error;
+}
+
+/* Recorded audio is written once and not read again, but it sits in the page cache anyway,
+ * pushing out everything else, until the kernel decides to write back a big burst of it all at
+ * once, stalling whoever is writing at the time. So every wb_every bytes, start write-back on
+ * what was written since the last time, then wait for the range before that (which has had a
+ * whole interval to get to the disk) and drop it from the page cache. */
+void AsyncOutput::SetWriteback(size_t every) {
+    wb_every = every;
+}
+
+/* everything before this file offset has been written */
+off_t AsyncOutput::_written(void) {
+    off_t r = pos - (off_t)cur_len;
+    unsigned int i;
+
+    /* the window is still being written through, only what is before it is done with */
+    if (map != NULL)
+        return map_off;
+
+    ASYNCOUT_LOCK();
+    for (i=0;i < depth;i++) {
+        if (slots[i].busy && r > slots[i].off)
+            r = slots[i].off;
+    }
+    ASYNCOUT_UNLOCK();
+
+    return r;
+}
+
+void AsyncOutput::_writeback(bool final) {
+    off_t upto;
+
+    if (wb_every == 0 || !IsOpen())
+        return;
+
+    upto = _written();
+    if (!final && (upto - wb_next) < (off_t)wb_every)
+        return;
+
+#if defined(HAVE_SYNC_FILE_RANGE)
+    if (upto > wb_next)
+        sync_file_range(fd,wb_next,upto - wb_next,SYNC_FILE_RANGE_WRITE);
+#endif
+
+    /* on close, everything is waited for and dropped */
+    if (final) wb_next = upto;
+
+    if (wb_next > wb_prev) {
+        const uint64_t t0 = monotonic_clock_us();
+        uint64_t t;
+
+#if defined(HAVE_SYNC_FILE_RANGE)
+        sync_file_range(fd,wb_prev,wb_next - wb_prev,SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+        t = monotonic_clock_us() - t0;
+#if defined(HAVE_POSIX_FADVISE)
+        posix_fadvise(fd,wb_prev,wb_next - wb_prev,POSIX_FADV_DONTNEED);
+#endif
+
+        stats.wb_ranges++;
+        stats.wb_wait_us += t;
+        if (stats.wb_wait_max_us < t) stats.wb_wait_max_us = t;
+    }
+
+    wb_prev = wb_next;
+    wb_next = upto;
+}
+
+/* write out everything and wait for it */
+int AsyncOutput::Drain(void) {
+    if (!IsOpen())
+        return error;
+
+    Submit(true);
+
+    ASYNCOUT_LOCK();
+    while (inflight != 0u) {
+#if defined(ASYNCOUT_HAVE_URING)
+        if (backend == ASYNCOUT_URING) {
+            ASYNCOUT_UNLOCK();
+            const int r = _reap(true);
+            ASYNCOUT_LOCK();
+            if (r < 0) break;
+            continue;
+        }
+#endif
+#if defined(ASYNCOUT_HAVE_THREAD)
+        pthread_cond_wait(&cond,&mutex);
+#else
+        break;
+#endif
+    }
+    ASYNCOUT_UNLOCK();
+
+    return error;
+}
+
+/* Map the window starting at the page 'at' is in, letting go of the last one. The file is first
+ * made long enough to cover it: storing to a page of a mapping past the end of the file is
+ * SIGBUS, not an error return. Close() cuts it back down to what was actually written. */
+int AsyncOutput::_map(off_t at) {
+#if defined(ASYNCOUT_HAVE_MMAP)
+    const off_t base = at & (~((off_t)ASYNCOUT_PAGE_SIZE - (off_t)1));
+    const uint64_t t0 = monotonic_clock_us();
+    struct stat st;
+    uint64_t t;
+    void *p;
+
+    _unmap();
+
+    if (fstat(fd,&st) < 0)
+        goto fail;
+    if (st.st_size < (base + (off_t)buf_size)) {
+        /* allocate it for real where possible, so that running out of disk space is an error here
+         * instead of a SIGBUS later on. Only a filesystem that can't do that at all gets a sparse
+         * file instead, a full disk (or quota) is an error */
+# if defined(HAVE_FALLOCATE)
+        if (fallocate(fd,0,st.st_size,(base + (off_t)buf_size) - st.st_size) < 0) {
+            if (!(errno == EOPNOTSUPP || errno == ENOSYS))
+                goto fail;
+            if (ftruncate(fd,base + (off_t)buf_size) < 0)
+                goto fail;
+        }
+# else
+        if (ftruncate(fd,base + (off_t)buf_size) < 0)
+            goto fail;
+# endif
+    }
+
+    p = mmap(NULL,buf_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,base);
+    if (p == MAP_FAILED)
+        goto fail;
+
+# if defined(MADV_SEQUENTIAL)
+    madvise(p,buf_size,MADV_SEQUENTIAL);
+# endif
+
+    map = (unsigned char*)p;
+    map_off = base;
+    map_start = at;
+
+    /* each window counts as one write, the time to get it as its latency */
+    t = monotonic_clock_us() - t0;
+    stats.latency_us += t;
+    if (stats.latency_max_us < t) stats.latency_max_us = t;
+    stats.depth_max = 1;
+
+    _writeback(false);
+    return 0;
+fail:
+    if (error == 0) error = -errno;
+    return error;
+#else
+    (void)at;
+    return -ENOSYS;
+#endif
+}
+
+void AsyncOutput::_unmap(void) {
+#if defined(ASYNCOUT_HAVE_MMAP)
+    if (map == NULL)
+        return;
+
+    munmap(map,buf_size);
+    map = NULL;
+
+    stats.writes++;
+    stats.bytes += (unsigned long long)(pos - map_start);
+#endif
+}
+
+/* a free buffer to fill next, waiting for one if they are all in flight */
+int AsyncOutput::_acquire(unsigned int &slot) {
+    uint64_t t0 = 0;
+    unsigned int i;
+
+    while (1) {
+        _reap(false);
+
+        ASYNCOUT_LOCK();
+        for (i=0;i < depth;i++) {
+            const unsigned int s = (cur + 1u + i) % depth;
+
+            if (!slots[s].busy) {
+                slot = s;
+                break;
+            }
+        }
+        ASYNCOUT_UNLOCK();
+
+        if (i < depth)
+            break;
+
+        if (t0 == 0) t0 = monotonic_clock_us();
+
+#if defined(ASYNCOUT_HAVE_URING)
+        if (backend == ASYNCOUT_URING) {
+            const int r = _reap(true);
+            if (r < 0) return r;
+            continue;
+        }
+#endif
+#if defined(ASYNCOUT_HAVE_THREAD)
+        ASYNCOUT_LOCK();
+        while (inflight == depth)
+            pthread_cond_wait(&cond,&mutex);
+        ASYNCOUT_UNLOCK();
+#else
+        return -EIO; /* can't happen, sync never leaves anything in flight */
+#endif
+    }
+
+    if (t0 != 0) {
+        stats.stalls++;
+        stats.stall_us += monotonic_clock_us() - t0;
+    }
+
+    return 0;
+}
+
+int AsyncOutput::_issue(unsigned int slot) {
+    AsyncOutputSlot &s = slots[slot];
+
+    ASYNCOUT_LOCK();
+    s.busy = true;
+    s.submit_us = monotonic_clock_us();
+    if (++inflight > stats.depth_max) stats.depth_max = inflight;
+    ASYNCOUT_UNLOCK();
+
+#if defined(ASYNCOUT_HAVE_URING)
+    if (backend == ASYNCOUT_URING) {
+        const int ret = asyncout_ring_write(ring,fd,slot,s.buf,s.len,s.off);
+
+        if (ret < 0) {
+            _complete(slot,ret,monotonic_clock_us());
+            return ret;
+        }
+
+        return 0;
+    }
+#endif
+#if defined(ASYNCOUT_HAVE_THREAD)
+    if (backend == ASYNCOUT_THREAD) {
+        asyncout_job j;
+
+        j.o = this;
+        j.slot = slot;
+        j.fd = fd;
+        j.buf = s.buf;
+        j.len = s.len;
+        j.off = s.off;
+
+        pthread_mutex_lock(&asyncout_pool_mutex);
+        asyncout_pool_jobs.push_back(j);
+        pthread_cond_signal(&asyncout_pool_cond);
+        pthread_mutex_unlock(&asyncout_pool_mutex);
+        return 0;
+    }
+#endif
+
+    /* sync: the file pointer is always at s.off, since everything is written in order */
+    {
+        int err = 0;
+
+        while (s.done < s.len) {
+            const int wd = (int)write(fd,s.buf + s.done,(unsigned int)(s.len - s.done));
+
+            if (wd < 0) {
+                if (errno == EINTR) continue;
+                err = -errno;
+                break;
+            }
+            if (wd == 0) {
+                err = -ENOSPC;
+                break;
+            }
+
+            s.done += (size_t)wd;
+        }
+
+        _complete(slot,err,monotonic_clock_us());
+        return err;
+    }
+}
+
+/* collect io_uring completions, waiting for at least one if 'wait' */
+int AsyncOutput::_reap(bool wait) {
+#if defined(ASYNCOUT_HAVE_URING)
+    AsyncOutputRing *r = ring;
+    unsigned int head,tail;
+
+    if (backend != ASYNCOUT_URING || r == NULL)
+        return 0;
+
+    if (wait) {
+        const int ret = asyncout_ring_enter(r,0,1);
+        if (ret < 0) return ret;
+    }
+
+    head = *r->cq_head;
+    while (head != (tail=__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE))) {
+        while (head != tail) {
+            const struct io_uring_cqe *c = &r->cqes[head & *r->cq_mask];
+            const unsigned int slot = (unsigned int)c->user_data;
+            const int res = c->res;
+
+            head++;
+            __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+
+            if (slot >= depth)
+                continue;
+
+            AsyncOutputSlot &s = slots[slot];
+
+            if (res < 0) {
+                _complete(slot,res,monotonic_clock_us());
+            }
+            else if (res == 0) {
+                _complete(slot,-ENOSPC,monotonic_clock_us());
+            }
+            else {
+                s.done += (size_t)res;
+                if (s.done >= s.len) {
+                    _complete(slot,0,monotonic_clock_us());
+                }
+                else if (error != 0) {
+                    /* short write, but another one failed already, and nothing more goes out */
+                    _complete(slot,-EIO,monotonic_clock_us());
+                }
+                else {
+                    /* short write, send the rest. it stays busy and in flight */
+                    const int ret = asyncout_ring_write(r,fd,slot,s.buf + s.done,s.len - s.done,s.off + (off_t)s.done);
+
+                    if (ret < 0)
+                        _complete(slot,ret,monotonic_clock_us());
+                }
+            }
+        }
+    }
+#else
+    (void)wait;
+#endif
+
+    return 0;
+}
+
+/* a write finished, or failed. called from the thread pool for ASYNCOUT_THREAD */
+void AsyncOutput::_complete(unsigned int slot,int err,uint64_t now) {
+    AsyncOutputSlot &s = slots[slot];
+    const uint64_t lat = now - s.submit_us;
+
+    ASYNCOUT_LOCK();
+    s.busy = false;
+    if (inflight != 0u) inflight--;
+
+    stats.writes++;
+    stats.latency_us += lat;
+    if (stats.latency_max_us < lat) stats.latency_max_us = lat;
+
+    if (err < 0) {
+        if (error == 0) {
+            fprintf(stderr,"Output write error at offset %llu, %s\n",(unsigned long long)s.off,strerror(-err));
+            error = err;
+        }
+    }
+    else {
+        stats.bytes += (unsigned long long)s.len;
+    }
+
+#if defined(HAVE_PTHREADS)
+    pthread_cond_broadcast(&cond);
+#endif
+    ASYNCOUT_UNLOCK();
+}
+
+/* file offset after the last byte appended, written out or not */
+off_t AsyncOutput::Position(void) const {
+    return pos;
+}
+
+int AsyncOutput::Backend(void) const {
+    return backend;
+}
+
+int AsyncOutput::Error(void) const {
+    return error;
+}
+
+const AsyncOutputStats &AsyncOutput::Stats(void) const {
+    return stats;
+}
+
+std::string AsyncOutput::StatsString(void) const {
+    std::string r;
+    char tmp[320];
+
+    snprintf(tmp,sizeof(tmp),"%s, %llu writes averaging %.1fKB, up to %u in flight, latency %.3fms average %.3fms max, waited for a buffer %llu times (%.3fms)",
+        BackendName(backend),
+        stats.writes,
+        stats.writes != 0ull ? ((double)stats.bytes / (double)stats.writes) / 1024.0 : 0.0,
+        stats.depth_max,
+        stats.writes != 0ull ? ((double)stats.latency_us / (double)stats.writes) / 1000.0 : 0.0,
+        (double)stats.latency_max_us / 1000.0,
+        stats.stalls,
+        (double)stats.stall_us / 1000.0);
+    r = tmp;
+
+    if (stats.wb_ranges != 0ull) {
+        snprintf(tmp,sizeof(tmp),", write-back every %.1fMB waited %.3fms average %.3fms max",
+            (double)wb_every / (1024.0 * 1024.0),
+            ((double)stats.wb_wait_us / (double)stats.wb_ranges) / 1000.0,
+            (double)stats.wb_wait_max_us / 1000.0);
+        r += tmp;
+    }
+
+    return r;
+}
+
+const char *AsyncOutput::BackendName(int b) {
+    switch (b) {
+        case ASYNCOUT_SYNC:     return "sync";
+        case ASYNCOUT_THREAD:   return "thread";
+        case ASYNCOUT_URING:    return "uring";
+        case ASYNCOUT_MMAP:     return "mmap";
+        default:                break;
+    }
+
+    return "?";
+}
+
+/* -1 if not recognized */
+int AsyncOutput::BackendParse(const char *s) {
+    int b;
+
+    for (b=0;b < ASYNCOUT_MAX;b++) {
+        if (!strcmp(s,BackendName(b)))
+            return b;
+    }
+
+    return -1;
+}
+
+/* size of the thread pool, before the first output using it is opened */
+void AsyncOutput::SetThreads(unsigned int n) {
+    if (n < 1u) n = 1u;
+    if (n > 16u) n = 16u;
+    asyncout_pool_threads = n;
+}
+
+/* Reserve disk space for the 'len' bytes at 'pos' without changing the file size, so that the
+ * filesystem can lay the file out in one piece instead of a few blocks at a time as it grows.
+ * -ENOSYS or -EOPNOTSUPP if the platform or filesystem can't, which is not an error as such. */
+int asyncout_preallocate(int fd,off_t pos,off_t len) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    if (len <= 0)
+        return 0;
+    if (fallocate(fd,FALLOC_FL_KEEP_SIZE,pos,len) < 0)
+        return -errno;
+
+    return 0;
+#else
+    (void)fd;
+    (void)pos;
+    (void)len;
+    return -ENOSYS;
+#endif
+}
+
+/* give back whatever asyncout_preallocate() reserved past the end of the file */
+int asyncout_preallocate_trim(int fd) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    struct stat st;
+
+    if (fstat(fd,&st) < 0)
+        return -errno;
+
+    /* truncating to the size it already is drops the blocks past the end. punching a hole
+     * there does not: ext4 quietly ignores anything past the end of the file */
+    if (ftruncate(fd,st.st_size) < 0)
+        return -errno;
+
+    return 0;
+#else
+    (void)fd;
+    return -ENOSYS;
+#endif
+}
+
+#if defined(ASYNCOUT_HAVE_THREAD)
+/* something else keeping the disk busy: big writes, each one forced out to the disk */
+static volatile bool asyncout_load_stop = false;
+
+static void *asyncout_load_proc(void *arg) {
+    const int fd = *((int*)arg);
+    unsigned char *buf = new(std::nothrow) unsigned char[1024u*1024u];
+    off_t o = 0;
+
+    if (buf == NULL) return NULL;
+    memset(buf,0x55,1024u*1024u);
+
+    while (!asyncout_load_stop) {
+        if (pwrite(fd,buf,1024u*1024u,o) <= 0) break;
+        fdatasync(fd);
+
+        o += (off_t)(1024u*1024u);
+        if (o >= (off_t)(256u*1024u*1024u)) {
+            ftruncate(fd,0);
+            o = 0;
+        }
+    }
+
+    delete[] buf;
+    return NULL;
+}
+#endif
+
+/* Append 'megabytes' in 4KB pieces, as the recorder does, through each backend, first on an
+ * idle disk then (with threads) with another thread hammering it. What matters for recording
+ * is the worst time a single append spends blocked, more than the throughput. */
+void asyncout_benchmark(unsigned long megabytes,unsigned int depth,size_t buffer_size,size_t writeback) {
+    const char *path = "permrec_iobench.tmp";
+    const size_t chunk = 4096;
+    unsigned char *data;
+    unsigned int pass;
+
+    data = new(std::nothrow) unsigned char[chunk];
+    if (data == NULL) return;
+    for (size_t i=0;i < chunk;i++) data[i] = (unsigned char)(i * 7u);
+
+    printf("Output benchmark: %luMB in %uKB appends, %uKB buffers, depth %u, in the current directory\n",
+        megabytes,(unsigned int)(chunk / 1024u),(unsigned int)(buffer_size / 1024u),depth);
+
+    for (pass=0;pass < 2;pass++) {
+#if defined(ASYNCOUT_HAVE_THREAD)
+        const char *load_path = "permrec_iobench_load.tmp";
+        pthread_t load_thread;
+        int load_fd = -1;
+
+        if (pass == 1) {
+            load_fd = open(load_path,O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0644);
+            if (load_fd < 0) break;
+
+            asyncout_load_stop = false;
+            if (pthread_create(&load_thread,NULL,asyncout_load_proc,&load_fd) != 0) {
+                close(load_fd);
+                unlink(load_path);
+                break;
+            }
+
+            printf("  with the disk loaded by a thread doing 1MB writes + fdatasync:\n");
+        }
+        else {
+            printf("  idle disk:\n");
+        }
+#else
+        if (pass == 1) break;
+#endif
+
+        for (int b=0;b < ASYNCOUT_MAX;b++) {
+            const unsigned long long total = (unsigned long long)megabytes * 1024ull * 1024ull;
+            uint64_t t0,t1,t2,worst = 0,in_append = 0;
+            unsigned long long done = 0;
+            AsyncOutput o;
+            int fd;
+
+            fd = open(path,O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0644);
+            if (fd < 0) {
+                fprintf(stderr,"Unable to open %s, %s\n",path,strerror(errno));
+                break;
+            }
+
+            o.SetWriteback(writeback);
+            if (!o.Open(fd,0,buffer_size,depth,b) || o.Backend() != b) {
+                printf("    %-7s not available\n",AsyncOutput::BackendName(b));
+                o.Close();
+                close(fd);
+                continue;
+            }
+
+            t0 = monotonic_clock_us();
+            while (done < total) {
+                const uint64_t a = monotonic_clock_us();
+                const int r = o.Append(data,chunk);
+                const uint64_t d = monotonic_clock_us() - a;
+
+                if (r < 0) break;
+                in_append += d;
+                if (worst < d) worst = d;
+                done += chunk;
+            }
+            t1 = monotonic_clock_us();
+            o.Close();
+            t2 = monotonic_clock_us();
+
+            printf("    %-7s %8.1f MB/s, append blocked %.3fms worst %.3fus average, drain %.3fms\n",
+                AsyncOutput::BackendName(b),
+                ((double)done / (1024.0 * 1024.0)) / ((double)(t2 - t0) / 1000000.0),
+                (double)worst / 1000.0,
+                done != 0ull ? (double)in_append / ((double)done / (double)chunk) : 0.0,
+                (double)(t2 - t1) / 1000.0);
+            printf("            %s\n",o.StatsString().c_str());
+
+            close(fd);
+            unlink(path);
+        }
+
+#if defined(ASYNCOUT_HAVE_THREAD)
+        if (pass == 1) {
+            asyncout_load_stop = true;
+            pthread_join(load_thread,NULL);
+            close(load_fd);
+            unlink(load_path);
+        }
+#endif
+    }
+
+    delete[] data;
+}
+
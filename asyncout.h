@@ -0,0 +1,124 @@
+#ifndef __ASYNCOUT_H
+#define __ASYNCOUT_H
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <string>
+
+#if defined(HAVE_PTHREADS)
+# include <pthread.h>
+#endif
+
+/* Buffered, optionally asynchronous, append-only file output.
+ *
+ * Data is collected in page aligned buffers of a fixed size. A full buffer is handed to the
+ * backend and the caller carries on filling the next one, so with "thread" or "uring" the
+ * thread that produces the data only waits on the disk if every buffer is still in flight.
+ * With "mmap" there are no buffers at all: the file is mapped a window at a time and the data
+ * goes straight into the page cache. The file descriptor belongs to the caller, who must not
+ * touch the file between Open() and Drain()/Close() except to read what Position() says is there. */
+
+enum {
+    ASYNCOUT_SYNC=0,            /* write() on the calling thread */
+    ASYNCOUT_THREAD,            /* pwrite() on a small pool of threads shared by all outputs */
+    ASYNCOUT_URING,             /* io_uring, completions reaped by the calling thread */
+    ASYNCOUT_MMAP,              /* written into a shared mapping of the file, a window at a time */
+
+    ASYNCOUT_MAX
+};
+
+struct AsyncOutputStats {
+    unsigned long long          writes;             /* writes completed */
+    unsigned long long          bytes;              /* bytes written */
+    unsigned long long          stalls;             /* times the caller had to wait for a buffer */
+    uint64_t                    stall_us;           /* total time spent waiting for one */
+    uint64_t                    latency_us;         /* total time from submit to completion */
+    uint64_t                    latency_max_us;
+    unsigned int                depth_max;          /* most writes in flight at once */
+    unsigned long long          wb_ranges;          /* ranges written back and dropped from the page cache */
+    uint64_t                    wb_wait_us;         /* total time waiting for write-back to finish */
+    uint64_t                    wb_wait_max_us;
+};
+
+struct AsyncOutputSlot {
+    unsigned char*              buf;
+    size_t                      len;                /* bytes to write */
+    size_t                      done;               /* bytes written so far */
+    off_t                       off;                /* file offset of buf[0] */
+    uint64_t                    submit_us;
+    bool                        busy;               /* submitted, not completed */
+};
+
+struct AsyncOutputRing;
+
+class AsyncOutput {
+public:
+    AsyncOutput();
+    ~AsyncOutput();
+public:
+    bool Open(int fd,off_t pos,size_t buffer_size,unsigned int depth,int backend);
+    int Close(void);
+    bool IsOpen(void) const;
+    unsigned char *Reserve(size_t &avail,size_t want=1);
+    void Commit(size_t len);
+    int Append(const void *buf,size_t len);
+    int Submit(bool all);
+    int SubmitIfOlder(unsigned int ms);
+    int Drain(void);
+    off_t Position(void) const;
+    int Backend(void) const;
+    int Error(void) const;
+    const AsyncOutputStats &Stats(void) const;
+    std::string StatsString(void) const;
+    void SetWriteback(size_t every);
+public:
+    static const char *BackendName(int b);
+    static int BackendParse(const char *s);
+    static void SetThreads(unsigned int n);
+public: /* backend use only */
+    void _complete(unsigned int slot,int err,uint64_t now);
+private:
+    int _acquire(unsigned int &slot);
+    int _issue(unsigned int slot);
+    int _reap(bool wait);
+    off_t _written(void);
+    void _writeback(bool final);
+    void _free(void);
+    int _map(off_t at);
+    void _unmap(void);
+private:
+    int                         fd;
+    int                         backend;
+    size_t                      buf_size;
+    unsigned int                depth;
+    AsyncOutputSlot*            slots;
+    unsigned int                cur;                /* slot being filled */
+    size_t                      cur_len;
+    uint64_t                    cur_since;          /* when the first byte went into it */
+    off_t                       pos;                /* file offset after the last byte appended */
+    unsigned int                inflight;
+    int                         error;              /* first write error, -errno */
+    AsyncOutputStats            stats;
+    AsyncOutputRing*            ring;
+    size_t                      wb_every;           /* write back and drop from the page cache every this many bytes, 0 = never */
+    off_t                       wb_prev;            /* write-back started on wb_prev...wb_next, still to wait for and drop */
+    off_t                       wb_next;
+    unsigned char*              map;                /* ASYNCOUT_MMAP: the window, buf_size bytes from file offset map_off */
+    off_t                       map_off;
+    off_t                       map_start;          /* where data went into the window from, for the stats */
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_t             mutex;              /* slot state, shared with the thread pool */
+    pthread_cond_t              cond;
+#endif
+};
+
+void asyncout_benchmark(unsigned long megabytes,unsigned int depth,size_t buffer_size,size_t writeback);
+
+int asyncout_preallocate(int fd,off_t pos,off_t len);
+int asyncout_preallocate_trim(int fd);
+
+#endif //__ASYNCOUT_H
+
@@ -0,0 +1,380 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <deque>
+
+#include "common.h"
+#include "monclock.h"
+#include "asyncwav.h"
+
+#if defined(HAVE_PTHREADS)
+/* most a pool thread hands a writer at once, before going on to the next writer */
+#define ASYNCWAV_CHUNK              ((size_t)65536u)
+
+static unsigned int asyncwav_pool_threads = 0; /* 0 = one per CPU */
+
+/* One pool of encoder threads for every writer. A writer with something to do is queued once,
+ * a thread takes it, does one piece of work, and queues it again at the back if there is more. */
+static pthread_mutex_t                  asyncwav_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t                   asyncwav_pool_cond = PTHREAD_COND_INITIALIZER;     /* a writer was queued */
+static pthread_cond_t                   asyncwav_pool_done = PTHREAD_COND_INITIALIZER;     /* a piece of work was done */
+static std::deque<AsyncWAVWriter*>      asyncwav_pool_jobs;
+static unsigned int                     asyncwav_pool_running = 0;
+
+AsyncWAVWriter::AsyncWAVWriter(WAVWriter *w,const AudioFormat &fmt,size_t queue_bytes) : WAVWriter(), w(w), queue_bytes(queue_bytes),
+    bytes_per_frame(fmt.bytes_per_frame), sample_rate(fmt.sample_rate), open(false), queued(false), busy(false), continue_from(NULL), continue_to(NULL), handing(NULL),
+    finishing(false), error(0), bytes_in(0), encode_us(0), level_max(0), waits(0), wait_us(0) {
+    if (this->bytes_per_frame == 0) this->bytes_per_frame = 1;
+
+    /* whole frames, so that every span the ring hands out is too */
+    this->queue_bytes -= this->queue_bytes % this->bytes_per_frame;
+    if (this->queue_bytes < ((size_t)this->bytes_per_frame * (size_t)1024u))
+        this->queue_bytes = (size_t)this->bytes_per_frame * (size_t)1024u;
+}
+
+AsyncWAVWriter::~AsyncWAVWriter() {
+    Close();
+    delete w;
+    w = NULL;
+}
+
+/* size of the thread pool, before the first writer is opened */
+void AsyncWAVWriter::SetThreads(unsigned int n) {
+    if (n > 64u) n = 64u;
+    asyncwav_pool_threads = n;
+}
+
+/* the threads live as long as the program */
+bool AsyncWAVWriter::_pool_start(void) {
+    unsigned int want = asyncwav_pool_threads;
+    bool ok;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+    if (want == 0u) {
+        const long n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n > 0) want = (n > 64l) ? 64u : (unsigned int)n;
+    }
+#endif
+    if (want == 0u) want = 2u;
+
+    pthread_mutex_lock(&asyncwav_pool_mutex);
+    while (asyncwav_pool_running < want) {
+        pthread_t t;
+
+        if (pthread_create(&t,NULL,_pool_proc,NULL) != 0)
+            break;
+
+        pthread_detach(t);
+        asyncwav_pool_running++;
+    }
+    ok = (asyncwav_pool_running != 0);
+    pthread_mutex_unlock(&asyncwav_pool_mutex);
+
+    return ok;
+}
+
+void *AsyncWAVWriter::_pool_proc(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&asyncwav_pool_mutex);
+    while (1) {
+        AsyncWAVWriter *a,*prev;
+        bool took;
+
+        while (asyncwav_pool_jobs.empty())
+            pthread_cond_wait(&asyncwav_pool_cond,&asyncwav_pool_mutex);
+        a = asyncwav_pool_jobs.front();
+        asyncwav_pool_jobs.pop_front();
+        a->queued = false;
+        a->busy = true;
+        prev = a->continue_from;
+        pthread_mutex_unlock(&asyncwav_pool_mutex);
+
+        took = a->_step(prev);
+
+        pthread_mutex_lock(&asyncwav_pool_mutex);
+        /* all of it under the mutex, and 'finishing' last: once that is false the recorder may
+         * close and delete 'prev', and its Close() waits for continue_to to be cleared first */
+        if (prev != NULL) {
+            prev->continue_to = NULL;
+            a->continue_from = NULL;
+            if (took) {
+                a->handing = prev;
+                a->_check_handoff();
+            }
+            else {
+                prev->finishing = false;
+            }
+        }
+        a->busy = false;
+        a->_schedule();
+
+        /* the one taking the encoder over from this one can go ahead now */
+        if (a->continue_to != NULL && a->_idle())
+            a->continue_to->_schedule();
+
+        pthread_cond_broadcast(&asyncwav_pool_done);
+    }
+
+    return NULL;
+}
+
+/* pool mutex held: something a pool thread can do right now */
+bool AsyncWAVWriter::_has_work(void) const {
+    if (continue_from != NULL)
+        return continue_from->_idle();
+
+    return ring.Level() != 0 && error == 0;
+}
+
+/* pool mutex held: nothing left that the wrapped writer will be handed */
+bool AsyncWAVWriter::_idle(void) const {
+    return !queued && !busy && continue_from == NULL && (ring.Level() == 0 || error != 0);
+}
+
+/* pool mutex held: queue for a pool thread, if there is anything to do and it isn't already */
+void AsyncWAVWriter::_schedule(void) {
+    if (open && !queued && !busy && _has_work()) {
+        queued = true;
+        asyncwav_pool_jobs.push_back(this);
+        pthread_cond_signal(&asyncwav_pool_cond);
+    }
+}
+
+/* pool thread: take the encoder over from 'prev' (true if it was), or else hand the writer the
+ * next piece. 'prev' is left for _pool_proc() to let go of, under the pool mutex */
+bool AsyncWAVWriter::_step(AsyncWAVWriter *prev) {
+    if (prev != NULL)
+        return w->ContinueFrom(*prev->w);
+
+    const unsigned char *p;
+    size_t len = ring.ReadSpan(p);
+
+    if (len > ASYNCWAV_CHUNK) len = ASYNCWAV_CHUNK - (ASYNCWAV_CHUNK % bytes_per_frame);
+
+    const uint64_t t0 = monotonic_clock_us();
+    const int r = w->Write(p,(unsigned int)len);
+    encode_us += monotonic_clock_us() - t0;
+
+    ring.ReadCommit(len);
+
+    if (r != (int)len) {
+        fprintf(stderr,"Encoder thread: write error\n");
+        error = r < 0 ? r : -EIO;
+    }
+
+    _check_handoff();
+    return false;
+}
+
+bool AsyncWAVWriter::Open(const std::string &path) {
+    if (IsOpen())
+        return true;
+    if (w == NULL)
+        return false;
+
+    if (!_pool_start()) {
+        fprintf(stderr,"Unable to start encoder threads\n");
+        return false;
+    }
+
+    if (!ring.Alloc(queue_bytes)) {
+        fprintf(stderr,"Unable to allocate encoder queue\n");
+        return false;
+    }
+
+    if (!w->Open(path)) {
+        ring.Free();
+        return false;
+    }
+
+    queued = false;
+    busy = false;
+    continue_from = NULL;
+    continue_to = NULL;
+    handing = NULL;
+    error = 0;
+    bytes_in = 0;
+    encode_us = 0;
+    level_max = 0;
+    waits = 0;
+    wait_us = 0;
+
+    open = true;
+    return true;
+}
+
+/* everything queued goes to the writer first, then it is closed */
+void AsyncWAVWriter::Close(void) {
+    if (open) {
+        pthread_mutex_lock(&asyncwav_pool_mutex);
+        _schedule();
+        /* and until the next writer is done taking the encoder over, it still uses this one */
+        while (!_idle() || continue_to != NULL)
+            pthread_cond_wait(&asyncwav_pool_done,&asyncwav_pool_mutex);
+        open = false;
+        pthread_mutex_unlock(&asyncwav_pool_mutex);
+    }
+
+    if (w != NULL)
+        w->Close();
+
+    /* closing the encoder finished off the last of what the previous file was owed */
+    if (handing != NULL) {
+        handing->finishing = false;
+        handing = NULL;
+    }
+
+    ring.Free();
+}
+
+bool AsyncWAVWriter::SetFormat(const AudioFormat &fmt) {
+    if (IsOpen() || w == NULL) return false;
+    if (!w->SetFormat(fmt)) return false;
+
+    bytes_per_frame = fmt.bytes_per_frame;
+    sample_rate = fmt.sample_rate;
+    return true;
+}
+
+bool AsyncWAVWriter::IsOpen(void) const {
+    return open;
+}
+
+void AsyncWAVWriter::SetComment(const std::string &str) {
+    if (w != NULL) w->SetComment(str);
+}
+
+/* whole frames only. Returns len, or the first error the writer had on a pool thread */
+int AsyncWAVWriter::Write(const void *buffer,unsigned int len) {
+    const unsigned char *s = (const unsigned char*)buffer;
+    const unsigned int total = len;
+
+    if (!IsOpen())
+        return -EINVAL;
+    if (error != 0)
+        return error;
+
+    while (len > 0) {
+        const size_t wd = ring.Write(s,len);
+
+        if (wd != 0) {
+            s += wd;
+            len -= (unsigned int)wd;
+
+            pthread_mutex_lock(&asyncwav_pool_mutex);
+            _schedule();
+            pthread_mutex_unlock(&asyncwav_pool_mutex);
+        }
+
+        {
+            const size_t lv = ring.Level();
+            if (level_max < lv) level_max = lv;
+        }
+
+        if (len > 0) {
+            const uint64_t t0 = monotonic_clock_us();
+
+            pthread_mutex_lock(&asyncwav_pool_mutex);
+            while (ring.Space() < (size_t)bytes_per_frame && error == 0) {
+                _schedule();
+                pthread_cond_wait(&asyncwav_pool_done,&asyncwav_pool_mutex);
+            }
+            pthread_mutex_unlock(&asyncwav_pool_mutex);
+
+            waits++;
+            wait_us += monotonic_clock_us() - t0;
+
+            if (error != 0)
+                return error;
+        }
+    }
+
+    bytes_in += (unsigned long long)total;
+    return (int)total;
+}
+
+/* The encoder is taken over on a pool thread, once everything queued for the previous writer has
+ * been written out, so that neither the recording thread nor the cut waits on that. */
+bool AsyncWAVWriter::ContinueFrom(WAVWriter &p) {
+    AsyncWAVWriter *prev = dynamic_cast<AsyncWAVWriter*>(&p);
+
+    if (prev == NULL || prev == this || !IsOpen() || !prev->IsOpen() || bytes_in != 0ull)
+        return false;
+
+    pthread_mutex_lock(&asyncwav_pool_mutex);
+    if (continue_from != NULL || prev->continue_to != NULL) {
+        pthread_mutex_unlock(&asyncwav_pool_mutex);
+        return false;
+    }
+    prev->finishing = true;
+    prev->continue_to = this;
+    continue_from = prev;
+    _schedule();
+    pthread_mutex_unlock(&asyncwav_pool_mutex);
+
+    return true;
+}
+
+/* until the encoder, now with the next writer, is done with this file */
+bool AsyncWAVWriter::Finishing(void) const {
+    return finishing;
+}
+
+std::string AsyncWAVWriter::OutputStats(void) const {
+    if (w == NULL) return std::string();
+    return w->OutputStats();
+}
+
+std::string AsyncWAVWriter::EncoderStats(void) const {
+    const double audio_s = (double)bytes_in / ((double)bytes_per_frame * (double)sample_rate);
+    const double enc_s = (double)encode_us / 1000000.0;
+    char tmp[256];
+
+    if (bytes_in == 0ull)
+        return std::string();
+
+    snprintf(tmp,sizeof(tmp),"%.1fx realtime (%.3fs for %.3fs of audio), queue peak %.1f%% of %lu bytes, recording waited for room %llu times (%.3fms)",
+        enc_s > 0.0 ? audio_s / enc_s : 0.0,
+        enc_s,
+        audio_s,
+        queue_bytes != 0 ? ((double)level_max * 100.0) / (double)queue_bytes : 0.0,
+        (unsigned long)queue_bytes,
+        waits,
+        (double)wait_us / 1000.0);
+
+    return std::string(tmp);
+}
+
+/* how full the queue is, in percent */
+unsigned int AsyncWAVWriter::Backlog(void) const {
+    const size_t sz = ring.Size();
+
+    if (sz == 0) return 0;
+    return (unsigned int)(((unsigned long long)ring.Level() * 100ull) / (unsigned long long)sz);
+}
+
+/* the previous file can be let go once its writer says the encoder owes it nothing more */
+void AsyncWAVWriter::_check_handoff(void) {
+    if (handing != NULL && !handing->w->Finishing()) {
+        handing->finishing = false;
+        handing = NULL;
+    }
+}
+#endif
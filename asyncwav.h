@@ -0,0 +1,73 @@
+#ifndef __ASYNCWAV_H
+#define __ASYNCWAV_H
+
+#include "config.h"
+#include "wavstruc.h"
+#include "wavwrite.h"
+#include "audring.h"
+
+#if defined(HAVE_PTHREADS)
+#include <pthread.h>
+
+#include <atomic>
+
+/* Runs another writer (an encoder, usually) on a pool of encoder threads shared by all of them.
+ *
+ * Write() only copies the PCM into a queue and returns. A pool thread then hands it to the wrapped
+ * writer's Write(), a piece at a time and one writer after another, so that 32 outputs don't need
+ * 32 threads and one writer is never on two threads at once. If the encoder falls so far behind
+ * that the queue fills up, Write() waits for room, which holds up the recording thread but not the
+ * capture thread, which has a ring of its own. Backlog() says how full it is, so the recorder can
+ * complain well before that. */
+class AsyncWAVWriter : public WAVWriter {
+public:
+    AsyncWAVWriter(WAVWriter *w,const AudioFormat &fmt,size_t queue_bytes);
+    virtual ~AsyncWAVWriter();
+public:
+    static void SetThreads(unsigned int n);
+public:
+    virtual bool Open(const std::string &path);
+    virtual void Close(void);
+    virtual bool SetFormat(const AudioFormat &fmt);
+    virtual bool IsOpen(void) const;
+    virtual int Write(const void *buffer,unsigned int len);
+    virtual void SetComment(const std::string &str);
+    virtual bool ContinueFrom(WAVWriter &prev);
+    virtual bool Finishing(void) const;
+    virtual std::string OutputStats(void) const;
+    virtual std::string EncoderStats(void) const;
+    virtual unsigned int Backlog(void) const;
+private:
+    static void *_pool_proc(void *arg);
+    static bool _pool_start(void);
+    bool _has_work(void) const;
+    bool _idle(void) const;
+    void _schedule(void);
+    bool _step(AsyncWAVWriter *prev);
+    void _check_handoff(void);
+private:
+    WAVWriter*          w;                  /* the writer doing the work, owned */
+    AudioRing           ring;
+    size_t              queue_bytes;
+    unsigned int        bytes_per_frame;
+    unsigned long       sample_rate;
+    bool                open;
+    /* the rest is under the pool mutex, and only changed by the pool threads */
+    bool                queued;             /* waiting for a pool thread */
+    bool                busy;               /* a pool thread is in _step() */
+    AsyncWAVWriter*     continue_from;      /* take the encoder over from this one first, once it is idle */
+    AsyncWAVWriter*     continue_to;        /* the one waiting for this one to be idle */
+    AsyncWAVWriter*     handing;            /* took it over from this one, which is still owed data */
+    std::atomic<bool>   finishing;
+    std::atomic<int>    error;              /* first error from w->Write(), -errno */
+private: /* per file */
+    unsigned long long  bytes_in;
+    uint64_t            encode_us;          /* time spent in w->Write() */
+    size_t              level_max;
+    unsigned long long  waits;              /* times Write() had to wait for room */
+    uint64_t            wait_us;
+};
+#endif
+
+#endif //__ASYNCWAV_H
+
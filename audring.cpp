@@ -0,0 +1,163 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <new>
+
+#include "common.h"
+#include "audring.h"
+
+AudioRing::AudioRing() : buffer(NULL), size(0), head(0), tail(0) {
+}
+
+AudioRing::~AudioRing() {
+    Free();
+}
+
+bool AudioRing::Alloc(size_t sz) {
+    Free();
+
+    if (sz == 0)
+        return false;
+
+    buffer = new(std::nothrow) unsigned char[sz];
+    if (buffer == NULL)
+        return false;
+
+    size = sz;
+    Reset();
+    return true;
+}
+
+void AudioRing::Free(void) {
+    if (buffer != NULL) {
+        delete[] buffer;
+        buffer = NULL;
+    }
+    size = 0;
+    Reset();
+}
+
+/* NTS: Only when neither the producer or consumer are running! */
+void AudioRing::Reset(void) {
+    head.store(0,std::memory_order_relaxed);
+    tail.store(0,std::memory_order_relaxed);
+}
+
+size_t AudioRing::Size(void) const {
+    return size;
+}
+
+size_t AudioRing::Level(void) const {
+    const uint64_t t = tail.load(std::memory_order_acquire);
+    const uint64_t h = head.load(std::memory_order_acquire);
+    return (size_t)(h - t);
+}
+
+size_t AudioRing::Space(void) const {
+    return size - Level();
+}
+
+uint64_t AudioRing::TotalWritten(void) const {
+    return head.load(std::memory_order_acquire);
+}
+
+uint64_t AudioRing::TotalRead(void) const {
+    return tail.load(std::memory_order_acquire);
+}
+
+/* producer: how much can be written contiguously at ptr */
+size_t AudioRing::WriteSpan(unsigned char* &ptr) {
+    const uint64_t h = head.load(std::memory_order_relaxed);
+    const uint64_t t = tail.load(std::memory_order_acquire);
+    const size_t ofs = (size_t)(h % (uint64_t)size);
+    size_t len = size - (size_t)(h - t);
+
+    if (len > (size - ofs))
+        len = size - ofs;
+
+    ptr = buffer + ofs;
+    return len;
+}
+
+void AudioRing::WriteCommit(size_t len) {
+    const uint64_t h = head.load(std::memory_order_relaxed);
+    assert((size_t)(h - tail.load(std::memory_order_acquire)) + len <= size);
+    head.store(h + (uint64_t)len,std::memory_order_release);
+}
+
+size_t AudioRing::Write(const void *src,size_t len) {
+    const unsigned char *s = (const unsigned char*)src;
+    size_t wd = 0;
+
+    while (len > 0) {
+        unsigned char *d;
+        size_t cando = WriteSpan(d);
+        if (cando == 0) break;
+        if (cando > len) cando = len;
+
+        memcpy(d,s,cando);
+        WriteCommit(cando);
+        wd += cando;
+        len -= cando;
+        s += cando;
+    }
+
+    return wd;
+}
+
+/* consumer: how much can be read contiguously at ptr */
+size_t AudioRing::ReadSpan(const unsigned char* &ptr) {
+    const uint64_t t = tail.load(std::memory_order_relaxed);
+    const uint64_t h = head.load(std::memory_order_acquire);
+    const size_t ofs = (size_t)(t % (uint64_t)size);
+    size_t len = (size_t)(h - t);
+
+    if (len > (size - ofs))
+        len = size - ofs;
+
+    ptr = buffer + ofs;
+    return len;
+}
+
+void AudioRing::ReadCommit(size_t len) {
+    const uint64_t t = tail.load(std::memory_order_relaxed);
+    assert(len <= (size_t)(head.load(std::memory_order_acquire) - t));
+    tail.store(t + (uint64_t)len,std::memory_order_release);
+}
+
+size_t AudioRing::Read(void *dst,size_t len) {
+    unsigned char *d = (unsigned char*)dst;
+    size_t rd = 0;
+
+    while (len > 0) {
+        const unsigned char *s;
+        size_t cando = ReadSpan(s);
+        if (cando == 0) break;
+        if (cando > len) cando = len;
+
+        memcpy(d,s,cando);
+        ReadCommit(cando);
+        rd += cando;
+        len -= cando;
+        d += cando;
+    }
+
+    return rd;
+}
+
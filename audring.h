@@ -0,0 +1,52 @@
+#ifndef __AUDRING_H
+#define __AUDRING_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/* Lock-free single producer / single consumer byte ring.
+ *
+ * One thread (the producer) writes, one thread (the consumer) reads. Neither side
+ * ever blocks or takes a lock. The buffer is allocated once up front, and both sides
+ * can work directly in the ring memory through the Span/Commit pairs to avoid an
+ * extra copy. Positions are running byte counts, so the fill level is always
+ * head - tail without any ambiguity between full and empty.
+ *
+ * If the ring size is a multiple of the audio frame size, and all commits are too,
+ * then every span the ring hands out is frame aligned as well. */
+class AudioRing {
+public:
+                        AudioRing();
+                        ~AudioRing();
+public:
+    bool                Alloc(size_t sz);
+    void                Free(void);
+    void                Reset(void);
+    size_t              Size(void) const;
+    size_t              Level(void) const;
+    size_t              Space(void) const;
+    uint64_t            TotalWritten(void) const;
+    uint64_t            TotalRead(void) const;
+public: /* producer side */
+    size_t              WriteSpan(unsigned char* &ptr);
+    void                WriteCommit(size_t len);
+    size_t              Write(const void *src,size_t len);
+public: /* consumer side */
+    size_t              ReadSpan(const unsigned char* &ptr);
+    void                ReadCommit(size_t len);
+    size_t              Read(void *dst,size_t len);
+private:
+    unsigned char*      buffer;
+    size_t              size;
+    std::atomic<uint64_t> head;                /* total bytes written */
+    /* keep producer and consumer positions on separate cache lines. padding, not alignas(),
+     * so that classes holding an AudioRing can still be allocated with plain new */
+    unsigned char         pad[64];
+    std::atomic<uint64_t> tail;                /* total bytes read */
+};
+
+#endif //__AUDRING_H
+
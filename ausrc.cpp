@@ -17,9 +17,12 @@
 #include <time.h>
 #include <math.h>
 
+#include "common.h"
+#include "monclock.h"
+#include "aufmt.h"
 #include "ausrc.h"
 
-AudioSource::AudioSource() {
+AudioSource::AudioSource() : timestamp_frames(0) {
 }
 
 AudioSource::~AudioSource() {
@@ -83,6 +86,100 @@ int AudioSource::Read(void *buffer,unsigned int bytes) {
     return -ENOSPC;
 }
 
+/* Block until there is something to Read(), or until timeout_ms has passed.
+ * Returns 1 if data is (probably) ready, 0 on timeout, or negative errno on error.
+ * Sources that cannot wait on the device just sleep a little, like the old polling loop did. */
+int AudioSource::WaitForData(int timeout_ms) {
+    if (timeout_ms > 10) timeout_ms = 10;
+    if (timeout_ms > 0) usleep((unsigned int)timeout_ms * 1000u);
+    return 1;
+}
+
+/* Zero-copy read. ReadBegin() points ptr at up to "bytes" of captured audio in the
+ * source's own buffer and returns how many bytes are there (0 if none), then ReadEnd()
+ * releases however many of those bytes were consumed. Returns -ENOSPC if the source
+ * cannot do this, in which case use Read(). */
+int AudioSource::ReadBegin(const void* &ptr,unsigned int bytes) {
+    (void)bytes;
+    ptr = NULL;
+    return -ENOSPC;
+}
+
+int AudioSource::ReadEnd(unsigned int bytes) {
+    (void)bytes;
+    return -ENOSPC;
+}
+
+/* Read(), and say when the first frame returned was captured. With bytes == 0 this just
+ * timestamps the next frame to be read. Sources that know better override this; the
+ * default guesses from the clock and how much audio is still waiting in the source. */
+int AudioSource::ReadTimestamped(void *buffer,unsigned int bytes,AudioTimestamp &ts) {
+    AudioFormat fmt;
+    int avail,rd = 0;
+
+    if (GetFormat(fmt) < 0 || fmt.bytes_per_frame == 0 || fmt.sample_rate == 0)
+        return -EINVAL;
+
+    if (bytes != 0) {
+        rd = Read(buffer,bytes);
+        if (rd < 0) return rd;
+    }
+
+    avail = GetAvailable();
+    if (avail < 0) avail = 0;
+
+    /* what we just read, plus what is still waiting, was captured before now */
+    TimestampEstimate(ts,(unsigned long long)((unsigned int)rd + (unsigned int)avail) / (unsigned long long)fmt.bytes_per_frame,fmt.sample_rate);
+    ts.frame = timestamp_frames;
+    timestamp_frames += (unsigned long long)((unsigned int)rd / fmt.bytes_per_frame);
+    return rd;
+}
+
+/* Start together with 'master', for devices that run off the same clock, so that the same
+ * frame number is the same moment on all of them. Call before either is opened, then Open()
+ * the master first. The first WaitForData() on any of them starts them all. Returns -ENOSPC
+ * if the source cannot do this. */
+int AudioSource::Link(AudioSource *master) {
+    (void)master;
+    return -ENOSPC;
+}
+
+/* after Open(), whether it really was started together with the master given to Link().
+ * Link() only asks for it, the device may still refuse when it is opened */
+bool AudioSource::IsLinked(void) {
+    return false;
+}
+
+/* how many times since Open() the source itself lost audio (an overrun in the driver, a hole
+ * in the stream). The frame count does not move past what was lost, so a caller timing the
+ * audio by frame count has to start over. Dropped bytes counted by SetCaptureRing() are not
+ * included, the caller already knows about those */
+unsigned long AudioSource::Xruns(void) {
+    return 0;
+}
+
+/* For a source that captures on a thread of its own into a buffer of its own: write into 'ring'
+ * instead, for a caller that would only copy it from that buffer into 'ring' anyway. After Open(),
+ * and only from the thread that would otherwise read. Audio that doesn't fit is dropped and added
+ * to 'dropped'. Until SetCaptureRing(NULL,NULL) the caller reads the ring, not Read(), but
+ * ReadTimestamped(NULL,0,ts) still gives the time of the next frame to be read from it, and
+ * WaitForData() waits for more to be written. Returns -ENOSPC if the source cannot do this. */
+int AudioSource::SetCaptureRing(AudioRing *ring,std::atomic<unsigned long long> *dropped) {
+    (void)dropped;
+    (void)ring;
+    return -ENOSPC;
+}
+
+/* fill in the capture time of a frame that has frames_buffered frames (itself included) after it */
+void AudioSource::TimestampEstimate(AudioTimestamp &ts,unsigned long long frames_buffered,unsigned int sample_rate) {
+    const uint64_t mono = monotonic_clock_us();
+    const uint64_t wall = wall_clock_us();
+    const uint64_t age = (uint64_t)((frames_buffered * 1000000ull) / (unsigned long long)sample_rate);
+
+    ts.mono_us = (mono > age) ? (mono - age) : 0;
+    ts.wall_us = (wall > age) ? (wall - age) : 0;
+}
+
 const char *AudioSource::GetSourceName(void) {
     return "baseclass";
 }
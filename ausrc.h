@@ -5,6 +5,17 @@
 #include "common.h"
 #include "audev.h"
 
+#include <atomic>
+
+class AudioRing;
+
+/* When a block of audio was captured, and where it sits in the stream */
+struct AudioTimestamp {
+    unsigned long long  frame;          /* frames returned by this source before this block */
+    uint64_t            mono_us;        /* monotonic_clock_us() when the first frame of the block was captured */
+    uint64_t            wall_us;        /* same moment on the wall clock (wall_clock_us()) */
+};
+
 class AudioSource {
 public:
                         AudioSource();
@@ -22,8 +33,19 @@ public:
     virtual bool        IsOpen(void);
     virtual int         GetAvailable(void);
     virtual int         Read(void *buffer,unsigned int bytes);
+    virtual int         WaitForData(int timeout_ms);
+    virtual int         ReadBegin(const void* &ptr,unsigned int bytes);
+    virtual int         ReadEnd(unsigned int bytes);
+    virtual int         ReadTimestamped(void *buffer,unsigned int bytes,AudioTimestamp &ts);
+    virtual int         Link(AudioSource *master);
+    virtual bool        IsLinked(void);
+    virtual unsigned long Xruns(void);
+    virtual int         SetCaptureRing(AudioRing *ring,std::atomic<unsigned long long> *dropped);
     virtual const char* GetSourceName(void);
     virtual const char* GetDeviceName(void);
+protected:
+    void                TimestampEstimate(AudioTimestamp &ts,unsigned long long frames_buffered,unsigned int sample_rate);
+    unsigned long long  timestamp_frames;
 };
 
 #endif //__AUSRC_H
@@ -32,15 +32,40 @@ time_t cut_interval = (time_t)60 * (time_t)60; // 1 hour, on the hour
 time_t next_auto_cut = 0;
 
 void compute_auto_cut(void) {
-    time_t now = time(NULL);
-    struct tm *tmnow = localtime(&now);
-    if (tmnow == NULL) return;
+    compute_auto_cut(next_auto_cut);
+}
+
+void compute_auto_cut(time_t &next) {
+    compute_auto_cut_from(next,time(NULL));
+}
+
+void compute_auto_cut_from(time_t now) {
+    compute_auto_cut_from(next_auto_cut,now);
+}
+
+/* next cut strictly after 'now' */
+void compute_auto_cut_from(time_t &next,time_t now) {
+    const time_t t = auto_cut_after(now);
+
+    if (t != (time_t)0)
+        next = t;
+}
+
+/* when the cut after 'now' will be, without changing next_auto_cut. 0 if unknown */
+time_t auto_cut_after(time_t now) {
+#if defined(WIN32)
+    struct tm *tmnow = localtime(&now); /* per-thread in the MS C runtime */
+#else
+    struct tm tmbuf; /* segment threads ask, for preallocation */
+    struct tm *tmnow = localtime_r(&now,&tmbuf);
+#endif
+    if (tmnow == NULL) return (time_t)0;
     struct tm tmday = *tmnow;
     tmday.tm_hour = 0;
     tmday.tm_min = 0;
     tmday.tm_sec = 0;
     time_t daystart = mktime(&tmday);
-    if (daystart == (time_t)-1) return;
+    if (daystart == (time_t)-1) return (time_t)0;
 
     if (now < daystart) {
         fprintf(stderr,"mktime() problem with start of day\n");
@@ -51,15 +76,40 @@ void compute_auto_cut(void) {
     delta -= delta % cut_interval;
     delta += cut_interval;
 
-    next_auto_cut = daystart + delta;
+    return daystart + delta;
 }
 
 bool time_to_auto_cut(void) {
+    return time_to_auto_cut(next_auto_cut);
+}
+
+bool time_to_auto_cut(time_t next) {
     time_t now = time(NULL);
 
-    if (next_auto_cut != (time_t)0 && now >= next_auto_cut)
+    if (next != (time_t)0 && now >= next)
         return true;
 
     return false;
 }
 
+bool auto_cut_frame(unsigned long long &cut,unsigned long long frame,uint64_t wall_us,double rate) {
+    return auto_cut_frame(next_auto_cut,cut,frame,wall_us,rate);
+}
+
+/* Which frame is the first one captured at or after the next cut, given that 'frame' was captured
+ * at 'wall_us' and frames arrive at 'rate' per second. Cutting the audio at exactly that frame
+ * lets each file start on the intended sample, instead of whenever time() happened to be polled. */
+bool auto_cut_frame(time_t next,unsigned long long &cut,unsigned long long frame,uint64_t wall_us,double rate) {
+    if (next == (time_t)0 || rate <= 0)
+        return false;
+
+    const int64_t d = ((int64_t)next * (int64_t)1000000) - (int64_t)wall_us;
+
+    if (d <= 0)
+        cut = frame;
+    else
+        cut = frame + (unsigned long long)ceil(((double)d * rate) / 1000000.0);
+
+    return true;
+}
+
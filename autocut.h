@@ -1,10 +1,20 @@
 
 #include <time.h>
+#include <stdint.h>
 
 extern time_t cut_interval;
 
 extern time_t next_auto_cut;
 
 void compute_auto_cut(void);
+void compute_auto_cut_from(time_t now);
+time_t auto_cut_after(time_t now);
 bool time_to_auto_cut(void);
+bool auto_cut_frame(unsigned long long &cut,unsigned long long frame,uint64_t wall_us,double rate);
+
+/* the same, for a caller that keeps its own next cut instead of next_auto_cut */
+void compute_auto_cut(time_t &next);
+void compute_auto_cut_from(time_t &next,time_t now);
+bool time_to_auto_cut(time_t next);
+bool auto_cut_frame(time_t next,unsigned long long &cut,unsigned long long frame,uint64_t wall_us,double rate);
 
@@ -0,0 +1,138 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include "common.h"
+#include "drift.h"
+
+/* no point reporting a rate until the window covers this much time, timestamp jitter dominates before then */
+static const double drift_min_span = 10.0;
+
+ClockDriftEstimator::ClockDriftEstimator() : nominal_rate(0), window_seconds(600) {
+}
+
+void ClockDriftEstimator::Reset(void) {
+    points.clear();
+}
+
+void ClockDriftEstimator::SetNominalRate(unsigned long rate) {
+    if (nominal_rate != rate) {
+        nominal_rate = rate;
+        Reset();
+    }
+}
+
+void ClockDriftEstimator::SetWindow(unsigned int seconds) {
+    if (seconds < 30) seconds = 30;
+    window_seconds = seconds;
+}
+
+void ClockDriftEstimator::Add(unsigned long long frame,uint64_t mono_us) {
+    if (nominal_rate == 0)
+        return;
+
+    if (!points.empty()) {
+        const point &last = points.back();
+
+        /* time or frames going backwards means the source restarted */
+        if (mono_us < last.mono_us || frame < last.frame) {
+            Reset();
+        }
+        else {
+            const uint64_t dt = mono_us - last.mono_us;
+
+            /* one point per second is plenty */
+            if (dt < (uint64_t)1000000u)
+                return;
+
+            /* A real clock is off by tens of ppm, not tenths of a percent. Anything further off
+             * than that plus a few ms of timestamp jitter is lost or repeated audio, not drift.
+             * Losses the capture side knows about (overflow, xrun) Reset() directly, this only
+             * catches what nobody reported. */
+            const double expect = ((double)dt * (double)nominal_rate) / 1000000.0;
+            const double got = (double)(frame - last.frame);
+
+            if (fabs(got - expect) > ((double)nominal_rate / 200.0) + (expect / 1000.0))
+                Reset();
+        }
+    }
+
+    point p;
+    p.frame = frame;
+    p.mono_us = mono_us;
+    points.push_back(p);
+
+    while (points.size() > 2 && (points.back().mono_us - points.front().mono_us) > ((uint64_t)window_seconds * (uint64_t)1000000u))
+        points.pop_front();
+}
+
+double ClockDriftEstimator::Span(void) const {
+    if (points.size() < 2)
+        return 0;
+
+    return (double)(points.back().mono_us - points.front().mono_us) / 1000000.0;
+}
+
+bool ClockDriftEstimator::IsValid(void) const {
+    return nominal_rate != 0 && points.size() >= 3 && Span() >= drift_min_span;
+}
+
+/* least squares slope of frames over seconds. Work relative to the first point so the
+ * running frame count and microsecond clock don't eat the precision of a double. */
+double ClockDriftEstimator::Rate(void) const {
+    if (!IsValid())
+        return (double)nominal_rate;
+
+    const point &first = points.front();
+    const double n = (double)points.size();
+    double sx = 0,sy = 0;
+
+    for (std::deque<point>::const_iterator i=points.begin();i!=points.end();i++) {
+        sx += (double)(i->mono_us - first.mono_us) / 1000000.0;
+        sy += (double)(i->frame - first.frame);
+    }
+
+    const double mx = sx / n;
+    const double my = sy / n;
+    double sxx = 0,sxy = 0;
+
+    for (std::deque<point>::const_iterator i=points.begin();i!=points.end();i++) {
+        const double x = ((double)(i->mono_us - first.mono_us) / 1000000.0) - mx;
+        const double y = (double)(i->frame - first.frame) - my;
+
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    if (sxx <= 0)
+        return (double)nominal_rate;
+
+    return sxy / sxx;
+}
+
+double ClockDriftEstimator::PPM(void) const {
+    return RatePPM(Rate(),nominal_rate);
+}
+
+double ClockDriftEstimator::RatePPM(double rate,unsigned long nominal) {
+    if (nominal == 0)
+        return 0;
+
+    return ((rate - (double)nominal) * 1000000.0) / (double)nominal;
+}
+
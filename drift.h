@@ -0,0 +1,42 @@
+#ifndef __DRIFT_H
+#define __DRIFT_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <deque>
+
+/* Sound card clock vs. system clock.
+ *
+ * Fed with (frame number, monotonic time) pairs as audio arrives, this fits a straight line
+ * through the last few minutes of them and reports the rate the card is really running at.
+ * One point is kept per second of monotonic time, so memory use is fixed by the window length
+ * no matter how often the source hands us audio. A jump in the frame count that cannot be
+ * explained by clock drift (xrun, dropped audio, device restart) restarts the window. */
+class ClockDriftEstimator {
+public:
+                        ClockDriftEstimator();
+public:
+    void                Reset(void);
+    void                SetNominalRate(unsigned long rate);
+    void                SetWindow(unsigned int seconds);
+    void                Add(unsigned long long frame,uint64_t mono_us);
+    bool                IsValid(void) const;
+    double              Rate(void) const;           /* effective frames per second */
+    double              PPM(void) const;            /* deviation from nominal rate, parts per million */
+    double              Span(void) const;           /* seconds of monotonic time in the window */
+public:
+    static double       RatePPM(double rate,unsigned long nominal);
+private:
+    struct point {
+        unsigned long long  frame;
+        uint64_t            mono_us;
+    };
+private:
+    std::deque<point>   points;
+    unsigned long       nominal_rate;
+    unsigned int        window_seconds;
+};
+
+#endif //__DRIFT_H
+
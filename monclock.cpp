@@ -50,3 +50,37 @@ monotonic_clock_t monotonic_clock() {
 #endif
 }
 
+/* microsecond resolution, for timestamping audio */
+uint64_t monotonic_clock_us(void) {
+#if defined(C_CLOCK_GETTIME)
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC,&t) >= 0) {
+        return
+            ((uint64_t)t.tv_sec  * (uint64_t)1000000ul) +
+            ((uint64_t)t.tv_nsec / (uint64_t)1000ul);
+    }
+
+    return 0;
+#else
+    return (uint64_t)monotonic_clock() * ((uint64_t)1000000ul / (uint64_t)monotonic_clock_rate());
+#endif
+}
+
+/* microseconds since the epoch */
+uint64_t wall_clock_us(void) {
+#if defined(C_CLOCK_GETTIME)
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_REALTIME,&t) >= 0) {
+        return
+            ((uint64_t)t.tv_sec  * (uint64_t)1000000ul) +
+            ((uint64_t)t.tv_nsec / (uint64_t)1000ul);
+    }
+
+    return 0;
+#else
+    return (uint64_t)time(NULL) * (uint64_t)1000000ul;
+#endif
+}
+
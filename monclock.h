@@ -3,4 +3,6 @@
 
 monotonic_clock_t monotonic_clock();
 monotonic_clock_t monotonic_clock_rate(void);
+uint64_t monotonic_clock_us(void);
+uint64_t wall_clock_us(void);
 
@@ -32,6 +32,7 @@
 #include "dbfs.h"
 #include "autocut.h"
 #include "wavstruc.h"
+#include "pcmconv.h"
 #include "mp3write.h"
 
 #include "as_alsa.h"
@@ -47,7 +48,7 @@ MP3Writer::~MP3Writer() {
 bool MP3Writer::Open(const std::string &path) {
     if (IsOpen())
         return true;
-    if (!setup_lame())
+    if (!enc_continue && !setup_lame())
         return false;
 
     fd = open(path.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0644);
@@ -57,6 +58,36 @@ bool MP3Writer::Open(const std::string &path) {
     }
 
     mp3_write_pos = 0;
+    _output_open(fd,0);
+    return true;
+}
+
+/* The encoder carries on from the previous file, so there is no new encoder delay at the start
+ * of this one and no padding at the end of that one, and nothing to set up at the cut. */
+bool MP3Writer::ContinueFrom(WAVWriter &p) {
+    MP3Writer *prev = dynamic_cast<MP3Writer*>(&p);
+    unsigned char output[8192];
+
+    if (prev == NULL || !enc_continue || !IsOpen() || lame_global != NULL || mp3_write_pos != 0)
+        return false;
+    if (prev->lame_global == NULL || !prev->IsOpen())
+        return false;
+    if (prev->source_rate != source_rate || prev->source_channels != source_channels)
+        return false;
+
+    /* end the previous file on whatever is encoded so far, keeping the rest for this one */
+    int rd = lame_encode_flush_nogap(prev->lame_global,output,sizeof(output));
+    if (rd > 0) {
+        if (prev->_output_write(prev->fd,output,(size_t)rd) == rd)
+            prev->mp3_write_pos += (off_t)rd;
+    }
+
+    /* new bitstream for this file, same encoder */
+    if (lame_init_bitstream(prev->lame_global) != 0)
+        return false;
+
+    lame_global = prev->lame_global;
+    prev->lame_global = NULL;
     return true;
 }
 
@@ -65,6 +96,7 @@ void MP3Writer::Close(void) {
         if (mp3_write_pos != 0)
             _flush();
 
+        _output_close();
         close(fd);
         fd = -1;
     }
@@ -86,10 +118,10 @@ bool MP3Writer::SetFormat(const AudioFormat &fmt) {
             if (fmt.sample_rate < 1000 || fmt.sample_rate > 192000)
                 return false;
 
-            if (fmt.format_tag == AFMT_PCMS)
-                flip_sign = false;
-            else
-                flip_sign = true;
+            /* conversion for this exact format, chosen once here instead of per buffer */
+            convert = pcmconv_get_int_planar(fmt);
+            if (convert == NULL)
+                return false;
 
             source_rate = fmt.sample_rate;
             source_format = fmt.format_tag;
@@ -107,79 +139,23 @@ bool MP3Writer::IsOpen(void) const {
     return (fd >= 0);
 }
 
-template <const bool flip_sign> static void _convert_type24(long *dst[2],const unsigned char* buffer,unsigned int tmp_len_samples,const unsigned int channels) {
-    const long half = 1u << (24u - 1u);
-    const long shf = (sizeof(long) - 3u/*24 bit*/) * 8u;
-    const uint32_t xorT = flip_sign ? half : 0u;
-
-    for (unsigned int c=0;c < channels;c++) {
-        assert(dst[c] != NULL);
-
-        const unsigned char* sp = buffer + c * 3u;
-        long *dp = dst[c];
-
-        for (unsigned int s=0;s < tmp_len_samples;s++,sp += channels*3u)
-            *dp++ = (long)__lesx24(__leu24(sp) ^ xorT) << (long)shf;
-    }
-}
-
-template <typename T,typename sT,const bool flip_sign> static void _convert_type(long *dst[2],const T* buffer,unsigned int tmp_len_samples,const unsigned int channels) {
-    static_assert(sizeof(long) >= sizeof(T), "long type not large enough");
-    const long half = ((T)1u << ((T)((sizeof(T) * size_t(8u)) - size_t(1u))));
-    const long shf = (long)((sizeof(long) - sizeof(T)) * size_t(8u));
-    const T xorT = flip_sign ? half : (T)0;
-
-    for (unsigned int c=0;c < channels;c++) {
-        assert(dst[c] != NULL);
-
-        const T* sp = buffer + c;
-        long *dp = dst[c];
-
-        for (unsigned int s=0;s < tmp_len_samples;s++,sp += channels)
-            *dp++ = ((long)((sT)(*sp ^ xorT))) << (long)shf;
-    }
-}
-
-void MP3Writer::_convert(const size_t dstlen_b,long *dst,const size_t bpf,const void* &buffer,unsigned int tmp_len_samples) {
+void MP3Writer::_convert(const size_t dstlen_b,int *dst,const size_t bpf,const void* &buffer,unsigned int tmp_len_samples) {
     assert(source_channels == 1u || source_channels == 2u);
-    long *dstp[2] = {NULL,NULL};
+    int *dstp[2] = {NULL,NULL};
 
-    assert(dstlen_b >= (tmp_len_samples * source_channels * sizeof(long)));
+    assert(dstlen_b >= (tmp_len_samples * source_channels * sizeof(int)));
     assert(bpf == ((unsigned int)source_channels * ((unsigned int)source_bits_per_sample >> 3u)));
 
     dstp[0] = dst;
     if (source_channels == 2u) dstp[1] = dst + tmp_len_samples;
 
-    if (flip_sign) {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/true>(dstp,(const uint8_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/true>(dstp,(const uint16_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/true>(dstp,(const unsigned char*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/true>(dstp,(const uint32_t*)buffer,tmp_len_samples,source_channels);
-        else
-            abort();
-    }
-    else {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/false>(dstp,(const uint8_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/false>(dstp,(const uint16_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/false>(dstp,(const unsigned char*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/false>(dstp,(const uint32_t*)buffer,tmp_len_samples,source_channels);
-        else
-            abort();
-    }
+    convert(dstp,buffer,tmp_len_samples,source_channels);
 
     buffer = (const void*)((const unsigned char*)buffer + (bpf * tmp_len_samples));
 }
 
-bool MP3Writer::_encode(const long *samp,unsigned int tmp_len_samples) {
-    const long *dstp[2] = {NULL,NULL};
+bool MP3Writer::_encode(const int *samp,unsigned int tmp_len_samples) {
+    const int *dstp[2] = {NULL,NULL};
     unsigned char output[8192];
 
     if (lame_global == NULL || fd < 0)
@@ -189,14 +165,14 @@ bool MP3Writer::_encode(const long *samp,unsigned int tmp_len_samples) {
     if (source_channels == 2u) dstp[1] = samp + tmp_len_samples;
     else dstp[1] = dstp[0];
 
-    int rd = lame_encode_buffer_long2(lame_global,dstp[0],dstp[1],(int)tmp_len_samples,output,sizeof(output));
+    int rd = lame_encode_buffer_int(lame_global,dstp[0],dstp[1],(int)tmp_len_samples,output,sizeof(output));
     if (rd < 0) {
         fprintf(stderr,"LAME encoder error %d\n",rd);
         return false;
     }
 
     if (rd > 0) {
-        if (write(fd,output,(size_t)rd) != rd)
+        if (_output_write(fd,output,(size_t)rd) != rd)
             return false;
 
         mp3_write_pos += (off_t)rd;
@@ -214,7 +190,7 @@ bool MP3Writer::_flush(void) {
     int rd = lame_encode_flush(lame_global,output,sizeof(output));
     if (rd > 0) {
         fprintf(stderr,"LAME: Flushed out %d more bytes at end\n",rd);
-        if (write(fd,output,(size_t)rd) != rd)
+        if (_output_write(fd,output,(size_t)rd) != rd)
             return false;
 
         mp3_write_pos += (off_t)rd;
@@ -225,11 +201,15 @@ bool MP3Writer::_flush(void) {
 
 int MP3Writer::Write(const void *buffer,unsigned int len) {
     if (IsOpen()) {
+        /* nothing was taken over from the previous file */
+        if (lame_global == NULL && !setup_lame())
+            return -EINVAL;
+
         const size_t bpf = (size_t)((unsigned int)source_bits_per_sample >> 3u) * (size_t)source_channels;
         unsigned int samples = len / (unsigned int)bpf;
         constexpr unsigned int tmp_len = 4096;
         const unsigned int tmp_len_samples = tmp_len / source_channels;
-        long tmp[tmp_len];
+        int tmp[tmp_len];
 
         while (samples >= tmp_len_samples) {
             _convert(sizeof(tmp),tmp,bpf,buffer,tmp_len_samples);
@@ -19,9 +19,10 @@ public:
     virtual bool SetFormat(const AudioFormat &fmt);
     virtual bool IsOpen(void) const;
     virtual int Write(const void *buffer,unsigned int len);
+    virtual bool ContinueFrom(WAVWriter &prev);
 private:
     int             fd;
-    bool            flip_sign;
+    pcmconv_int_planar_t convert = NULL;
     off_t           mp3_write_pos;
     unsigned int    source_format = 0;
     uint32_t        source_rate = 0;
@@ -31,8 +32,8 @@ private:
 private:
     void free_lame(void);
     bool setup_lame(void);
-    void _convert(const size_t dstlen_b,long *dst,const size_t bpf,const void* &buffer,unsigned int tmp_len_samples);
-    bool _encode(const long *samp,unsigned int tmp_len_samples);
+    void _convert(const size_t dstlen_b,int *dst,const size_t bpf,const void* &buffer,unsigned int tmp_len_samples);
+    bool _encode(const int *samp,unsigned int tmp_len_samples);
     bool _flush(void);
 };
 #endif
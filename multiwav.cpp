@@ -0,0 +1,203 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <typeinfo>
+
+#include "common.h"
+#include "multiwav.h"
+
+FanoutWAVWriter::FanoutWAVWriter() : WAVWriter(), open(false) {
+}
+
+FanoutWAVWriter::~FanoutWAVWriter() {
+    Close();
+    for (size_t i=0;i < outs.size();i++) {
+        delete outs[i].w;
+        outs[i].w = NULL;
+    }
+    outs.clear();
+}
+
+/* takes ownership of 'w', which writes to the path given to Open() plus 'suffix'. Before Open() */
+void FanoutWAVWriter::Add(WAVWriter *w,const std::string &suffix) {
+    Output o;
+
+    if (IsOpen() || w == NULL) return;
+
+    o.w = w;
+    o.suffix = suffix;
+    outs.push_back(o);
+}
+
+size_t FanoutWAVWriter::Count(void) const {
+    return outs.size();
+}
+
+std::string FanoutWAVWriter::Path(size_t i) const {
+    if (i >= outs.size()) return std::string();
+    return outs[i].path;
+}
+
+/* all or nothing. whatever was opened is closed and deleted again if one can't be */
+bool FanoutWAVWriter::Open(const std::string &path) {
+    size_t i;
+
+    if (IsOpen())
+        return true;
+    if (outs.empty())
+        return false;
+
+    for (i=0;i < outs.size();i++) {
+        outs[i].path = path + outs[i].suffix;
+        if (!outs[i].w->Open(outs[i].path))
+            break;
+    }
+
+    if (i < outs.size()) {
+        while (i-- > 0) {
+            outs[i].w->Close();
+            unlink(outs[i].path.c_str());
+        }
+
+        return false;
+    }
+
+    open = true;
+    return true;
+}
+
+void FanoutWAVWriter::Close(void) {
+    for (size_t i=0;i < outs.size();i++)
+        outs[i].w->Close();
+
+    open = false;
+}
+
+bool FanoutWAVWriter::IsOpen(void) const {
+    return open;
+}
+
+void FanoutWAVWriter::SetComment(const std::string &str) {
+    for (size_t i=0;i < outs.size();i++)
+        outs[i].w->SetComment(str);
+}
+
+/* output by output, from a writer of the same kind set up the same way */
+bool FanoutWAVWriter::ContinueFrom(WAVWriter &p) {
+    FanoutWAVWriter *prev = dynamic_cast<FanoutWAVWriter*>(&p);
+    bool any = false;
+
+    if (prev == NULL || typeid(*prev) != typeid(*this) || prev->outs.size() != outs.size() || !IsOpen())
+        return false;
+
+    for (size_t i=0;i < outs.size();i++) {
+        if (prev->outs[i].suffix != outs[i].suffix)
+            continue;
+        if (outs[i].w->ContinueFrom(*prev->outs[i].w))
+            any = true;
+    }
+
+    return any;
+}
+
+bool FanoutWAVWriter::Finishing(void) const {
+    for (size_t i=0;i < outs.size();i++) {
+        if (outs[i].w->Finishing())
+            return true;
+    }
+
+    return false;
+}
+
+std::string FanoutWAVWriter::OutputStats(void) const {
+    std::string r;
+
+    for (size_t i=0;i < outs.size();i++) {
+        const std::string st = outs[i].w->OutputStats();
+
+        if (st.empty()) continue;
+        if (!r.empty()) r += "; ";
+        r += outs[i].suffix + ": " + st;
+    }
+
+    return r;
+}
+
+std::string FanoutWAVWriter::EncoderStats(void) const {
+    std::string r;
+
+    for (size_t i=0;i < outs.size();i++) {
+        const std::string st = outs[i].w->EncoderStats();
+
+        if (st.empty()) continue;
+        if (!r.empty()) r += "; ";
+        r += outs[i].suffix + ": " + st;
+    }
+
+    return r;
+}
+
+/* whichever is furthest behind */
+unsigned int FanoutWAVWriter::Backlog(void) const {
+    unsigned int r = 0;
+
+    for (size_t i=0;i < outs.size();i++) {
+        const unsigned int b = outs[i].w->Backlog();
+        if (r < b) r = b;
+    }
+
+    return r;
+}
+
+MultiWAVWriter::MultiWAVWriter() : FanoutWAVWriter() {
+}
+
+MultiWAVWriter::~MultiWAVWriter() {
+}
+
+bool MultiWAVWriter::SetFormat(const AudioFormat &fmt) {
+    if (IsOpen() || outs.empty()) return false;
+
+    for (size_t i=0;i < outs.size();i++) {
+        if (!outs[i].w->SetFormat(fmt))
+            return false;
+    }
+
+    return true;
+}
+
+/* every output gets all of it. an error from any of them is returned, after the rest have been written */
+int MultiWAVWriter::Write(const void *buffer,unsigned int len) {
+    int r = (int)len;
+
+    if (!IsOpen())
+        return -EINVAL;
+
+    for (size_t i=0;i < outs.size();i++) {
+        const int wr = outs[i].w->Write(buffer,len);
+
+        if (wr != (int)len && r == (int)len) {
+            fprintf(stderr,"Output %s: write error\n",outs[i].path.c_str());
+            r = wr < 0 ? wr : -EIO;
+        }
+    }
+
+    return r;
+}
+
@@ -0,0 +1,55 @@
+#ifndef __MULTIWAV_H
+#define __MULTIWAV_H
+
+#include "config.h"
+#include "wavstruc.h"
+#include "wavwrite.h"
+
+#include <string>
+#include <vector>
+
+/* A writer made of several others, each writing a file of its own. Open() is given the path
+ * without an extension, and each output adds its own suffix. This does everything but decide
+ * what each output gets: subclasses have SetFormat() and Write(). */
+class FanoutWAVWriter : public WAVWriter {
+public:
+    FanoutWAVWriter();
+    virtual ~FanoutWAVWriter();
+public:
+    void Add(WAVWriter *w,const std::string &suffix);
+    size_t Count(void) const;
+    std::string Path(size_t i) const;
+public:
+    virtual bool Open(const std::string &path);
+    virtual void Close(void);
+    virtual bool IsOpen(void) const;
+    virtual void SetComment(const std::string &str);
+    virtual bool ContinueFrom(WAVWriter &prev);
+    virtual bool Finishing(void) const;
+    virtual std::string OutputStats(void) const;
+    virtual std::string EncoderStats(void) const;
+    virtual unsigned int Backlog(void) const;
+protected:
+    struct Output {
+        WAVWriter*      w;              /* owned */
+        std::string     suffix;
+        std::string     path;
+    };
+    std::vector<Output> outs;
+    bool                open;
+};
+
+/* Several writers recording the same audio at once, a WAV master and an Opus proxy for example,
+ * so that one capture can feed them all. Anything slow should be wrapped in an AsyncWAVWriter
+ * first, so that each output does its work on the encoder threads. */
+class MultiWAVWriter : public FanoutWAVWriter {
+public:
+    MultiWAVWriter();
+    virtual ~MultiWAVWriter();
+public:
+    virtual bool SetFormat(const AudioFormat &fmt);
+    virtual int Write(const void *buffer,unsigned int len);
+};
+
+#endif //__MULTIWAV_H
+
@@ -28,12 +28,13 @@
 #include "dbfs.h"
 #include "autocut.h"
 #include "wavstruc.h"
+#include "pcmconv.h"
 #include "opuwrite.h"
 
 #include "as_alsa.h"
 
 #if defined(HAVE_OPUSENC)
-OpusWriter::OpusWriter() : WAVWriter() {
+OpusWriter::OpusWriter() : WAVWriter(), fd(-1) {
 }
 
 OpusWriter::~OpusWriter() {
@@ -41,8 +42,6 @@ OpusWriter::~OpusWriter() {
 }
 
 bool OpusWriter::Open(const std::string &path) {
-    opus_int32 error;
-
     if (IsOpen())
         return true;
 
@@ -59,10 +58,36 @@ bool OpusWriter::Open(const std::string &path) {
     }
     ope_comments_add(opus_comments,"ENCODER","Permanent Record");
 
-    opus_enc = ope_encoder_create_file(path.c_str(), opus_comments, (opus_int32)source_rate, (opus_int32)source_channels, (opus_int32)0, &error);
+    fd = open(path.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0644);
+    if (fd < 0) {
+        fprintf(stderr,"Failed to open Opus output, %s\n",strerror(errno));
+        Close();
+        return false;
+    }
+
+    _output_open(fd,0);
+
+    if (!enc_continue && !setup_opus()) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+bool OpusWriter::setup_opus(void) {
+    opus_int32 error;
+
+    /* libopusenc hands us the pages, so that they go out through the same buffers as everything else */
+    {
+        OpusEncCallbacks cb;
+
+        cb.write = _ope_write;
+        cb.close = _ope_close;
+        opus_enc = ope_encoder_create_callbacks(&cb, this, opus_comments, (opus_int32)source_rate, (opus_int32)source_channels, (opus_int32)0, &error);
+    }
     if (opus_enc == NULL) {
         fprintf(stderr,"Opus failed to open: error %d\n",error);
-        Close();
         return false;
     }
 
@@ -73,6 +98,52 @@ bool OpusWriter::Open(const std::string &path) {
     return true;
 }
 
+/* The encoder carries on from the previous file: libopusenc ends that stream on the sample it is
+ * at now and starts this one with the right pre-skip, so the files join up without a gap and
+ * there is no encoder to set up at the cut. The previous file still gets its last few pages,
+ * from the Write() calls made on this one, until _ope_close() says it is done. */
+bool OpusWriter::ContinueFrom(WAVWriter &p) {
+    OpusWriter *prev = dynamic_cast<OpusWriter*>(&p);
+
+    if (prev == NULL || !enc_continue || !IsOpen() || opus_enc != NULL)
+        return false;
+    if (prev->opus_enc == NULL || !prev->opus_init || !prev->IsOpen())
+        return false;
+    if (prev->source_rate != source_rate || prev->source_channels != source_channels)
+        return false;
+
+    if (ope_encoder_continue_new_callbacks(prev->opus_enc, this, opus_comments) != OPE_OK)
+        return false;
+
+    opus_enc = prev->opus_enc;
+    opus_init = true;
+    prev->opus_enc = NULL;
+    prev->opus_init = false;
+    prev->opus_tail = true;
+    return true;
+}
+
+bool OpusWriter::Finishing(void) const {
+    return opus_tail;
+}
+
+int OpusWriter::_ope_write(void *user_data,const unsigned char *ptr,opus_int32 len) {
+    OpusWriter *w = (OpusWriter*)user_data;
+
+    if (w->_output_write(w->fd,ptr,(size_t)len) != (int)len)
+        return 1;
+
+    return 0;
+}
+
+/* the file is closed by free_opus() once the encoder is done with it */
+int OpusWriter::_ope_close(void *user_data) {
+    OpusWriter *w = (OpusWriter*)user_data;
+
+    w->opus_tail = false;
+    return 0;
+}
+
 void OpusWriter::Close(void) {
     free_opus();
 }
@@ -91,10 +162,10 @@ bool OpusWriter::SetFormat(const AudioFormat &fmt) {
             if (fmt.sample_rate < 1000 || fmt.sample_rate > 192000)
                 return false;
 
-            if (fmt.format_tag == AFMT_PCMS)
-                flip_sign = false;
-            else
-                flip_sign = true;
+            /* conversion for this exact format, chosen once here instead of per buffer */
+            convert = pcmconv_get_float(fmt);
+            if (convert == NULL)
+                return false;
 
             source_rate = fmt.sample_rate;
             source_format = fmt.format_tag;
@@ -109,59 +180,17 @@ bool OpusWriter::SetFormat(const AudioFormat &fmt) {
 }
 
 bool OpusWriter::IsOpen(void) const {
-    return (opus_enc != NULL);
-}
-
-template <const bool flip_sign> static void _convert_type24(float *dst,const unsigned char* buffer,unsigned int raw_samples/*combined*/) {
-    const long half = 1u << (24u - 1u);
-    const float fhalf = float(half);
-    const uint32_t xorT = flip_sign ? half : 0u;
-
-    for (unsigned int s=0;s < raw_samples;s++,buffer += 3u)
-        *dst++ = (float)__lesx24(__leu24(buffer) ^ xorT) / fhalf;
-}
-
-template <typename T,typename sT,const bool flip_sign> static void _convert_type(float *dst,const T* buffer,unsigned int raw_samples/*combined*/) {
-    const long half = ((T)1u << ((T)((sizeof(T) * size_t(8u)) - size_t(1u))));
-    const float fhalf = float(half);
-    const T xorT = flip_sign ? half : (T)0;
-
-    for (unsigned int s=0;s < raw_samples;s++)
-        *dst++ = (float)((long)((sT)((*buffer++) ^ xorT))) / fhalf;
+    return (fd >= 0);
 }
 
 bool OpusWriter::_convert(const size_t tmpsz,float *tmp,const size_t bpf,const void* &buffer,unsigned int tmp_samples/*combined*/) {
     assert(source_channels == 1u || source_channels == 2u);
     assert(bpf == ((unsigned int)source_channels * ((unsigned int)source_bits_per_sample >> 3u)));
-    const unsigned int raw_samples = tmp_samples * (unsigned int)source_channels;
-    assert(tmpsz >= (sizeof(*tmp) * raw_samples));
+    assert(tmpsz >= (sizeof(*tmp) * tmp_samples * (unsigned int)source_channels));
 
     if (!opus_init) return false;
 
-    if (flip_sign) {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/true>(tmp,(const uint8_t*)buffer,raw_samples);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/true>(tmp,(const uint16_t*)buffer,raw_samples);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/true>(tmp,(const unsigned char*)buffer,raw_samples);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/true>(tmp,(const uint32_t*)buffer,raw_samples);
-        else
-            abort();
-    }
-    else {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/false>(tmp,(const uint8_t*)buffer,raw_samples);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/false>(tmp,(const uint16_t*)buffer,raw_samples);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/false>(tmp,(const unsigned char*)buffer,raw_samples);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/false>(tmp,(const uint32_t*)buffer,raw_samples);
-        else
-            abort();
-    }
+    convert(tmp,buffer,tmp_samples,source_channels);
 
     buffer = (const void*)((const unsigned char*)buffer + (bpf * tmp_samples));
 
@@ -173,6 +202,10 @@ bool OpusWriter::_convert(const size_t tmpsz,float *tmp,const size_t bpf,const v
 
 int OpusWriter::Write(const void *buffer,unsigned int len) {
     if (IsOpen()) {
+        /* nothing was taken over from the previous file */
+        if (opus_enc == NULL && !setup_opus())
+            return -EINVAL;
+
         const size_t bpf = (size_t)((unsigned int)source_bits_per_sample >> 3u) * (size_t)source_channels;
         unsigned int samples = len / (unsigned int)bpf;
         constexpr unsigned int tmp_len = 4096;
@@ -199,11 +232,17 @@ void OpusWriter::free_opus(void) {
         ope_encoder_destroy(opus_enc);
         opus_enc = NULL;
     }
+    if (fd >= 0) {
+        _output_close();
+        close(fd);
+        fd = -1;
+    }
     if (opus_comments) {
         ope_comments_destroy(opus_comments);
         opus_comments = NULL;
     }
     opus_init = false;
+    opus_tail = false;
 }
 #endif
 
@@ -19,8 +19,11 @@ public:
     virtual bool SetFormat(const AudioFormat &fmt);
     virtual bool IsOpen(void) const;
     virtual int Write(const void *buffer,unsigned int len);
+    virtual bool ContinueFrom(WAVWriter &prev);
+    virtual bool Finishing(void) const;
 private:
-    bool            flip_sign;
+    int             fd;
+    pcmconv_float_t convert = NULL;
     unsigned int    source_format = 0;
     uint32_t        source_rate = 0;
     uint8_t         source_bits_per_sample = 0;
@@ -29,8 +32,12 @@ private:
     OggOpusEnc*     opus_enc = NULL;
     OggOpusComments* opus_comments = NULL;
     bool            opus_init = false;
+    bool            opus_tail = false;      /* encoder given away, still owes this file its last pages */
 private:
     void free_opus(void);
+    bool setup_opus(void);
+    static int _ope_write(void *user_data,const unsigned char *ptr,opus_int32 len);
+    static int _ope_close(void *user_data);
     bool _convert(const size_t tmpsz,float *tmp,const size_t bpf,const void* &buffer,unsigned int raw_samples/*combined*/);
 };
 #endif
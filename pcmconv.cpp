@@ -0,0 +1,467 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <endian.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <new>
+
+#include "common.h"
+#include "monclock.h"
+#include "aufmt.h"
+#include "aufmtui.h"
+#include "pcmconv.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define PCMCONV_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
+#if defined(PCMCONV_HAVE_SSE2)
+/* four samples, each in the top of a 32-bit lane, sign not yet flipped */
+template <const unsigned int bytes> static inline __m128i pcm_load4(const unsigned char *p);
+
+template <> inline __m128i pcm_load4<1u>(const unsigned char *p) {
+    const __m128i z = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(z,_mm_unpacklo_epi8(z,_mm_cvtsi32_si128(*((const int*)p))));
+}
+
+template <> inline __m128i pcm_load4<2u>(const unsigned char *p) {
+    return _mm_unpacklo_epi16(_mm_setzero_si128(),_mm_loadl_epi64((const __m128i*)p));
+}
+
+/* packed 24-bit: 12 bytes in, sample k moves from bytes 3k..3k+2 to 4k+1..4k+3. SSE2 has no
+ * byte shuffle, so shift the whole register once per sample and mask out the one that landed */
+template <> inline __m128i pcm_load4<3u>(const unsigned char *p) {
+    const __m128i x = _mm_or_si128(_mm_loadl_epi64((const __m128i*)p),_mm_slli_si128(_mm_cvtsi32_si128(*((const int*)(p + 8))),8));
+    const int m = (int)0xFFFFFF00u;
+
+    return _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_slli_si128(x,1),_mm_set_epi32(0,0,0,m)),_mm_and_si128(_mm_slli_si128(x,2),_mm_set_epi32(0,0,m,0))),
+        _mm_or_si128(_mm_and_si128(_mm_slli_si128(x,3),_mm_set_epi32(0,m,0,0)),_mm_and_si128(_mm_slli_si128(x,4),_mm_set_epi32(m,0,0,0))));
+}
+
+template <> inline __m128i pcm_load4<4u>(const unsigned char *p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+/* with everything at the top of the lane, the sign flip is the same for every width */
+template <const unsigned int bytes,const bool flip> static inline __m128i pcm_load4s(const unsigned char *p) {
+    return _mm_xor_si128(pcm_load4<bytes>(p),_mm_set1_epi32(flip ? (int)0x80000000u : 0));
+}
+
+static inline __m128 pcm_float4(const __m128i x) {
+    return _mm_mul_ps(_mm_cvtepi32_ps(x),_mm_set1_ps(1.0f / 2147483648.0f));
+}
+#endif
+
+/* CH is the channel count, or 0 to take it from the argument.
+ * vec says whether to use SIMD where there is any, false gives the plain C loop (for the benchmark) */
+template <const unsigned int bytes,const bool flip,const unsigned int CH,const bool vec> static void pcm_to_int_planar(int **dst,const void *src,unsigned int frames,unsigned int channels) {
+    static_assert(sizeof(int) == 4, "int is not 32 bits");
+    const unsigned int nch = CH != 0u ? CH : channels;
+    const unsigned char *sp = (const unsigned char*)src;
+    unsigned int s = 0;
+
+#if defined(PCMCONV_HAVE_SSE2)
+    if (vec && CH == 1u) {
+        for (;(s+4u) <= frames;s += 4u,sp += 4u * bytes)
+            _mm_storeu_si128((__m128i*)(dst[0] + s),pcm_load4s<bytes,flip>(sp));
+    }
+    else if (vec && CH == 2u) {
+        for (;(s+4u) <= frames;s += 4u,sp += 8u * bytes) {
+            const __m128 a = _mm_castsi128_ps(pcm_load4s<bytes,flip>(sp));
+            const __m128 b = _mm_castsi128_ps(pcm_load4s<bytes,flip>(sp + (4u * bytes)));
+
+            _mm_storeu_si128((__m128i*)(dst[0] + s),_mm_castps_si128(_mm_shuffle_ps(a,b,_MM_SHUFFLE(2,0,2,0))));
+            _mm_storeu_si128((__m128i*)(dst[1] + s),_mm_castps_si128(_mm_shuffle_ps(a,b,_MM_SHUFFLE(3,1,3,1))));
+        }
+    }
+#endif
+
+    for (;s < frames;s++) {
+        for (unsigned int c=0;c < nch;c++) {
+            dst[c][s] = (int)((uint32_t)pcm_sample<bytes,flip>::get(sp) << ((4u - bytes) * 8u));
+            sp += bytes;
+        }
+    }
+}
+
+template <const unsigned int bytes,const bool flip,const unsigned int CH,const bool vec> static void pcm_to_float_planar(float **dst,const void *src,unsigned int frames,unsigned int channels) {
+    const unsigned int nch = CH != 0u ? CH : channels;
+    const float scale = 1.0f / (float)(1ul << ((bytes * 8u) - 1u)); /* power of two, so this is exact */
+    const unsigned char *sp = (const unsigned char*)src;
+    unsigned int s = 0;
+
+#if defined(PCMCONV_HAVE_SSE2)
+    if (vec && CH == 1u) {
+        for (;(s+4u) <= frames;s += 4u,sp += 4u * bytes)
+            _mm_storeu_ps(dst[0] + s,pcm_float4(pcm_load4s<bytes,flip>(sp)));
+    }
+    else if (vec && CH == 2u) {
+        for (;(s+4u) <= frames;s += 4u,sp += 8u * bytes) {
+            const __m128 a = pcm_float4(pcm_load4s<bytes,flip>(sp));
+            const __m128 b = pcm_float4(pcm_load4s<bytes,flip>(sp + (4u * bytes)));
+
+            _mm_storeu_ps(dst[0] + s,_mm_shuffle_ps(a,b,_MM_SHUFFLE(2,0,2,0)));
+            _mm_storeu_ps(dst[1] + s,_mm_shuffle_ps(a,b,_MM_SHUFFLE(3,1,3,1)));
+        }
+    }
+#endif
+
+    for (;s < frames;s++) {
+        for (unsigned int c=0;c < nch;c++) {
+            dst[c][s] = (float)pcm_sample<bytes,flip>::get(sp) * scale;
+            sp += bytes;
+        }
+    }
+}
+
+template <const unsigned int bytes,const bool flip,const unsigned int CH,const bool vec> static void pcm_to_float(float *dst,const void *src,unsigned int frames,unsigned int channels) {
+    const unsigned int nch = CH != 0u ? CH : channels;
+    const float scale = 1.0f / (float)(1ul << ((bytes * 8u) - 1u));
+    const unsigned char *sp = (const unsigned char*)src;
+    unsigned int samples = frames * nch;
+
+#if defined(PCMCONV_HAVE_SSE2)
+    if (vec) {
+        for (;samples >= 4u;samples -= 4u,sp += 4u * bytes,dst += 4)
+            _mm_storeu_ps(dst,pcm_float4(pcm_load4s<bytes,flip>(sp)));
+    }
+#endif
+
+    for (;samples > 0u;samples--) {
+        *dst++ = (float)pcm_sample<bytes,flip>::get(sp) * scale;
+        sp += bytes;
+    }
+}
+
+/* a same-width copy with at most an XOR, which the compiler vectorizes well enough by itself */
+template <const unsigned int bytes,const bool flip,const unsigned int CH,const bool vec> static void pcm_to_wav(void *dst,const void *src,unsigned int frames,unsigned int channels) {
+    const unsigned int nch = CH != 0u ? CH : channels;
+    const unsigned char *sp = (const unsigned char*)src;
+    unsigned char *dp = (unsigned char*)dst;
+
+    (void)vec;
+
+    for (unsigned int s=0;s < frames;s++) {
+        for (unsigned int c=0;c < nch;c++) {
+            if (bytes == 1u) {
+                dp[0] = (unsigned char)(sp[0] ^ (flip ? 0x80u : 0x00u));
+            }
+            else if (bytes == 2u) {
+                *((uint16_t*)dp) = htole16((uint16_t)(*((const uint16_t*)sp) ^ (flip ? 0x8000u : 0x0000u)));
+            }
+            else if (bytes == 3u) {
+                dp[0] = sp[0];
+                dp[1] = sp[1];
+                dp[2] = (unsigned char)(sp[2] ^ (flip ? 0x80u : 0x00u));
+            }
+            else if (bytes == 4u) {
+                *((uint32_t*)dp) = htole32((uint32_t)(*((const uint32_t*)sp) ^ (flip ? 0x80000000u : 0x00000000u)));
+            }
+
+            sp += bytes;
+            dp += bytes;
+        }
+    }
+}
+
+#if defined(PCMCONV_HAVE_SSE2)
+/* 8 frames of 8 16-bit channels in, 8 samples of each of the 8 channels out. 'stride' is bytes per frame */
+static inline void pcm_split_8x8_16(void **dst,unsigned int s,const unsigned char *sp,unsigned int stride) {
+    const __m128i r0 = _mm_loadu_si128((const __m128i*)(sp));
+    const __m128i r1 = _mm_loadu_si128((const __m128i*)(sp + stride));
+    const __m128i r2 = _mm_loadu_si128((const __m128i*)(sp + (stride * 2u)));
+    const __m128i r3 = _mm_loadu_si128((const __m128i*)(sp + (stride * 3u)));
+    const __m128i r4 = _mm_loadu_si128((const __m128i*)(sp + (stride * 4u)));
+    const __m128i r5 = _mm_loadu_si128((const __m128i*)(sp + (stride * 5u)));
+    const __m128i r6 = _mm_loadu_si128((const __m128i*)(sp + (stride * 6u)));
+    const __m128i r7 = _mm_loadu_si128((const __m128i*)(sp + (stride * 7u)));
+
+    /* pairs of frames per channel, then fours, then all eight */
+    const __m128i a0 = _mm_unpacklo_epi16(r0,r1),a1 = _mm_unpackhi_epi16(r0,r1);
+    const __m128i a2 = _mm_unpacklo_epi16(r2,r3),a3 = _mm_unpackhi_epi16(r2,r3);
+    const __m128i a4 = _mm_unpacklo_epi16(r4,r5),a5 = _mm_unpackhi_epi16(r4,r5);
+    const __m128i a6 = _mm_unpacklo_epi16(r6,r7),a7 = _mm_unpackhi_epi16(r6,r7);
+    const __m128i b0 = _mm_unpacklo_epi32(a0,a2),b1 = _mm_unpackhi_epi32(a0,a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a1,a3),b3 = _mm_unpackhi_epi32(a1,a3);
+    const __m128i b4 = _mm_unpacklo_epi32(a4,a6),b5 = _mm_unpackhi_epi32(a4,a6);
+    const __m128i b6 = _mm_unpacklo_epi32(a5,a7),b7 = _mm_unpackhi_epi32(a5,a7);
+
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[0] + s),_mm_unpacklo_epi64(b0,b4));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[1] + s),_mm_unpackhi_epi64(b0,b4));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[2] + s),_mm_unpacklo_epi64(b1,b5));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[3] + s),_mm_unpackhi_epi64(b1,b5));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[4] + s),_mm_unpacklo_epi64(b2,b6));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[5] + s),_mm_unpackhi_epi64(b2,b6));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[6] + s),_mm_unpacklo_epi64(b3,b7));
+    _mm_storeu_si128((__m128i*)((uint16_t*)dst[7] + s),_mm_unpackhi_epi64(b3,b7));
+}
+
+/* the same with 4 frames of 4 32-bit channels */
+static inline void pcm_split_4x4_32(void **dst,unsigned int s,const unsigned char *sp,unsigned int stride) {
+    const __m128i r0 = _mm_loadu_si128((const __m128i*)(sp));
+    const __m128i r1 = _mm_loadu_si128((const __m128i*)(sp + stride));
+    const __m128i r2 = _mm_loadu_si128((const __m128i*)(sp + (stride * 2u)));
+    const __m128i r3 = _mm_loadu_si128((const __m128i*)(sp + (stride * 3u)));
+    const __m128i a0 = _mm_unpacklo_epi32(r0,r1),a1 = _mm_unpackhi_epi32(r0,r1);
+    const __m128i a2 = _mm_unpacklo_epi32(r2,r3),a3 = _mm_unpackhi_epi32(r2,r3);
+
+    _mm_storeu_si128((__m128i*)((uint32_t*)dst[0] + s),_mm_unpacklo_epi64(a0,a2));
+    _mm_storeu_si128((__m128i*)((uint32_t*)dst[1] + s),_mm_unpackhi_epi64(a0,a2));
+    _mm_storeu_si128((__m128i*)((uint32_t*)dst[2] + s),_mm_unpacklo_epi64(a1,a3));
+    _mm_storeu_si128((__m128i*)((uint32_t*)dst[3] + s),_mm_unpackhi_epi64(a1,a3));
+}
+#endif
+
+/* nothing to convert, only to move. one pass over the source, every plane written in order */
+template <const unsigned int bytes,const bool flip,const unsigned int CH,const bool vec> static void pcm_split(void **dst,const void *src,unsigned int frames,unsigned int channels) {
+    const unsigned int nch = CH != 0u ? CH : channels;
+    const unsigned char *sp = (const unsigned char*)src;
+    unsigned int s = 0;
+
+    (void)flip;
+
+#if defined(PCMCONV_HAVE_SSE2)
+    if (vec && bytes == 2u && (nch % 8u) == 0u) {
+        for (;(s+8u) <= frames;s += 8u,sp += 8u * nch * bytes) {
+            for (unsigned int c=0;c < nch;c += 8u)
+                pcm_split_8x8_16(dst + c,s,sp + (c * bytes),nch * bytes);
+        }
+    }
+    else if (vec && bytes == 4u && (nch % 4u) == 0u) {
+        for (;(s+4u) <= frames;s += 4u,sp += 4u * nch * bytes) {
+            for (unsigned int c=0;c < nch;c += 4u)
+                pcm_split_4x4_32(dst + c,s,sp + (c * bytes),nch * bytes);
+        }
+    }
+#endif
+
+    for (;s < frames;s++) {
+        for (unsigned int c=0;c < nch;c++) {
+            memcpy((unsigned char*)dst[c] + (s * bytes),sp,bytes);
+            sp += bytes;
+        }
+    }
+}
+
+/* [flip][bytes-1][channel class] */
+#define PCMCONV_CHANNELS(fn,b,f,v) { &fn<b,f,0u,v>, &fn<b,f,1u,v>, &fn<b,f,2u,v>, &fn<b,f,8u,v> }
+#define PCMCONV_WIDTHS(fn,f,v) { PCMCONV_CHANNELS(fn,1u,f,v), PCMCONV_CHANNELS(fn,2u,f,v), PCMCONV_CHANNELS(fn,3u,f,v), PCMCONV_CHANNELS(fn,4u,f,v) }
+#define PCMCONV_TABLE(fn,v) { PCMCONV_WIDTHS(fn,false,v), PCMCONV_WIDTHS(fn,true,v) }
+
+static const pcmconv_int_planar_t pcmconv_int_planar_table[2][4][4] = PCMCONV_TABLE(pcm_to_int_planar,true);
+static const pcmconv_float_planar_t pcmconv_float_planar_table[2][4][4] = PCMCONV_TABLE(pcm_to_float_planar,true);
+static const pcmconv_float_t pcmconv_float_table[2][4][4] = PCMCONV_TABLE(pcm_to_float,true);
+static const pcmconv_wav_t pcmconv_wav_table[2][4][4] = PCMCONV_TABLE(pcm_to_wav,false);
+static const pcmconv_split_t pcmconv_split_table[2][4][4] = PCMCONV_TABLE(pcm_split,true);
+
+/* the plain C versions, to check and time the others against */
+static const pcmconv_int_planar_t pcmconv_int_planar_table_c[2][4][4] = PCMCONV_TABLE(pcm_to_int_planar,false);
+static const pcmconv_float_planar_t pcmconv_float_planar_table_c[2][4][4] = PCMCONV_TABLE(pcm_to_float_planar,false);
+static const pcmconv_float_t pcmconv_float_table_c[2][4][4] = PCMCONV_TABLE(pcm_to_float,false);
+static const pcmconv_split_t pcmconv_split_table_c[2][4][4] = PCMCONV_TABLE(pcm_split,false);
+
+#undef PCMCONV_TABLE
+#undef PCMCONV_WIDTHS
+#undef PCMCONV_CHANNELS
+
+/* table indexes for a format, false if it isn't something we convert */
+static bool pcmconv_index(const AudioFormat &fmt,unsigned int &w,unsigned int &c) {
+    if (!(fmt.format_tag == AFMT_PCMU || fmt.format_tag == AFMT_PCMS))
+        return false;
+    if (!(fmt.bits_per_sample == 8 || fmt.bits_per_sample == 16 || fmt.bits_per_sample == 24 || fmt.bits_per_sample == 32))
+        return false;
+    if (fmt.channels == 0)
+        return false;
+
+    w = ((unsigned int)fmt.bits_per_sample / 8u) - 1u;
+
+    switch (fmt.channels) {
+        case 1:     c = 1; break;
+        case 2:     c = 2; break;
+        case 8:     c = 3; break;
+        default:    c = 0; break;
+    }
+
+    return true;
+}
+
+/* the encoders all want signed samples */
+pcmconv_int_planar_t pcmconv_get_int_planar(const AudioFormat &fmt) {
+    unsigned int w,c;
+
+    if (!pcmconv_index(fmt,w,c)) return NULL;
+    return pcmconv_int_planar_table[fmt.format_tag == AFMT_PCMU ? 1 : 0][w][c];
+}
+
+pcmconv_float_planar_t pcmconv_get_float_planar(const AudioFormat &fmt) {
+    unsigned int w,c;
+
+    if (!pcmconv_index(fmt,w,c)) return NULL;
+    return pcmconv_float_planar_table[fmt.format_tag == AFMT_PCMU ? 1 : 0][w][c];
+}
+
+pcmconv_float_t pcmconv_get_float(const AudioFormat &fmt) {
+    unsigned int w,c;
+
+    if (!pcmconv_index(fmt,w,c)) return NULL;
+    return pcmconv_float_table[fmt.format_tag == AFMT_PCMU ? 1 : 0][w][c];
+}
+
+/* WAV only supports 8-bit unsigned or 16/24/32-bit signed PCM */
+static bool pcmconv_wav_flip(const AudioFormat &fmt) {
+    if (fmt.bits_per_sample == 8)
+        return fmt.format_tag == AFMT_PCMS;
+
+    return fmt.format_tag == AFMT_PCMU;
+}
+
+pcmconv_wav_t pcmconv_get_wav(const AudioFormat &fmt) {
+    unsigned int w,c;
+
+    if (!pcmconv_index(fmt,w,c)) return NULL;
+    return pcmconv_wav_table[pcmconv_wav_flip(fmt) ? 1 : 0][w][c];
+}
+
+/* the samples aren't touched, so signedness doesn't matter */
+pcmconv_split_t pcmconv_get_split(const AudioFormat &fmt) {
+    unsigned int w,c;
+
+    if (!pcmconv_index(fmt,w,c)) return NULL;
+    return pcmconv_split_table[0][w][c];
+}
+
+bool pcmconv_wav_needs_xlat(const AudioFormat &fmt) {
+#if defined(WORDS_BIGENDIAN)
+    if (fmt.bits_per_sample > 8)
+        return true;
+#endif
+
+    return pcmconv_wav_flip(fmt);
+}
+
+static const char *pcmconv_bench_name[4] = { "float", "float planar", "int32 planar", "split" };
+
+/* one block through one converter. out holds 'channels' planes of 'stride' samples */
+static void pcmconv_bench_block(unsigned int kind,bool vec,unsigned int f,unsigned int w,unsigned int c,void *out,unsigned int stride,const unsigned char *src,unsigned int frames,unsigned int channels) {
+    float *fp[255]; /* AudioFormat::channels is 8 bits */
+    int *ip[255];
+    void *sp[255];
+    unsigned int i;
+
+    for (i=0;i < channels;i++) {
+        fp[i] = (float*)out + (i * stride);
+        ip[i] = (int*)out + (i * stride);
+        sp[i] = (unsigned char*)out + (i * stride * (w + 1u));
+    }
+
+    if (kind == 0)
+        (vec ? pcmconv_float_table : pcmconv_float_table_c)[f][w][c]((float*)out,src,frames,channels);
+    else if (kind == 1)
+        (vec ? pcmconv_float_planar_table : pcmconv_float_planar_table_c)[f][w][c](fp,src,frames,channels);
+    else if (kind == 2)
+        (vec ? pcmconv_int_planar_table : pcmconv_int_planar_table_c)[f][w][c](ip,src,frames,channels);
+    else
+        (vec ? pcmconv_split_table : pcmconv_split_table_c)[f][w][c](sp,src,frames,channels);
+}
+
+/* Time the SIMD and plain C converters the encoders use on one second of noise in the given
+ * format, in blocks about the size they get them in, and check both give exactly the same result. */
+void pcmconv_benchmark(const AudioFormat &fmt) {
+    const unsigned int block = 1024;
+    const unsigned int frames = fmt.sample_rate;
+    unsigned int blocks,i,w,c,f,kind;
+    uint32_t lcg = 0x87654321u;
+    unsigned char *buf;
+    uint32_t *o1,*o2;
+    size_t bsz;
+
+    if (!pcmconv_index(fmt,w,c) || fmt.bytes_per_frame == 0 || frames < block) {
+        fprintf(stderr,"Unsupported format for conversion benchmark\n");
+        return;
+    }
+
+    f = (fmt.format_tag == AFMT_PCMU) ? 1u : 0u;
+    blocks = frames / block;
+    bsz = (size_t)block * (size_t)fmt.bytes_per_frame;
+    buf = new(std::nothrow) unsigned char[(size_t)blocks * bsz];
+    o1 = new(std::nothrow) uint32_t[(size_t)block * fmt.channels];
+    o2 = new(std::nothrow) uint32_t[(size_t)block * fmt.channels];
+    if (buf == NULL || o1 == NULL || o2 == NULL) {
+        fprintf(stderr,"Out of memory\n");
+        delete[] buf;
+        delete[] o1;
+        delete[] o2;
+        return;
+    }
+
+    for (i=0;i < (blocks * (unsigned int)bsz);i++) {
+        lcg = (lcg * 1103515245u) + 12345u;
+        buf[i] = (unsigned char)(lcg >> 16u);
+    }
+
+    {
+        AudioFormat pf = fmt;
+        printf("Conversion benchmark: %s, %u frame blocks\n",ui_print_format(pf).c_str(),block);
+    }
+
+    for (kind=0;kind < 4;kind++) {
+        double ns[2] = {0,0};
+        bool match = true;
+
+        memset(o1,0,sizeof(uint32_t) * block * fmt.channels);
+        memset(o2,0,sizeof(uint32_t) * block * fmt.channels);
+        for (i=0;i < blocks;i++) {
+            pcmconv_bench_block(kind,false,f,w,c,o1,block,buf + (i * bsz),block,fmt.channels);
+            pcmconv_bench_block(kind,true,f,w,c,o2,block,buf + (i * bsz),block,fmt.channels);
+            if (memcmp(o1,o2,sizeof(uint32_t) * block * fmt.channels) != 0)
+                match = false;
+        }
+
+        for (unsigned int v=0;v < 2;v++) {
+            unsigned long long passes = 0;
+            uint64_t t0,t1;
+
+            t0 = monotonic_clock_us();
+            do {
+                for (i=0;i < blocks;i++)
+                    pcmconv_bench_block(kind,v != 0,f,w,c,o1,block,buf + (i * bsz),block,fmt.channels);
+                passes++;
+                t1 = monotonic_clock_us();
+            } while ((t1 - t0) < (uint64_t)250000u);
+
+            ns[v] = ((double)(t1 - t0) * 1000.0) / ((double)passes * (double)blocks * (double)block);
+        }
+
+#if defined(PCMCONV_HAVE_SSE2)
+        printf("    %-13s c %8.3f ns/frame, sse2 %8.3f ns/frame (%.1fx)%s\n",
+                pcmconv_bench_name[kind],ns[0],ns[1],ns[0] / ns[1],
+                match ? "" : "  MISMATCH with C");
+#else
+        printf("    %-13s c %8.3f ns/frame%s\n",
+                pcmconv_bench_name[kind],ns[0],
+                match ? "" : "  MISMATCH");
+#endif
+    }
+
+    delete[] buf;
+    delete[] o1;
+    delete[] o2;
+}
+
@@ -0,0 +1,81 @@
+#ifndef __PCMCONV_H
+#define __PCMCONV_H
+
+#include "config.h"
+#include "aufmt.h"
+
+#include <stdint.h>
+
+/* Sample format conversion.
+ *
+ * There is one kernel for every (signedness, sample width, channel count) combination, generated
+ * from templates. Writers look theirs up once in SetFormat() and call it through a pointer, so the
+ * loop that runs for every buffer has no format tests in it. Mono, stereo and 8-channel audio get
+ * loops with the channel count fixed at compile time, anything else uses a loop that reads it
+ * from the argument. Source samples are in host byte order, as the audio sources deliver them.
+ *
+ * On x86 the float and int kernels do the bulk of the work four samples at a time with SSE2:
+ * every width is loaded into the top of a 32-bit lane (packed 24-bit included), the sign is
+ * flipped on bit 31 for all of them alike, and mono/stereo are split into planes with shuffles.
+ * The splitter moves 16-bit audio 8 channels by 8 frames at a time, and 32-bit 4 by 4, through
+ * a transpose in registers when the channel count is a multiple of that.
+ * The results are bit-for-bit the same as the plain C loops. */
+
+/* one sample, sign flipped if "flip", as a signed value of its own width. also used by the VU meter */
+template <const unsigned int bytes,const bool flip> struct pcm_sample;
+
+template <const bool flip> struct pcm_sample<1u,flip> {
+    static inline int32_t get(const unsigned char *p) {
+        return (int32_t)((int8_t)(p[0] ^ (flip ? 0x80u : 0x00u)));
+    }
+};
+
+template <const bool flip> struct pcm_sample<2u,flip> {
+    static inline int32_t get(const unsigned char *p) {
+        return (int32_t)((int16_t)(*((const uint16_t*)p) ^ (flip ? 0x8000u : 0x0000u)));
+    }
+};
+
+template <const bool flip> struct pcm_sample<3u,flip> {
+    static inline int32_t get(const unsigned char *p) {
+        /* assemble in the top 24 bits and shift down to sign extend, rather than calling __lesx24(__leu24()) per sample */
+        return (int32_t)(((uint32_t)p[0] << 8u) | ((uint32_t)p[1] << 16u) | ((uint32_t)(p[2] ^ (flip ? 0x80u : 0x00u)) << 24u)) >> 8;
+    }
+};
+
+template <const bool flip> struct pcm_sample<4u,flip> {
+    static inline int32_t get(const unsigned char *p) {
+        return (int32_t)(*((const uint32_t*)p) ^ (flip ? 0x80000000u : 0x00000000u));
+    }
+};
+
+/* interleaved PCM to planar 32-bit int, sample in the most significant bits (LAME) */
+typedef void (*pcmconv_int_planar_t)(int **dst,const void *src,unsigned int frames,unsigned int channels);
+
+/* interleaved PCM to planar float in -1..1 (Vorbis) */
+typedef void (*pcmconv_float_planar_t)(float **dst,const void *src,unsigned int frames,unsigned int channels);
+
+/* interleaved PCM to interleaved float in -1..1 (Opus) */
+typedef void (*pcmconv_float_t)(float *dst,const void *src,unsigned int frames,unsigned int channels);
+
+/* PCM to the same width, little endian, unsigned if 8-bit and signed otherwise (WAV) */
+typedef void (*pcmconv_wav_t)(void *dst,const void *src,unsigned int frames,unsigned int channels);
+
+/* interleaved PCM to one plane per channel, samples unchanged (one mono file per channel) */
+typedef void (*pcmconv_split_t)(void **dst,const void *src,unsigned int frames,unsigned int channels);
+
+/* NULL if the format is not 8/16/24/32-bit PCM */
+pcmconv_int_planar_t pcmconv_get_int_planar(const AudioFormat &fmt);
+pcmconv_float_planar_t pcmconv_get_float_planar(const AudioFormat &fmt);
+pcmconv_float_t pcmconv_get_float(const AudioFormat &fmt);
+pcmconv_wav_t pcmconv_get_wav(const AudioFormat &fmt);
+pcmconv_split_t pcmconv_get_split(const AudioFormat &fmt);
+
+/* does this format need pcmconv_get_wav() at all, or can it be written to a WAV file as is? */
+bool pcmconv_wav_needs_xlat(const AudioFormat &fmt);
+
+/* time the SIMD kernels against the plain C ones for a format, and check they agree */
+void pcmconv_benchmark(const AudioFormat &fmt);
+
+#endif //__PCMCONV_H
+
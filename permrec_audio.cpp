@@ -33,6 +33,14 @@
 #include "opuwrite.h"
 #include "recpath.h"
 #include "ole32.h"
+#include "audring.h"
+#include "drift.h"
+#include "vumeter.h"
+#include "pcmconv.h"
+#include "asyncout.h"
+#include "asyncwav.h"
+#include "multiwav.h"
+#include "splitwav.h"
 
 #include "as_alsa.h"
 #include "as_pulse.h"
@@ -42,6 +50,12 @@
 # include "commctrl.h"
 #endif
 
+#if defined(HAVE_PTHREADS)
+# include <pthread.h>
+# include <atomic>
+# include <deque>
+#endif
+
 enum {
     FILEFMT_NONE=0,
     FILEFMT_WAV,
@@ -57,16 +71,80 @@ enum {
     FILEFMT_MAX
 };
 
+/* name for -ff */
+static const char *filefmt_name(int ff) {
+    switch (ff) {
+        case FILEFMT_WAV:       return "wav";
+#if defined(HAVE_LAME)
+        case FILEFMT_MP3:       return "mp3";
+#endif
+#if defined(HAVE_VORBISENC)
+        case FILEFMT_VORBIS:    return "vorbis";
+#endif
+#if defined(HAVE_OPUSENC)
+        case FILEFMT_OPUS:      return "opus";
+#endif
+        default:                break;
+    }
+
+    return "";
+}
+
+/* file extension */
+static const char *filefmt_suffix(int ff) {
+    switch (ff) {
+        case FILEFMT_WAV:       return ".WAV";
+#if defined(HAVE_LAME)
+        case FILEFMT_MP3:       return ".MP3";
+#endif
+#if defined(HAVE_VORBISENC)
+        case FILEFMT_VORBIS:    return ".OGG";
+#endif
+#if defined(HAVE_OPUSENC)
+        case FILEFMT_OPUS:      return ".opus";
+#endif
+        default:                break;
+    }
+
+    return "";
+}
+
 #ifndef TARGET_GUI
 static std::string          ui_command;
 #endif
 static std::string          ui_source;
 static std::string          ui_device;
+
+/* every -d, with its -s and -opt */
+struct ui_input {
+    std::string             source;
+    std::string             device;
+    std::vector<AudioOptionPair> options;   /* -opt between the last -d and this one */
+};
+static std::vector<ui_input> ui_inputs;
+
 static int                  ui_want_fmt = 0;
 static long                 ui_want_rate = 0;
 static int                  ui_want_channels = 0;
 static int                  ui_want_bits = 0;
-static int                  ui_want_ff = FILEFMT_WAV;
+static unsigned int         ui_want_ff = 1u << FILEFMT_WAV;    /* bitmask, 1u << FILEFMT_* */
+static double               ui_ring_seconds = 4;
+static double               ui_enc_queue_seconds = 10;
+static std::vector<AudioOptionPair> ui_source_options;   /* -opt after the last -d, for all of them */
+static std::string          rec_source_options;             /* as negotiated, single device */
+static unsigned int         ui_drift_window = 600;
+static bool                 ui_drift_wav = false;
+static unsigned long        ui_write_buffer_kb = 1024;
+static unsigned int         ui_write_flush_ms = 2000;
+static int                  ui_write_backend = ASYNCOUT_SYNC;
+static unsigned int         ui_write_depth = 4;
+static unsigned long        ui_iobench_mb = 256;
+static bool                 ui_prealloc = true;
+static unsigned long        ui_writeback_mb = 0;
+static bool                 ui_rf64 = true;
+static bool                 ui_enc_continue = true;
+static bool                 ui_link = false;
+static bool                 ui_split = false;
 
 #ifdef TARGET_GUI_WINDOWS
 DWORD WinCapThreadID = 0;
@@ -86,7 +164,7 @@ static void help(void) {
     fprintf(stderr," -fmt <format>\n");
     fprintf(stderr,"    pcmu    unsigned PCM\n");
     fprintf(stderr,"    pcms    signed PCM\n");
-    fprintf(stderr," -ff <format>\n");
+    fprintf(stderr," -ff <format>[,<format>...]  One or more, recorded at the same time\n");
     fprintf(stderr,"    wav     record as WAV (default)\n");
 #if defined(HAVE_LAME)
     fprintf(stderr,"    mp3     record as MP3\n");
@@ -97,13 +175,58 @@ static void help(void) {
 #if defined(HAVE_OPUSENC)
     fprintf(stderr,"    opus    record as Ogg Opus\n");
 #endif
-    fprintf(stderr," -d <device>\n");
-    fprintf(stderr," -s <source>\n");
+    fprintf(stderr," -split         A mono file per channel (.CH01.WAV, .CH02.WAV...) instead of one with them all\n");
+    fprintf(stderr," -d <device>    Can be given more than once, to record several devices at once,\n");
+    fprintf(stderr,"                each under PERMREC/<device>\n");
+    fprintf(stderr," -s <source>    For the -d after it (or all of them, if it comes last)\n");
+#if defined(HAVE_PTHREADS)
+    fprintf(stderr," -link          Start all the -d devices together and cut them on the same frame, for devices\n");
+    fprintf(stderr,"                on one clock (ALSA snd_pcm_link), so that their files line up sample for sample\n");
+#endif
+    fprintf(stderr," -opt <name>=<value>  Source option, can be given more than once. For the -d after it\n");
+    fprintf(stderr,"                (or all of them, if it comes after the last -d)\n");
+    fprintf(stderr,"    mmap=1       ALSA: capture with mmap access (in place with -rb 0)\n");
+    fprintf(stderr,"    period_us=N  ALSA: period length in microseconds (wakeup rate)\n");
+    fprintf(stderr,"    buffer_us=N  ALSA: buffer length in microseconds (headroom)\n");
+    fprintf(stderr,"    periods=N    ALSA: number of periods in the buffer\n");
+    fprintf(stderr,"    timeout_ms=N PULSE: give up on the server after this long (default 5000)\n");
+    fprintf(stderr," -drift-window <seconds>  Window for the sound card clock rate estimate (default 600)\n");
+    fprintf(stderr," -drift-wav     Also write the measured sample rate into the WAV file (LIST:INFO comment)\n");
+    fprintf(stderr," -wbuf <KB>     Output write buffer size (default 1024, 0 = write as it comes)\n");
+    fprintf(stderr," -wbuf-ms <ms>  Write out the output buffer at least this often (default 2000)\n");
+    fprintf(stderr," -aio <how>     How the output buffers are written\n");
+    fprintf(stderr,"    sync         write() from the recording thread (default)\n");
+#if defined(HAVE_PTHREADS)
+    fprintf(stderr,"    thread       pwrite() from a pool of writer threads\n");
+#endif
+#if defined(HAVE_LINUX_IO_URING_H)
+    fprintf(stderr,"    uring        Linux io_uring, falls back to thread if the kernel refuses\n");
+#endif
+#if !defined(_WIN32)
+    fprintf(stderr,"    mmap         Write (convert) straight into a mapping of the file, in windows of -wbuf (at least 8MB)\n");
+#endif
+    fprintf(stderr," -aio-depth <n> Output buffers per file, the most writes in flight (default 4)\n");
+    fprintf(stderr," -no-prealloc   Don't reserve disk space for the whole WAV file when it is opened\n");
+    fprintf(stderr," -no-rf64       Start a new WAV file at 2GB instead of switching to RF64\n");
+    fprintf(stderr," -no-enc-continue  Start the encoder over in every file instead of carrying it across cuts\n");
+    fprintf(stderr,"                (it is only carried across when encoding on the encoder threads, see -enc-queue)\n");
+    fprintf(stderr," -writeback <MB>  Write back and drop recorded data from the page cache every <MB> (default 0 = off)\n");
+#if defined(HAVE_PTHREADS)
+    fprintf(stderr," -aio-threads <n>  Writer threads for -aio thread (default 2)\n");
+#endif
+#if defined(HAVE_PTHREADS)
+    fprintf(stderr," -rb <seconds>  Capture ring buffer length (default 4, 0 = no capture thread)\n");
+    fprintf(stderr," -enc-queue <seconds>  Encode MP3/Vorbis/Opus on the encoder threads, this much audio queued for each\n");
+    fprintf(stderr,"                at most (default 10, 0 = encode on the recording thread)\n");
+    fprintf(stderr," -enc-threads <n>  Encoder threads shared by all of those outputs (default 0 = one per CPU)\n");
+#endif
     fprintf(stderr," -c <command>\n");
     fprintf(stderr,"    rec          Record\n");
     fprintf(stderr,"    test         Test format\n");
     fprintf(stderr,"    listsrc      List audio sources\n");
     fprintf(stderr,"    listdev      List audio devices\n");
+    fprintf(stderr,"    bench        Benchmark VU metering and sample conversion (8ch 192KHz 16-bit unless -ch -sr -bs -fmt)\n");
+    fprintf(stderr,"    iobench      Benchmark the -aio methods, in the current directory (-iobench-mb <MB>, default 256)\n");
 }
 
 static int parse_argv(int argc,char **argv) {
@@ -123,21 +246,25 @@ static int parse_argv(int argc,char **argv) {
                 a = argv[i++];
                 if (a == NULL) return 1;
 
-                if (!strcmp(a,"wav"))
-                    ui_want_ff = FILEFMT_WAV;
-#if defined(HAVE_LAME)
-                else if (!strcmp(a,"mp3"))
-                    ui_want_ff = FILEFMT_MP3;
-#endif
-#if defined(HAVE_VORBISENC)
-                else if (!strcmp(a,"vorbis"))
-                    ui_want_ff = FILEFMT_VORBIS;
-#endif
-#if defined(HAVE_OPUSENC)
-                else if (!strcmp(a,"opus"))
-                    ui_want_ff = FILEFMT_OPUS;
-#endif
-                else
+                /* one or more, comma separated, all recorded at once */
+                ui_want_ff = 0;
+                while (1) {
+                    char *e = strchr(a,',');
+                    const std::string n = e != NULL ? std::string(a,(size_t)(e - a)) : std::string(a);
+                    int ff;
+
+                    for (ff=FILEFMT_NONE+1;ff < FILEFMT_MAX;ff++) {
+                        if (n == filefmt_name(ff))
+                            break;
+                    }
+                    if (ff >= FILEFMT_MAX)
+                        return 1;
+
+                    ui_want_ff |= 1u << (unsigned int)ff;
+                    if (e == NULL) break;
+                    a = e + 1;
+                }
+                if (ui_want_ff == 0)
                     return 1;
             }
             else if (!strcmp(a,"fmt")) {
@@ -180,10 +307,121 @@ static int parse_argv(int argc,char **argv) {
                 ui_source = a;
             }
             else if (!strcmp(a,"d")) {
+                ui_input in;
+
                 a = argv[i++];
                 if (a == NULL) return 1;
                 ui_device = a;
+
+                /* with the -s before it, if any, and the -opt since the last -d */
+                in.source = ui_source;
+                in.device = a;
+                in.options.swap(ui_source_options);
+                ui_inputs.push_back(in);
+            }
+            else if (!strcmp(a,"opt")) {
+                AudioOptionPair p;
+                const char *eq;
+
+                a = argv[i++];
+                if (a == NULL) return 1;
+
+                if ((eq=strchr(a,'=')) != NULL) {
+                    p.name = std::string(a,(size_t)(eq - a));
+                    p.value = eq + 1;
+                }
+                else {
+                    p.name = a;
+                    p.value = "1";
+                }
+
+                if (p.name.empty()) return 1;
+                ui_source_options.push_back(p);
+            }
+            else if (!strcmp(a,"drift-window")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_drift_window = (unsigned int)strtoul(a,NULL,0);
+                if (ui_drift_window < 30u || ui_drift_window > 86400u) return 1;
+            }
+            else if (!strcmp(a,"drift-wav")) {
+                ui_drift_wav = true;
+            }
+            else if (!strcmp(a,"wbuf")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_write_buffer_kb = strtoul(a,NULL,0);
+                if (ui_write_buffer_kb > 65536ul) return 1;
+            }
+            else if (!strcmp(a,"wbuf-ms")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_write_flush_ms = (unsigned int)strtoul(a,NULL,0);
+                if (ui_write_flush_ms > 3600000u) return 1;
+            }
+            else if (!strcmp(a,"aio")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_write_backend = AsyncOutput::BackendParse(a);
+                if (ui_write_backend < 0) return 1;
+            }
+            else if (!strcmp(a,"aio-depth")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_write_depth = (unsigned int)strtoul(a,NULL,0);
+                if (ui_write_depth < 1u || ui_write_depth > 64u) return 1;
+            }
+            else if (!strcmp(a,"aio-threads")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                AsyncOutput::SetThreads((unsigned int)strtoul(a,NULL,0));
+            }
+            else if (!strcmp(a,"writeback")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_writeback_mb = strtoul(a,NULL,0);
+                if (ui_writeback_mb > 4096ul) return 1;
+            }
+            else if (!strcmp(a,"no-rf64")) {
+                ui_rf64 = false;
+            }
+            else if (!strcmp(a,"link")) {
+                ui_link = true;
+            }
+            else if (!strcmp(a,"split")) {
+                ui_split = true;
+            }
+            else if (!strcmp(a,"no-enc-continue")) {
+                ui_enc_continue = false;
+            }
+            else if (!strcmp(a,"no-prealloc")) {
+                ui_prealloc = false;
+            }
+            else if (!strcmp(a,"iobench-mb")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_iobench_mb = strtoul(a,NULL,0);
+                if (ui_iobench_mb < 1ul || ui_iobench_mb > 65536ul) return 1;
+            }
+#if defined(HAVE_PTHREADS)
+            else if (!strcmp(a,"rb")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_ring_seconds = atof(a);
+                if (ui_ring_seconds != 0 && (ui_ring_seconds < 0.25 || ui_ring_seconds > 600)) return 1;
+            }
+            else if (!strcmp(a,"enc-queue")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                ui_enc_queue_seconds = atof(a);
+                if (ui_enc_queue_seconds != 0 && (ui_enc_queue_seconds < 0.25 || ui_enc_queue_seconds > 600)) return 1;
             }
+            else if (!strcmp(a,"enc-threads")) {
+                a = argv[i++];
+                if (a == NULL) return 1;
+                AsyncWAVWriter::SetThreads((unsigned int)strtoul(a,NULL,0));
+            }
+#endif
             else {
                 fprintf(stderr,"Unknown switch %s\n",a);
                 return 1;
@@ -200,6 +438,12 @@ static int parse_argv(int argc,char **argv) {
         return 1;
     }
 
+    /* -d before any -s record from the last -s */
+    for (size_t j=0;j < ui_inputs.size();j++) {
+        if (ui_inputs[j].source.empty())
+            ui_inputs[j].source = ui_source;
+    }
+
     return 0;
 }
 #endif
@@ -215,12 +459,36 @@ void ui_apply_format(AudioFormat &fmt) {
         fmt.bits_per_sample = (uint8_t)ui_want_bits;
 }
 
-bool ui_apply_options(AudioSource* alsa,AudioFormat &fmt) {
-    if (alsa->SelectDevice(ui_device.c_str()) < 0) {
+/* select, configure and open 'device' with the -opt given for it ('options') and those for all of
+ * them. 'negotiated' is what the source settled on, for the recording's sidecar */
+bool ui_apply_options(AudioSource* alsa,AudioFormat &fmt,const std::string &device,const std::vector<AudioOptionPair> &options,std::string &negotiated) {
+    int r;
+
+    if (alsa->SelectDevice(device.c_str()) < 0) {
         fprintf(stderr,"Unable to set device\n");
         return false;
     }
 
+    for (auto i=options.begin();i != options.end();i++) {
+        if (alsa->SetOption((*i).name.c_str(),(*i).value.c_str()) < 0) {
+            fprintf(stderr,"Unable to set option '%s' to '%s'\n",(*i).name.c_str(),(*i).value.c_str());
+            return false;
+        }
+    }
+
+    /* with several devices, these may well be meant for another kind of source than this one */
+    for (auto i=ui_source_options.begin();i != ui_source_options.end();i++) {
+        if ((r=alsa->SetOption((*i).name.c_str(),(*i).value.c_str())) < 0) {
+            if ((r == -ENOENT || r == -ENOSPC) && ui_inputs.size() > 1) {
+                fprintf(stderr,"Option '%s' does not apply to %s, ignored\n",(*i).name.c_str(),alsa->GetSourceName());
+                continue;
+            }
+
+            fprintf(stderr,"Unable to set option '%s' to '%s'\n",(*i).name.c_str(),(*i).value.c_str());
+            return false;
+        }
+    }
+
     fmt.format_tag = 0;
     if (alsa->GetFormat(fmt) < 0) {
         /* some sources don't have a default */
@@ -248,26 +516,461 @@ bool ui_apply_options(AudioSource* alsa,AudioFormat &fmt) {
         return false;
     }
 
+    /* what the source actually negotiated */
+    {
+        std::vector<AudioOptionPair> l;
+
+        negotiated.clear();
+        if (alsa->EnumOptions(l) >= 0) {
+            for (auto i=l.begin();i != l.end();i++) {
+                if (!negotiated.empty()) negotiated += " ";
+                negotiated += (*i).name + "=" + (*i).value;
+            }
+        }
+
+        if (!negotiated.empty())
+            printf("Source options: %s\n",negotiated.c_str());
+    }
+
     return true;
 }
 
+/* the one device, -d or the default */
+bool ui_apply_options(AudioSource* alsa,AudioFormat &fmt) {
+    static const std::vector<AudioOptionPair> none;
+
+    return ui_apply_options(alsa,fmt,ui_device,ui_inputs.size() == 1 ? ui_inputs[0].options : none,rec_source_options);
+}
+
 #define OVERREAD (16u)
 
-static unsigned char audio_tmp[4096u + OVERREAD];
+/* Everything that makes up one recording on disk */
+struct rec_segment {
+    std::string         path_base;
+    std::string         path_wav;           /* the first of path_out, for display */
+    std::vector<std::string> path_out;      /* one per -ff format, or per format and channel with -split */
+    unsigned int        path_split;         /* files per format */
+    std::string         path_info;
+    WAVWriter*          out;
+    FILE*               info;
+    time_t              when;
+
+    rec_segment() : path_split(1), out(NULL), info(NULL), when(0) { }
+};
+
+/* One device being recorded: the capture thread and ring, the recording in progress and
+ * the segment thread that opens and closes its files. Each -d gets one of these, and when
+ * there are several they record at the same time, each on a thread of its own. */
+class Recorder {
+public:
+    Recorder();
+    ~Recorder();
+public:
+    bool Run(AudioSource* alsa,const AudioFormat &fmt);
+    void SetSubdir(const std::string &s);
+    void SetSourceOptions(const std::string &s);
+    void SetDraw(bool en);
+#if defined(HAVE_PTHREADS)
+    void SetCutLeader(Recorder *r);
+#endif
+    std::string Status(void) const;
+    double Seconds(void) const;
+    unsigned long Files(void) const;
+    unsigned long Overflows(void) const;
+    unsigned long long OverflowBytes(void) const;
+private:
+    void capture_anchor_set(unsigned long long frame,const AudioTimestamp &ts);
+    void capture_drift_reset(void);
+    void capture_xrun_check(AudioSource* alsa,unsigned long &xruns);
+    bool capture_time_of_frame(unsigned long long frame,AudioTimestamp &ts);
+    bool capture_drift_rate(double &rate,double &span);
+    std::string capture_drift_write(FILE *fp);
+    void capture_time_write(FILE *fp,const char *what,unsigned long long frame);
+    void ui_recording_draw(void);
+    void VU_init(const AudioFormat &fmt);
+    void VU_advance(const void *audio_tmp,unsigned int rd);
+    WAVWriter *segment_output(int ff,const AudioFormat &fmt,time_t when);
+    WAVWriter *segment_outputs(const AudioFormat &fmt,time_t when,std::string &suffix);
+    bool segment_create(rec_segment &seg,time_t when);
+#if defined(HAVE_PTHREADS)
+    static void *segment_thread_proc(void *arg);
+    void segment_thread_main(void);
+    void segment_thread_start(void);
+    void segment_thread_stop(void);
+    void segment_prepare(time_t when);
+    bool segment_take(time_t when,rec_segment &seg);
+#endif
+    void segment_retire(rec_segment &seg);
+    void finishing_retire(void);
+    void recording_detach(rec_segment &seg);
+    void close_recording(void);
+    bool open_recording(time_t when);
+    bool cut_recording(time_t when);
+    void record_update_cut_frame(void);
+#if defined(HAVE_PTHREADS)
+    bool cut_shared(time_t when,unsigned long long &frame);
+#endif
+    bool record_write(const void *buf,unsigned int len);
+    bool record_process(const void *buf,unsigned int len);
+    void record_check_auto_cut(void);
+    void record_loop_direct(AudioSource* alsa);
+#if defined(HAVE_PTHREADS)
+    void capture_notify(void);
+    static void *capture_thread_proc(void *arg);
+    void capture_thread_main(void);
+    void capture_thread_watch(AudioSource* alsa);
+    bool capture_thread_start(AudioSource* alsa);
+    void capture_thread_stop(void);
+    void capture_wait(void);
+    bool capture_drain(void);
+    void record_loop_threaded(void);
+#endif
+private:
+    unsigned char                       audio_tmp[4096u + OVERREAD];
+
+    std::string                         subdir;             /* under PERMREC, if not recording there directly */
+    std::string                         source_options;     /* as the source negotiated them */
+    bool                                draw;               /* VU meter and time on the console (or the GUI) */
+    AudioSource*                        source;
+
+    /* for Status(), from another thread, when not drawing */
+    std::atomic<unsigned int>           shown_peak;
+    std::atomic<bool>                   shown_clip;
+
+    AudioFormat                         rec_fmt;
+    unsigned int                        VU_dec;
+    unsigned long long                  framecount;
+    /* one channel's meter. the three are stepped together, so keep them together */
+    struct VUChannel {
+        unsigned int                    peak;
+        unsigned int                    rms;
+        unsigned long                   clip;               /* frames left to show the clip indicator */
+    };
+    VUChannel                           VU[VU_MAX_CHANNELS];
+    VUKernel                            VUkern;
+
+    std::string                         rec_path_wav;
+    std::string                         rec_path_info;
+    std::string                         rec_path_base;
+    WAVWriter*                          wav_out;
+    FILE*                               wav_info;
+    bool                                wav_info_need_time;
+    unsigned long                       files;              /* recordings opened */
+
+    /* when the current recording is cut, see autocut.h */
+    time_t                              next_auto_cut;
+
+    /* Latest capture timestamp from the source, and which frame (counting like framecount) it
+     * belongs to. Written by whichever thread reads from the source, read by the recording thread. */
+    AudioTimestamp                      capture_anchor;
+    bool                                capture_anchor_valid;
+
+    /* Sound card rate as measured against the monotonic clock, fed from every anchor.
+     * Shares the anchor lock. */
+    ClockDriftEstimator                 capture_drift;
+
+    /* capture time of the first frame of the current recording, to measure the rate across the whole file */
+    AudioTimestamp                      rec_first_time;
+    bool                                rec_first_time_valid;
+
+    /* frame (counting like framecount) where the next auto-cut happens, once we know when frames are captured */
+    unsigned long long                  rec_cut_frame;
+    bool                                rec_cut_frame_valid;
+
+    /* The recording before this one, while the encoder carried over from it still owes it data.
+     * It is retired as soon as it doesn't, see WAVWriter::Finishing(). */
+    rec_segment                         rec_finishing;
+
+    bool                                backlog_warned;
+
+#if defined(HAVE_PTHREADS)
+    /* Capture runs on its own thread and pushes into a pre-allocated lock-free ring.
+     * The recording thread drains the ring for metering and encoding, so a slow encoder
+     * or a disk stall fills the ring instead of overrunning the audio device. */
+    AudioRing                           capture_ring;
+    pthread_t                           capture_thread;
+    bool                                capture_thread_running;
+    pthread_mutex_t                     capture_mutex;
+    pthread_cond_t                      capture_cond;
+    std::atomic<bool>                   capture_stop;
+    std::atomic<int>                    capture_error;
+    std::atomic<size_t>                 capture_ring_peak;
+    std::atomic<unsigned long>          capture_overflows;
+    std::atomic<unsigned long long>     capture_overflow_bytes;
+    unsigned long                       capture_overflows_reported;
+    unsigned long                       capture_overflows_at_open;
+    unsigned long long                  capture_overflow_bytes_at_open;
+    pthread_mutex_t                     capture_anchor_mutex;
+
+    /* The segment thread opens the next recording a few seconds before the cut and finalizes
+     * the previous one after it, so that the recording thread only swaps pointers at the cut. */
+    pthread_t                           segment_thread;
+    bool                                segment_thread_running;
+    pthread_mutex_t                     segment_mutex;
+    pthread_cond_t                      segment_cond;
+    bool                                segment_stop;
+    time_t                              segment_want;       /* prepare a recording starting at this time */
+    time_t                              segment_creating;   /* segment thread is preparing this one now */
+    time_t                              segment_failed;     /* and don't keep trying this one */
+    bool                                segment_ready;
+    rec_segment                         segment_next;       /* prepared, valid if segment_ready */
+    std::deque<rec_segment>             segment_retired;    /* closed, waiting to be finalized */
+
+    /* Devices started together on one clock cut on the frame the leader works out, so that
+     * their files line up. The leader publishes its cut frame here for the others, which use
+     * it while it is within cut_shared_slack_ms of their own. The cut it last made is kept
+     * too, for the others that have not got there yet. */
+    Recorder*                           cut_leader;
+    bool                                cut_publish;
+    pthread_mutex_t                     cut_mutex;
+    time_t                              cut_when;
+    unsigned long long                  cut_frame;
+    bool                                cut_valid;
+    time_t                              cut_prev_when;
+    unsigned long long                  cut_prev_frame;
+#endif
+};
+
+Recorder::Recorder() : draw(true), source(NULL), shown_peak(0), shown_clip(false), VU_dec(1), framecount(0), wav_out(NULL), wav_info(NULL), wav_info_need_time(false),
+    files(0), next_auto_cut(0), capture_anchor_valid(false), rec_first_time_valid(false), rec_cut_frame(0), rec_cut_frame_valid(false), backlog_warned(false)
+#if defined(HAVE_PTHREADS)
+    , capture_thread_running(false), capture_stop(false), capture_error(0), capture_ring_peak(0), capture_overflows(0), capture_overflow_bytes(0),
+    capture_overflows_reported(0), capture_overflows_at_open(0), capture_overflow_bytes_at_open(0),
+    segment_thread_running(false), segment_stop(false), segment_want(0), segment_creating(0), segment_failed(0), segment_ready(false),
+    cut_leader(NULL), cut_publish(false), cut_when(0), cut_frame(0), cut_valid(false), cut_prev_when(0), cut_prev_frame(0)
+#endif
+{
+    for (unsigned int i=0;i < VU_MAX_CHANNELS;i++) {
+        VU[i].clip = 0u;
+        VU[i].rms = 0u;
+        VU[i].peak = 0u;
+    }
+
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_init(&capture_mutex,NULL);
+    pthread_cond_init(&capture_cond,NULL);
+    pthread_mutex_init(&capture_anchor_mutex,NULL);
+    pthread_mutex_init(&segment_mutex,NULL);
+    pthread_cond_init(&segment_cond,NULL);
+    pthread_mutex_init(&cut_mutex,NULL);
+#endif
+}
+
+Recorder::~Recorder() {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_destroy(&cut_mutex);
+    pthread_cond_destroy(&segment_cond);
+    pthread_mutex_destroy(&segment_mutex);
+    pthread_mutex_destroy(&capture_anchor_mutex);
+    pthread_cond_destroy(&capture_cond);
+    pthread_mutex_destroy(&capture_mutex);
+#endif
+}
+
+/* record under PERMREC/<s> instead of PERMREC */
+void Recorder::SetSubdir(const std::string &s) {
+    subdir = s;
+}
+
+/* what the source negotiated, for the sidecar */
+void Recorder::SetSourceOptions(const std::string &s) {
+    source_options = s;
+}
+
+/* off when several devices are recording, the caller draws one status line for all of them */
+void Recorder::SetDraw(bool en) {
+    draw = en;
+}
+
+#if defined(HAVE_PTHREADS)
+/* cut on the same frames as 'r', which was started together with this one. Before Run() */
+void Recorder::SetCutLeader(Recorder *r) {
+    if (r == this) return;
+
+    cut_leader = r;
+    if (r != NULL) r->cut_publish = true;
+}
+
+/* the frame the leader cuts on at 'when', if it knows */
+bool Recorder::cut_shared(time_t when,unsigned long long &frame) {
+    bool ok;
+
+    pthread_mutex_lock(&cut_mutex);
+    if (when == (time_t)0) {
+        ok = false;
+    }
+    else if (cut_valid && cut_when == when) {
+        frame = cut_frame;
+        ok = true;
+    }
+    else if (cut_prev_when == when) {
+        frame = cut_prev_frame;
+        ok = true;
+    }
+    else {
+        ok = false;
+    }
+    pthread_mutex_unlock(&cut_mutex);
+
+    return ok;
+}
+#endif
+
+void Recorder::capture_anchor_set(unsigned long long frame,const AudioTimestamp &ts) {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&capture_anchor_mutex);
+#endif
+    capture_anchor = ts;
+    capture_anchor.frame = frame;
+    capture_anchor_valid = true;
+    capture_drift.Add(frame,ts.mono_us);
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock(&capture_anchor_mutex);
+#endif
+}
+
+/* audio was lost: the frame count no longer follows the clock, measure the drift afresh */
+void Recorder::capture_drift_reset(void) {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&capture_anchor_mutex);
+#endif
+    capture_drift.Reset();
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock(&capture_anchor_mutex);
+#endif
+}
+
+/* before the next anchor, in case the source lost audio since the last one */
+void Recorder::capture_xrun_check(AudioSource* alsa,unsigned long &xruns) {
+    const unsigned long x = alsa->Xruns();
+
+    if (x != xruns) {
+        xruns = x;
+        capture_drift_reset();
+    }
+}
+
+/* when was this frame captured? counts forward or back from the latest anchor */
+bool Recorder::capture_time_of_frame(unsigned long long frame,AudioTimestamp &ts) {
+    bool ok;
+
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&capture_anchor_mutex);
+#endif
+    ts = capture_anchor;
+    ok = capture_anchor_valid;
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock(&capture_anchor_mutex);
+#endif
+
+    if (!ok || rec_fmt.sample_rate == 0)
+        return false;
+
+    const int64_t d = (int64_t)(((double)((int64_t)frame - (int64_t)ts.frame) * 1000000.0) / (double)rec_fmt.sample_rate);
+
+    ts.mono_us = (uint64_t)((int64_t)ts.mono_us + d);
+    ts.wall_us = (uint64_t)((int64_t)ts.wall_us + d);
+    ts.frame = frame;
+    return true;
+}
+
+/* effective sample rate over the drift window. false if there is not enough history yet */
+bool Recorder::capture_drift_rate(double &rate,double &span) {
+    bool ok;
+
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&capture_anchor_mutex);
+#endif
+    ok = capture_drift.IsValid();
+    rate = capture_drift.Rate();
+    span = capture_drift.Span();
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock(&capture_anchor_mutex);
+#endif
+
+    return ok;
+}
+
+/* Write what the sound card clock actually did during this recording, so that timing can be
+ * corrected later from the .TXT files alone. Returns a one line summary for the WAV header. */
+std::string Recorder::capture_drift_write(FILE *fp) {
+    std::string summary;
+    double rate,span;
+    AudioTimestamp ts;
+    char tmp[256];
+
+    if (fp == NULL || rec_fmt.sample_rate == 0)
+        return summary;
+
+    /* across the whole file, from the capture times of its first and last frames */
+    if (rec_first_time_valid && capture_time_of_frame(framecount,ts) && ts.mono_us > rec_first_time.mono_us) {
+        span = (double)(ts.mono_us - rec_first_time.mono_us) / 1000000.0;
+        rate = (double)(ts.frame - rec_first_time.frame) / span;
+
+        if (span >= 10.0) {
+            sprintf(tmp,"Measured sample rate %.6fHz (%+.3fppm) across %.3f seconds",
+                    rate,ClockDriftEstimator::RatePPM(rate,rec_fmt.sample_rate),span);
+            fprintf(fp,"%s of recording, %llu frames\n",tmp,ts.frame - rec_first_time.frame);
+            summary = tmp;
+        }
+    }
+
+    /* and the most recent stretch, which tracks temperature changes more closely */
+    if (capture_drift_rate(rate,span)) {
+        sprintf(tmp,"Measured sample rate %.6fHz (%+.3fppm) across %.3f seconds",
+                rate,ClockDriftEstimator::RatePPM(rate,rec_fmt.sample_rate),span);
+        fprintf(fp,"%s of capture ending here\n",tmp);
+        if (summary.empty()) summary = tmp;
+    }
+
+    return summary;
+}
+
+void Recorder::capture_time_write(FILE *fp,const char *what,unsigned long long frame) {
+    AudioTimestamp ts;
+
+    if (fp == NULL || !capture_time_of_frame(frame,ts))
+        return;
+
+    time_t now = (time_t)(ts.wall_us / (uint64_t)1000000u);
+#if defined(WIN32)
+    struct tm *tm = localtime(&now); /* per-thread in the MS C runtime */
+#else
+    struct tm tmbuf; /* other devices' recorders may be formatting times too */
+    struct tm *tm = localtime_r(&now,&tmbuf);
+#endif
+
+    if (tm != NULL) {
+        fprintf(fp,"%s Y-M-D-H-M-S %04u-%02u-%02u %02u:%02u:%02u.%06u monotonic %llu.%06u frame %llu\n",
+                what,
+                tm->tm_year+1900,
+                tm->tm_mon+1,
+                tm->tm_mday,
+                tm->tm_hour,
+                tm->tm_min,
+                tm->tm_sec,
+                (unsigned int)(ts.wall_us % (uint64_t)1000000u),
+                (unsigned long long)(ts.mono_us / (uint64_t)1000000u),
+                (unsigned int)(ts.mono_us % (uint64_t)1000000u),
+                frame);
+    }
+}
+
+void Recorder::ui_recording_draw(void) {
+    if (!draw) {
+        unsigned int peak = 0,ch;
+        bool clip = false;
 
-AudioFormat rec_fmt;
-unsigned int VU_dec = 1;
-unsigned long long framecount = 0;
-unsigned long VUclip[8];
-unsigned int VU[8];
+        for (ch=0;ch < rec_fmt.channels && ch < VU_MAX_CHANNELS;ch++) {
+            if (peak < VU[ch].peak) peak = VU[ch].peak;
+            if (VU[ch].clip > 0ul) clip = true;
+        }
 
-std::string rec_path_wav;
-std::string rec_path_info;
-std::string rec_path_base;
-WAVWriter* wav_out = NULL;
-FILE *wav_info = NULL;
+        shown_peak.store(peak,std::memory_order_relaxed);
+        shown_clip.store(clip,std::memory_order_relaxed);
+        return;
+    }
 
-void ui_recording_draw(void) {
 #ifdef TARGET_GUI_WINDOWS
     std::string msg;
 
@@ -306,14 +1009,14 @@ void ui_recording_draw(void) {
 	    unsigned int L,R;
             double d;
 
-            d = dBFS_measure((double)VU[0] / 65535);
+            d = dBFS_measure((double)VU[0].peak / 65535);
             d = (d + 48) / 48; // VU meters are much longer in Windows GUI
             if (d < 0) d = 0;
             if (d > 1) d = 1;
             L = (unsigned int)((d * 0x7FFFul) + 0.5);
 
 	    if (rec_fmt.channels >= 2) {
-		    d = dBFS_measure((double)VU[0] / 65535);
+		    d = dBFS_measure((double)VU[1].peak / 65535);
 		    d = (d + 48) / 48; // vu meters are much longer in windows gui
 		    if (d < 0) d = 0;
 		    if (d > 1) d = 1;
@@ -351,28 +1054,49 @@ void ui_recording_draw(void) {
     }
 
     {
-        unsigned int barl = 34u / rec_fmt.channels;
-        unsigned int i,im,ch,chmax;
+        unsigned int i,im,ir,ch,chmax,barl;
         char tmp[36];
         double d;
 
         chmax = rec_fmt.channels;
         if (chmax > 2) chmax = 2;
+        barl = 34u / chmax;
 
         for (ch=0;ch < chmax;ch++) {
-            d = dBFS_measure((double)VU[ch] / 65535);
+            d = dBFS_measure((double)VU[ch].rms / 65535);
+            d = (d + 48) / 48;
+            if (d < 0) d = 0;
+            if (d > 1) d = 1;
+            ir = (unsigned int)((d * barl) + 0.5);
+
+            d = dBFS_measure((double)VU[ch].peak / 65535);
             d = (d + 48) / 48;
             if (d < 0) d = 0;
             if (d > 1) d = 1;
             im = (unsigned int)((d * barl) + 0.5);
-            for (i=0;i < im;i++) tmp[i] = '=';
+            if (ir > im) ir = im;
+
+            /* '#' up to the RMS level, '=' on up to the peak */
+            for (i=0;i < ir;i++) tmp[i] = '#';
+            for (   ;i < im;i++) tmp[i] = '=';
             for (   ;i < barl;i++) tmp[i] = ' ';
-            tmp[i++] = VUclip[ch] > 0l ? '@' : '|';
+            tmp[i++] = VU[ch].clip > 0l ? '@' : '|';
             tmp[i++] = 0;
             assert(i <= sizeof(tmp));
 
             printf("%s",tmp);
         }
+
+        /* the rest don't fit on the line. say how many, and if any of them is clipping */
+        if (rec_fmt.channels > chmax) {
+            bool clip = false;
+
+            for (ch=chmax;ch < rec_fmt.channels;ch++) {
+                if (VU[ch].clip > 0ul) clip = true;
+            }
+
+            printf(" +%uch%c",(unsigned int)rec_fmt.channels - chmax,clip ? '@' : ' ');
+        }
     }
 
     printf("\x0D");
@@ -380,163 +1104,469 @@ void ui_recording_draw(void) {
 #endif
 }
 
-void VU_init(const AudioFormat &fmt) {
+void Recorder::VU_init(const AudioFormat &fmt) {
     VU_dec = (unsigned int)((4410000ul / fmt.sample_rate) / 10ul);
     if (VU_dec == 0) VU_dec = 1;
+
+    /* the format doesn't change while recording, so pick the metering code now */
+    if (!VU_kernel_for(VUkern,fmt))
+        fprintf(stderr,"VU meter does not support this format\n");
 }
 
-void VU_advance_ch(const unsigned int ch,const unsigned int val) {
-    if (VU[ch] < val)
-        VU[ch] = val;
-    else if (VU[ch] >= VU_dec)
-        VU[ch] -= VU_dec;
-    else if (VU[ch] > 0u)
-        VU[ch] = 0;
+/* Meter a whole block at once: peak and RMS per channel from the block kernel, then the
+ * decay and clip hold stepped forward by the length of the block in one go. */
+void Recorder::VU_advance(const void *audio_tmp,unsigned int rd) {
+    const unsigned int frames = rd / rec_fmt.bytes_per_frame;
+    unsigned int ch,chmax;
+    VUBlock b;
 
-    if (VU[ch] >= 0xFFF0u)
-        VUclip[ch] = rec_fmt.sample_rate;
-    else if (VUclip[ch] > 0u)
-        VUclip[ch]--;
-}
+    if (frames == 0u)
+        return;
 
-void VU_advance_pcmu_8(const uint8_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+    VU_measure_block(b,audio_tmp,frames,VUkern);
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs((int)audio_tmp[ch] - 0x80) * 2u * 256u;
-            VU_advance_ch(ch,val);
-        }
+    const unsigned long dec = (unsigned long)VU_dec * (unsigned long)frames;
 
-        audio_tmp += rec_fmt.channels;
-    }
-}
+    chmax = rec_fmt.channels;
+    if (chmax > VU_MAX_CHANNELS) chmax = VU_MAX_CHANNELS;
 
-void VU_advance_pcmu_16(const uint16_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+    for (ch=0;ch < chmax;ch++) {
+        VUChannel &v = VU[ch];
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs((long)audio_tmp[ch] - 0x8000l) * 2u;
-            VU_advance_ch(ch,val);
-        }
+        if ((unsigned long)v.peak >= dec)
+            v.peak -= (unsigned int)dec;
+        else
+            v.peak = 0;
+
+        if (v.peak < b.peak[ch])
+            v.peak = b.peak[ch];
+
+        v.rms = (unsigned int)(sqrt((double)b.sumsq[ch] / (double)frames) + 0.5);
 
-        audio_tmp += rec_fmt.channels;
+        if (v.peak >= 0xFFF0u)
+            v.clip = rec_fmt.sample_rate;
+        else if (v.clip > (unsigned long)frames)
+            v.clip -= (unsigned long)frames;
+        else
+            v.clip = 0;
     }
 }
 
-void VU_advance_pcmu_24(const unsigned char *audio_tmp,unsigned int rds) {
-    unsigned int ch;
-
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs((__leu24(audio_tmp) - 0x800000l) / 128l);
-            VU_advance_ch(ch,val);
-	    audio_tmp += 3;
-        }
+/* flush and close a recording. this is the slow part: WAV header patching, encoder flush */
+static void segment_finish(rec_segment &seg) {
+    if (seg.out != NULL) {
+        std::string st;
+
+        seg.out->Close();
+        st = seg.out->OutputStats();
+        if (seg.info != NULL && !st.empty())
+            fprintf(seg.info,"Output: %s\n",st.c_str());
+        st = seg.out->EncoderStats();
+        if (seg.info != NULL && !st.empty())
+            fprintf(seg.info,"Encoder: %s\n",st.c_str());
+
+        delete seg.out;
+        seg.out = NULL;
     }
+    if (seg.info != NULL) {
+        fclose(seg.info);
+        seg.info = NULL;
+    }
+}
+
+/* close and delete a recording that never got any audio */
+static void segment_discard(rec_segment &seg) {
+    segment_finish(seg);
+    for (size_t i=0;i < seg.path_out.size();i++) unlink(seg.path_out[i].c_str());
+    if (!seg.path_info.empty()) unlink(seg.path_info.c_str());
 }
 
-void VU_advance_pcmu_32(const uint32_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+/* one output of a recording in file format 'ff', set up but not opened */
+WAVWriter *Recorder::segment_output(int ff,const AudioFormat &fmt,time_t when) {
+#if defined(HAVE_PTHREADS)
+    const bool async = ui_enc_queue_seconds > 0 && ff != FILEFMT_WAV;
+#else
+    const bool async = false;
+#endif
+    WAVWriter *w = NULL;
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs(((long)((int32_t)(audio_tmp[ch] ^ (uint32_t)0x80000000ul))) / 32768l);
-            VU_advance_ch(ch,val);
-        }
+    if (ff == FILEFMT_WAV)
+        w = new WAVWriter();
+#if defined(HAVE_LAME)
+    else if (ff == FILEFMT_MP3)
+        w = new MP3Writer();
+#endif
+#if defined(HAVE_VORBISENC)
+    else if (ff == FILEFMT_VORBIS)
+        w = new VorbisWriter();
+#endif
+#if defined(HAVE_OPUSENC)
+    else if (ff == FILEFMT_OPUS)
+        w = new OpusWriter();
+#endif
+    else
+        abort();
 
-        audio_tmp += rec_fmt.channels;
+    if (w == NULL)
+        return NULL;
+    if (!w->SetFormat(fmt)) {
+        fprintf(stderr,"WAVE format rejected (%s)\n",filefmt_name(ff));
+        delete w;
+        return NULL;
     }
+    w->SetWriteBuffer((size_t)ui_write_buffer_kb * (size_t)1024u,ui_write_flush_ms);
+    w->SetOutput(ui_write_backend,ui_write_depth);
+    w->SetWriteback((size_t)ui_writeback_mb * (size_t)1024u * (size_t)1024u);
+    w->SetRF64(ui_rf64);
+    /* Carrying the encoder across a cut ends the previous file in ContinueFrom(), and if nothing
+     * is carried over the encoder is set up on the first Write(). That work belongs on the
+     * encoder threads, not the recording thread. Without them the encoder is set up in Open()
+     * on the segment thread, and the previous file is finished by segment_retire(). */
+    w->SetContinue(ui_enc_continue && async);
+    if (ui_prealloc && ff == FILEFMT_WAV) {
+        /* everything up to the next cut, plus a second for the clock running fast */
+        const time_t start = when != (time_t)0 ? when : time(NULL);
+        const time_t end = auto_cut_after(start);
+
+        if (end > start)
+            w->SetPreallocate((uint64_t)(end + (time_t)1 - start) * (uint64_t)fmt.sample_rate * (uint64_t)fmt.bytes_per_frame);
+    }
+#if defined(HAVE_PTHREADS)
+    /* the writer does its work on the encoder threads. PCM needs no such help */
+    if (async)
+        w = new AsyncWAVWriter(w,fmt,(size_t)(ui_enc_queue_seconds * (double)fmt.sample_rate) * (size_t)fmt.bytes_per_frame);
+#endif
+
+    return w;
 }
 
-void VU_advance_pcms_8(const int8_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+/* every -ff output for audio in 'fmt', set up but not opened. to be opened with 'suffix' added
+ * to the path: the extension, if there is only the one, else nothing and each adds its own */
+WAVWriter *Recorder::segment_outputs(const AudioFormat &fmt,time_t when,std::string &suffix) {
+    MultiWAVWriter *m = NULL;
+    WAVWriter *r = NULL;
+
+    for (int ff=FILEFMT_NONE+1;ff < FILEFMT_MAX;ff++) {
+        if (!(ui_want_ff & (1u << (unsigned int)ff)))
+            continue;
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs(audio_tmp[ch]) * 2u * 256u;
-            VU_advance_ch(ch,val);
+        WAVWriter *w = segment_output(ff,fmt,when);
+        if (w == NULL) {
+            delete r;
+            return NULL;
         }
 
-        audio_tmp += rec_fmt.channels;
+        if (r == NULL) {
+            suffix = filefmt_suffix(ff);
+            r = w;
+            continue;
+        }
+
+        /* one capture, several files. each encoder gets a queue of its own on the encoder threads */
+        if (m == NULL) {
+            m = new MultiWAVWriter();
+            m->Add(r,suffix);
+            suffix.clear();
+            r = m;
+        }
+        m->Add(w,filefmt_suffix(ff));
     }
+
+    return r;
 }
 
-void VU_advance_pcms_16(const int16_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+/* ".CH01" for channel 0, three digits if there are more than 99 */
+static std::string split_suffix(unsigned int ch,unsigned int channels) {
+    char tmp[16];
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs(audio_tmp[ch]) * 2u;
-            VU_advance_ch(ch,val);
-        }
+    sprintf(tmp,".CH%0*u",channels > 99u ? 3 : 2,ch + 1u);
+    return tmp;
+}
 
-        audio_tmp += rec_fmt.channels;
+/* make directories, open the sidecar and the output, initialize the encoder. 'when' is
+ * the time the recording starts, or 0 for now. touches nothing shared with the recording
+ * thread, so this can run on the segment thread. */
+bool Recorder::segment_create(rec_segment &seg,time_t when) {
+    seg.when = when;
+    seg.path_base = make_recording_path(when != (time_t)0 ? when : time(NULL),subdir);
+    if (seg.path_base.empty()) {
+        fprintf(stderr,"Unable to make recording path\n");
+        return false;
     }
-}
 
-void VU_advance_pcms_24(const unsigned char *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+    if (ui_split && rec_fmt.channels > 1)
+        seg.path_split = rec_fmt.channels;
+
+    for (int ff=FILEFMT_NONE+1;ff < FILEFMT_MAX;ff++) {
+        if (!(ui_want_ff & (1u << (unsigned int)ff)))
+            continue;
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs(__les24(audio_tmp) / 128l);
-            VU_advance_ch(ch,val);
-	    audio_tmp += 3;
+        if (seg.path_split > 1u) {
+            for (unsigned int ch=0;ch < seg.path_split;ch++)
+                seg.path_out.push_back(seg.path_base + split_suffix(ch,seg.path_split) + filefmt_suffix(ff));
+        }
+        else {
+            seg.path_out.push_back(seg.path_base + filefmt_suffix(ff));
         }
     }
-}
-
-void VU_advance_pcms_32(const int32_t *audio_tmp,unsigned int rds) {
-    unsigned int ch;
+    if (seg.path_out.empty())
+        abort();
 
-    while (rds-- > 0u) {
-        for (ch=0;ch < rec_fmt.channels;ch++) {
-            unsigned int val = (unsigned int)labs(audio_tmp[ch] / 32768l);
-            VU_advance_ch(ch,val);
-        }
+    seg.path_wav = seg.path_out[0];
+    seg.path_info = seg.path_base + ".TXT";
 
-        audio_tmp += rec_fmt.channels;
+    seg.info = fopen(seg.path_info.c_str(),"w");
+    if (seg.info == NULL) {
+        fprintf(stderr,"Unable to open %s, %s\n",seg.path_info.c_str(),strerror(errno));
+        segment_finish(seg);
+        return false;
     }
-}
 
-void VU_advance_pcmu(const void *audio_tmp,unsigned int rds) {
-         if (rec_fmt.bits_per_sample == 8)
-        VU_advance_pcmu_8((const uint8_t*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 16)
-        VU_advance_pcmu_16((const uint16_t*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 24)
-        VU_advance_pcmu_24((const unsigned char*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 32)
-        VU_advance_pcmu_32((const uint32_t*)audio_tmp,rds);
-}
+    if (seg.path_split > 1u) {
+        /* one capture taken apart into mono files, each channel with all its -ff formats */
+        SplitWAVWriter *sp = new SplitWAVWriter();
+        AudioFormat mono = rec_fmt;
 
-void VU_advance_pcms(const void *audio_tmp,unsigned int rds) {
-         if (rec_fmt.bits_per_sample == 8)
-        VU_advance_pcms_8((const int8_t*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 16)
-        VU_advance_pcms_16((const int16_t*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 24)
-        VU_advance_pcms_24((const unsigned char*)audio_tmp,rds);
-    else if (rec_fmt.bits_per_sample == 32)
-        VU_advance_pcms_32((const int32_t*)audio_tmp,rds);
-}
+        mono.channels = 1;
+        mono.updateFrameInfo();
 
-void VU_advance(const void *audio_tmp,unsigned int rd) {
-    if (rec_fmt.format_tag == AFMT_PCMU) {
-        VU_advance_pcmu(audio_tmp,rd / rec_fmt.bytes_per_frame);
+        seg.out = sp;
+        for (unsigned int ch=0;ch < seg.path_split;ch++) {
+            std::string suffix;
+            WAVWriter *w = segment_outputs(mono,when,suffix);
+
+            if (w == NULL) {
+                segment_finish(seg);
+                return false;
+            }
+
+            sp->Add(w,split_suffix(ch,seg.path_split) + suffix);
+        }
+        if (!sp->SetFormat(rec_fmt)) {
+            fprintf(stderr,"WAVE format rejected (split)\n");
+            segment_finish(seg);
+            return false;
+        }
+        if (!sp->Open(seg.path_base)) {
+            fprintf(stderr,"WAVE open failed\n");
+            segment_finish(seg);
+            return false;
+        }
+    }
+    else {
+        std::string suffix;
+
+        seg.out = segment_outputs(rec_fmt,when,suffix);
+        if (seg.out == NULL) {
+            segment_finish(seg);
+            return false;
+        }
+        if (!seg.out->Open(seg.path_base + suffix)) {
+            fprintf(stderr,"WAVE open failed\n");
+            segment_finish(seg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#if defined(HAVE_PTHREADS)
+/* how far ahead of a cut the segment thread opens the next recording */
+static const unsigned int                   segment_prepare_seconds = 5;
+
+void *Recorder::segment_thread_proc(void *arg) {
+    ((Recorder*)arg)->segment_thread_main();
+    return NULL;
+}
+
+void Recorder::segment_thread_main(void) {
+    pthread_mutex_lock(&segment_mutex);
+    while (1) {
+        if (segment_want != (time_t)0 && segment_want != segment_failed && !segment_ready && segment_creating == (time_t)0) {
+            rec_segment seg;
+            bool ok;
+
+            segment_creating = segment_want;
+            pthread_mutex_unlock(&segment_mutex);
+            ok = segment_create(seg,segment_creating);
+            pthread_mutex_lock(&segment_mutex);
+
+            if (ok && segment_want == segment_creating) {
+                segment_next = seg;
+                segment_ready = true;
+            }
+            else {
+                /* failed (the recording thread will try again itself at the cut and report it), or no longer wanted.
+                 * Closing and deleting it is file I/O, so not under the lock, but segment_creating stays set until
+                 * it is gone so that the recording thread does not open the same name in place in the meantime. */
+                if (!ok) segment_failed = segment_creating;
+                pthread_mutex_unlock(&segment_mutex);
+                segment_discard(seg);
+                pthread_mutex_lock(&segment_mutex);
+            }
+
+            segment_creating = 0;
+            pthread_cond_broadcast(&segment_cond);
+        }
+        else if (!segment_retired.empty()) {
+            rec_segment seg = segment_retired.front();
+            segment_retired.pop_front();
+
+            pthread_mutex_unlock(&segment_mutex);
+            segment_finish(seg);
+            pthread_mutex_lock(&segment_mutex);
+        }
+        else if (segment_stop) {
+            break;
+        }
+        else {
+            pthread_cond_wait(&segment_cond,&segment_mutex);
+        }
+    }
+    pthread_mutex_unlock(&segment_mutex);
+}
+
+void Recorder::segment_thread_start(void) {
+    segment_stop = false;
+    segment_want = 0;
+    segment_creating = 0;
+    segment_failed = 0;
+    segment_ready = false;
+
+    if (pthread_create(&segment_thread,NULL,segment_thread_proc,(void*)this) != 0) {
+        fprintf(stderr,"Unable to start segment thread, opening and closing recordings in place\n");
+        return;
+    }
+
+    segment_thread_running = true;
+}
+
+/* finalize everything retired so far, then drop whatever was prepared but never used */
+void Recorder::segment_thread_stop(void) {
+    if (segment_thread_running) {
+        pthread_mutex_lock(&segment_mutex);
+        segment_stop = true;
+        segment_want = 0;
+        pthread_cond_broadcast(&segment_cond);
+        pthread_mutex_unlock(&segment_mutex);
+
+        pthread_join(segment_thread,NULL);
+        segment_thread_running = false;
     }
-    else if (rec_fmt.format_tag == AFMT_PCMS) {
-        VU_advance_pcms(audio_tmp,rd / rec_fmt.bytes_per_frame);
+
+    if (segment_ready) {
+        segment_discard(segment_next);
+        segment_ready = false;
     }
 }
 
-void close_recording(void) {
+/* ask the segment thread to have a recording starting at 'when' ready to go */
+void Recorder::segment_prepare(time_t when) {
+    rec_segment stale;
+
+    if (!segment_thread_running || when == (time_t)0)
+        return;
+
+    pthread_mutex_lock(&segment_mutex);
+    if (segment_want != when) {
+        /* plans changed (clock stepped?), drop the one prepared for the old time */
+        if (segment_ready && segment_next.when != when) {
+            stale = segment_next;
+            segment_ready = false;
+        }
+
+        segment_want = when;
+        pthread_cond_broadcast(&segment_cond);
+    }
+    pthread_mutex_unlock(&segment_mutex);
+
+    segment_discard(stale);
+}
+
+/* Take the recording prepared for 'when', if there is one. Anything else that was prepared
+ * is dropped, so that opening a recording in place never races the segment thread for a file. */
+bool Recorder::segment_take(time_t when,rec_segment &seg) {
+    rec_segment stale;
+    bool ok = false;
+
+    pthread_mutex_lock(&segment_mutex);
+    while (segment_creating != (time_t)0)
+        pthread_cond_wait(&segment_cond,&segment_mutex);
+
+    if (segment_ready) {
+        if (when != (time_t)0 && segment_next.when == when) {
+            seg = segment_next;
+            ok = true;
+        }
+        else {
+            stale = segment_next;
+        }
+
+        segment_ready = false;
+    }
+    segment_want = 0;
+    pthread_mutex_unlock(&segment_mutex);
+
+    segment_discard(stale);
+    return ok;
+}
+#endif
+
+/* hand a closed recording off to be finalized */
+void Recorder::segment_retire(rec_segment &seg) {
+#if defined(HAVE_PTHREADS)
+    if (segment_thread_running) {
+        pthread_mutex_lock(&segment_mutex);
+        segment_retired.push_back(seg);
+        pthread_cond_broadcast(&segment_cond);
+        pthread_mutex_unlock(&segment_mutex);
+        return;
+    }
+#endif
+
+    segment_finish(seg);
+}
+
+void Recorder::finishing_retire(void) {
+    if (rec_finishing.out != NULL || rec_finishing.info != NULL) {
+        segment_retire(rec_finishing);
+        rec_finishing = rec_segment();
+    }
+}
+
+/* finish off the sidecar and take the current recording out of play, without closing it */
+void Recorder::recording_detach(rec_segment &seg) {
     if (wav_info != NULL) {
+#if defined(HAVE_PTHREADS)
+        if (capture_ring.Size() != 0) {
+            const size_t peak = capture_ring_peak.exchange(0);
+
+            fprintf(wav_info,"Capture ring: %lu bytes, peak fill %lu bytes (%.1f%%), %lu overflows (%llu bytes dropped)\n",
+                    (unsigned long)capture_ring.Size(),
+                    (unsigned long)peak,
+                    ((double)peak * 100.0) / (double)capture_ring.Size(),
+                    capture_overflows.load() - capture_overflows_at_open,
+                    capture_overflow_bytes.load() - capture_overflow_bytes_at_open);
+        }
+#endif
+
+        if (!wav_info_need_time) {
+            capture_time_write(wav_info,"Capture time after last frame",framecount);
+
+            const std::string drift = capture_drift_write(wav_info);
+            if (ui_drift_wav && wav_out != NULL && !drift.empty())
+                wav_out->SetComment(drift);
+        }
+
         {
             time_t now = time(NULL);
+#if defined(WIN32)
             struct tm *tm = localtime(&now);
+#else
+            struct tm tmbuf;
+            struct tm *tm = localtime_r(&now,&tmbuf);
+#endif
 
             if (tm != NULL) {
                 fprintf(wav_info,"Recording stopped Y-M-D-H-M-S %04u-%02u-%02u %02u:%02u:%02u\n",
@@ -548,87 +1578,61 @@ void close_recording(void) {
                         tm->tm_sec);
             }
         }
-
-        fclose(wav_info);
-        wav_info = NULL;
-    }
-    if (wav_out) {
-        delete wav_out;
-        wav_out = NULL;
     }
+
+    seg.path_base = rec_path_base;
+    seg.path_wav = rec_path_wav;
+    seg.path_info = rec_path_info;
+    seg.info = wav_info;
+    seg.out = wav_out;
+    wav_info = NULL;
+    wav_out = NULL;
 }
 
-bool open_recording(void) {
-    if (wav_out != NULL || wav_info != NULL)
-        return true;
+void Recorder::close_recording(void) {
+    rec_segment seg;
 
-    rec_path_base = make_recording_path_now();
-    if (rec_path_base.empty()) {
-        fprintf(stderr,"Unable to make recording path\n");
-        return false;
-    }
+    recording_detach(seg);
 
-    if (ui_want_ff == FILEFMT_WAV)
-        rec_path_wav = rec_path_base + ".WAV";
-#if defined(HAVE_LAME)
-    else if (ui_want_ff == FILEFMT_MP3)
-        rec_path_wav = rec_path_base + ".MP3";
-#endif
-#if defined(HAVE_VORBISENC)
-    else if (ui_want_ff == FILEFMT_VORBIS)
-        rec_path_wav = rec_path_base + ".OGG";
-#endif
-#if defined(HAVE_OPUSENC)
-    else if (ui_want_ff == FILEFMT_OPUS)
-        rec_path_wav = rec_path_base + ".opus";
-#endif
-    else
-        abort();
+    /* the rest (header patching, encoder flush) happens off the recording thread if it can.
+     * the one before it goes after, since flushing this one's encoder finishes that too */
+    if (seg.info != NULL || seg.out != NULL)
+        segment_retire(seg);
 
-    rec_path_info = rec_path_base + ".TXT";
+    finishing_retire();
+}
 
-    wav_info = fopen(rec_path_info.c_str(),"w");
-    if (wav_info == NULL) {
-        fprintf(stderr,"Unable to open %s, %s\n",rec_path_info.c_str(),strerror(errno));
-        close_recording();
-        return false;
-    }
+/* start a new recording. 'when' is the auto-cut boundary it starts on, or 0 for now */
+bool Recorder::open_recording(time_t when) {
+    if (wav_out != NULL || wav_info != NULL)
+        return true;
 
-    if (ui_want_ff == FILEFMT_WAV)
-        wav_out = new WAVWriter();
-#if defined(HAVE_LAME)
-    else if (ui_want_ff == FILEFMT_MP3)
-        wav_out = new MP3Writer();
-#endif
-#if defined(HAVE_VORBISENC)
-    else if (ui_want_ff == FILEFMT_VORBIS)
-        wav_out = new VorbisWriter();
-#endif
-#if defined(HAVE_OPUSENC)
-    else if (ui_want_ff == FILEFMT_OPUS)
-        wav_out = new OpusWriter();
-#endif
-    else
-        abort();
+    rec_segment seg;
 
-    if (wav_out == NULL) {
-        close_recording();
-        return false;
-    }
-    if (!wav_out->SetFormat(rec_fmt)) {
-        fprintf(stderr,"WAVE format rejected\n");
-        close_recording();
-        return false;
-    }
-    if (!wav_out->Open(rec_path_wav)) {
-        fprintf(stderr,"WAVE open failed\n");
-        close_recording();
-        return false;
+    /* normally the segment thread has this ready by the time we cut */
+#if defined(HAVE_PTHREADS)
+    if (!segment_take(when,seg))
+#endif
+    {
+        if (!segment_create(seg,when))
+            return false;
     }
 
+    rec_path_base = seg.path_base;
+    rec_path_wav = seg.path_wav;
+    rec_path_info = seg.path_info;
+    wav_info = seg.info;
+    wav_out = seg.out;
+    files++;
+
     {
         time_t now = time(NULL);
+#if defined(WIN32)
         struct tm *tm = localtime(&now);
+#else
+        struct tm tmbuf;
+        struct tm *tm = localtime_r(&now,&tmbuf);
+#endif
 
         if (tm != NULL) {
             fprintf(wav_info,"Recording began Y-M-D-H-M-S %04u-%02u-%02u %02u:%02u:%02u\n",
@@ -640,49 +1644,266 @@ bool open_recording(void) {
                     tm->tm_sec);
             fprintf(wav_info,"Recording format is: %s\n",
                     ui_print_format(rec_fmt).c_str());
+            if (!source_options.empty())
+                fprintf(wav_info,"Source options: %s\n",source_options.c_str());
         }
     }
 
-    compute_auto_cut();
+    /* filled in when the first audio arrives */
+    wav_info_need_time = true;
+    rec_first_time_valid = false;
+
+#if defined(HAVE_PTHREADS)
+    capture_overflows_at_open = capture_overflows.load();
+    capture_overflow_bytes_at_open = capture_overflow_bytes.load();
+#endif
 
-    printf("Recording to: %s\n",rec_path_wav.c_str());
+    /* if the clock stepped past the boundary we were cutting on, cut on the next one from now */
+    if (when != (time_t)0)
+        compute_auto_cut_from(next_auto_cut,when);
+    if (when == (time_t)0 || next_auto_cut <= time(NULL))
+        compute_auto_cut(next_auto_cut);
+
+    rec_cut_frame_valid = false;
+
+    for (size_t i=0;i < seg.path_out.size();i += seg.path_split) {
+        if (seg.path_split > 1u)
+            printf("Recording to: %s ... %s\n",seg.path_out[i].c_str(),seg.path_out[i + seg.path_split - 1u].c_str());
+        else
+            printf("Recording to: %s\n",seg.path_out[i].c_str());
+    }
 
     return true;
 }
 
-bool record_main(AudioSource* alsa,AudioFormat &fmt) {
-    int rd,i,patience;
+/* Auto-cut: close the current recording and open the one starting at 'when' (0 for now),
+ * carrying the encoder over from one to the next if it can. */
+bool Recorder::cut_recording(time_t when) {
+    rec_segment prev;
 
-    for (i=0;i < 8;i++) {
-        VUclip[i] = 0u;
-        VU[i] = 0u;
-    }
-    framecount = 0;
-    rec_fmt = fmt;
-    VU_init(fmt);
+    recording_detach(prev);
 
-    if (!open_recording()) {
-        fprintf(stderr,"Unable to open recording\n");
+    /* a whole recording later, the encoder can't still owe that one anything */
+    finishing_retire();
+
+    if (!open_recording(when)) {
+        segment_retire(prev);
         return false;
     }
 
+    if (prev.out != NULL && wav_out != NULL && wav_out->ContinueFrom(*prev.out)) {
+        if (prev.out->Finishing()) {
+            rec_finishing = prev;
+            return true;
+        }
+    }
+
+    segment_retire(prev);
+    return true;
+}
+
+#if defined(HAVE_PTHREADS)
+/* how far apart (in milliseconds of frames) our cut and the leader's may be, for the leader's to be used */
+static const unsigned int                   cut_shared_slack_ms = 2;
+#endif
+
+/* Work out which frame the next auto-cut lands on, from the latest capture timestamp.
+ * Redone for every block so that it uses a nearby anchor and the measured clock rate
+ * rather than extrapolating an hour ahead. */
+void Recorder::record_update_cut_frame(void) {
+    double rate,span;
+    AudioTimestamp ts;
+
+    if (!capture_time_of_frame(framecount,ts)) {
+        rec_cut_frame_valid = false;
+    }
+    else {
+        if (!capture_drift_rate(rate,span))
+            rate = (double)rec_fmt.sample_rate;
+
+        rec_cut_frame_valid = auto_cut_frame(next_auto_cut,rec_cut_frame,framecount,ts.wall_us,rate);
+    }
+
+#if defined(HAVE_PTHREADS)
+    /* Started together, the same frame number is the same moment on both, until one of them
+     * loses audio (a ring overflow here or there, or an overrun that re-prepared the group).
+     * So take the leader's frame, to the sample, only while it agrees with our own timing. */
+    if (cut_leader != NULL && rec_cut_frame_valid) {
+        const unsigned long long slack = ((unsigned long long)rec_fmt.sample_rate * (unsigned long long)cut_shared_slack_ms) / 1000ull;
+        unsigned long long f;
+
+        if (cut_leader->cut_shared(next_auto_cut,f) &&
+            (f > rec_cut_frame ? (f - rec_cut_frame) : (rec_cut_frame - f)) <= slack)
+            rec_cut_frame = f;
+    }
+
+    if (cut_publish) {
+        pthread_mutex_lock(&cut_mutex);
+        if (cut_valid && cut_when != next_auto_cut) {
+            cut_prev_when = cut_when;
+            cut_prev_frame = cut_frame;
+        }
+        cut_when = next_auto_cut;
+        cut_frame = rec_cut_frame;
+        cut_valid = rec_cut_frame_valid;
+        pthread_mutex_unlock(&cut_mutex);
+    }
+#endif
+}
+
+/* meter, count, and write audio that belongs entirely to the current recording */
+bool Recorder::record_write(const void *buf,unsigned int len) {
+    /* the capture thread sets the anchor, so ask through capture_time_of_frame(), which takes the lock */
+    if (wav_info_need_time && capture_time_of_frame(framecount,rec_first_time)) {
+        capture_time_write(wav_info,"Capture time of first frame",framecount);
+        rec_first_time_valid = true;
+        wav_info_need_time = false;
+    }
+
+    VU_advance(buf,len);
+
+    framecount += (unsigned long long)(len / rec_fmt.bytes_per_frame);
+
+    if (wav_out != NULL) {
+        if (wav_out->Write(buf,len) != (int)len) {
+            fprintf(stderr,"WAV writing error, closing and reopening\n");
+            close_recording();
+        }
+    }
+    if (rec_finishing.out != NULL && !rec_finishing.out->Finishing())
+        finishing_retire();
+
+    /* an encoder falling behind on the encoder threads. say so well before its queue fills up */
+    if (wav_out != NULL) {
+        const unsigned int backlog = wav_out->Backlog();
+
+        if (backlog >= 50u && !backlog_warned) {
+            fprintf(stderr,"Encoder falling behind, queue %u%% full\n",backlog);
+            backlog_warned = true;
+        }
+        else if (backlog < 10u) {
+            backlog_warned = false;
+        }
+    }
+    if (wav_out == NULL) {
+        if (!open_recording(0)) {
+            fprintf(stderr,"Unable to open recording\n");
+            signal_to_die = 1;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* meter, count, and write one block of captured audio, splitting it at the auto-cut frame
+ * so that nothing is lost or duplicated across files. false if recording cannot continue. */
+bool Recorder::record_process(const void *buf,unsigned int len) {
+    const unsigned char *p = (const unsigned char*)buf;
+    bool cut = false;
+
+    while (len > 0) {
+        unsigned int n = len;
+
+        record_update_cut_frame();
+
+#if defined(HAVE_PTHREADS)
+        if (rec_cut_frame_valid && rec_cut_frame > framecount &&
+            (rec_cut_frame - framecount) <= ((unsigned long long)rec_fmt.sample_rate * (unsigned long long)segment_prepare_seconds))
+            segment_prepare(next_auto_cut);
+#endif
+
+        /* never cut twice on the same block, even if the clock says so */
+        if (rec_cut_frame_valid && !cut) {
+            if (rec_cut_frame <= framecount)
+                n = 0;
+            else if ((rec_cut_frame - framecount) < (unsigned long long)(len / rec_fmt.bytes_per_frame))
+                n = (unsigned int)(rec_cut_frame - framecount) * rec_fmt.bytes_per_frame;
+        }
+
+        if (n > 0) {
+            if (!record_write(p,n))
+                return false;
+
+            p += n;
+            len -= n;
+        }
+
+        if (rec_cut_frame_valid && !cut && framecount >= rec_cut_frame) {
+            const time_t when = next_auto_cut;
+
+            if (wav_info) fprintf(stderr,"Auto-cut commencing\n");
+            if (!cut_recording(when)) {
+                fprintf(stderr,"Unable to open recording\n");
+                signal_to_die = 1;
+                return false;
+            }
+
+            cut = true;
+        }
+    }
+
+    return true;
+}
+
+/* fallback for when there are no capture timestamps to cut on an exact frame */
+void Recorder::record_check_auto_cut(void) {
+    if (!rec_cut_frame_valid && time_to_auto_cut(next_auto_cut)) {
+        if (wav_info) fprintf(stderr,"Auto-cut commencing\n");
+        cut_recording(0);
+    }
+}
+
+/* single-threaded loop: read, meter and write all on the calling thread */
+void Recorder::record_loop_direct(AudioSource* alsa) {
+    const unsigned int zerocopy_max = rec_fmt.bytes_per_frame * rec_fmt.sample_rate;
+    const void *zp = NULL;
+    AudioTimestamp ts;
+    int rd,patience;
+
+    /* if the source can hand us its own buffer, meter and write straight out of it */
+    const bool zerocopy = alsa->ReadBegin(zp,0) >= 0;
+    unsigned long xruns = alsa->Xruns();
+
     while (1) {
         if (signal_to_die) break;
-        usleep(10000);
 
-        if (time_to_auto_cut()) {
-            if (wav_info) fprintf(stderr,"Auto-cut commencing\n");
-            close_recording();
-            open_recording();
+        /* sleep until the device has a period for us (or 100ms, to keep the UI and auto-cut going) */
+        if ((rd=alsa->WaitForData(100)) < 0) {
+            fprintf(stderr,"Problem with audio device\n");
+            break;
         }
 
+        record_check_auto_cut();
+
 	rd = 0;
 	patience = 10;
         do {
             if (signal_to_die || --patience < 0) break;
 
+            capture_xrun_check(alsa,xruns);
+
+            if (zerocopy) {
+                /* timestamp what ReadBegin() is about to hand us */
+                if (alsa->ReadTimestamped(NULL,0,ts) >= 0)
+                    capture_anchor_set(framecount,ts);
+
+                rd = alsa->ReadBegin(zp,zerocopy_max);
+                if (rd > 0) {
+                    const bool ok = record_process(zp,(unsigned int)rd);
+
+                    ui_recording_draw();
+
+                    int err = alsa->ReadEnd((unsigned int)rd);
+                    if (err < 0) rd = err;
+                    if (!ok) break;
+                }
+
+                continue;
+            }
+
             audio_tmp[sizeof(audio_tmp) - OVERREAD] = 'x';
-            rd = alsa->Read(audio_tmp,(unsigned int)(sizeof(audio_tmp) - OVERREAD));
+            rd = alsa->ReadTimestamped(audio_tmp,(unsigned int)(sizeof(audio_tmp) - OVERREAD),ts);
             if (audio_tmp[sizeof(audio_tmp) - OVERREAD] != 'x') {
                 fprintf(stderr,"Read buffer overrun\n");
                 signal_to_die = 1;
@@ -690,39 +1911,549 @@ bool record_main(AudioSource* alsa,AudioFormat &fmt) {
             }
 
             if (rd > 0) {
-                VU_advance(audio_tmp,(unsigned int)rd);
+                capture_anchor_set(framecount,ts);
+                if (!record_process(audio_tmp,(unsigned int)rd))
+                    break;
 
                 ui_recording_draw();
+            }
+        } while (rd > 0);
+
+        if (rd < 0) {
+            fprintf(stderr,"Problem with audio device\n");
+            break;
+        }
+    }
+}
 
-                framecount += (unsigned long long)((unsigned int)rd / fmt.bytes_per_frame);
+#if defined(HAVE_PTHREADS)
+void Recorder::capture_notify(void) {
+    pthread_mutex_lock(&capture_mutex);
+    pthread_cond_signal(&capture_cond);
+    pthread_mutex_unlock(&capture_mutex);
+}
 
-                if (wav_out != NULL) {
-                    if (wav_out->Write(audio_tmp,(unsigned int)rd) != rd) {
-                        fprintf(stderr,"WAV writing error, closing and reopening\n");
-                        close_recording();
-                    }
+void *Recorder::capture_thread_proc(void *arg) {
+    ((Recorder*)arg)->capture_thread_main();
+    return NULL;
+}
+
+void Recorder::capture_thread_main(void) {
+    AudioSource* alsa = source;
+    const size_t bpf = rec_fmt.bytes_per_frame;
+    const size_t discard = (sizeof(audio_tmp) - OVERREAD) - ((sizeof(audio_tmp) - OVERREAD) % bpf);
+    unsigned long xruns = alsa->Xruns();
+    bool overflowing = false;
+    AudioTimestamp ts;
+    int rd = 0,patience;
+
+    /* A source that captures on a thread of its own can put the audio straight into the ring,
+     * rather than into a buffer of its own that this thread would only copy it out of again */
+    if (alsa->SetCaptureRing(&capture_ring,&capture_overflow_bytes) >= 0) {
+        capture_thread_watch(alsa);
+        alsa->SetCaptureRing(NULL,NULL);
+        return;
+    }
+
+    while (!capture_stop.load() && !signal_to_die) {
+        if ((rd=alsa->WaitForData(100)) < 0) {
+            capture_error = rd;
+            capture_notify();
+            break;
+        }
+
+        patience = 10;
+        do {
+            unsigned char *p;
+            size_t len;
+
+            if (--patience < 0) break;
+
+            capture_xrun_check(alsa,xruns);
+
+            len = capture_ring.WriteSpan(p);
+            len -= len % bpf;
+            if (len != 0) {
+                rd = alsa->ReadTimestamped(p,(unsigned int)len,ts);
+                if (rd > 0) {
+                    capture_anchor_set((unsigned long long)(capture_ring.TotalWritten() / (uint64_t)bpf),ts);
+                    capture_ring.WriteCommit((size_t)rd);
+                    overflowing = false;
+
+                    const size_t lvl = capture_ring.Level();
+                    if (capture_ring_peak.load(std::memory_order_relaxed) < lvl)
+                        capture_ring_peak.store(lvl,std::memory_order_relaxed);
                 }
-                if (wav_out == NULL) {
-                    if (!open_recording()) {
-                        fprintf(stderr,"Unable to open recording\n");
-                        signal_to_die = 1;
-                        break;
+            }
+            else {
+                /* The ring is full, the recording thread is falling behind. Keep draining
+                 * the device anyway so it does not overrun, and count what was lost. */
+                rd = alsa->Read(audio_tmp,(unsigned int)discard);
+                if (rd > 0) {
+                    if (!overflowing) {
+                        capture_overflows++;
+                        capture_drift_reset();
                     }
+                    capture_overflow_bytes += (unsigned long long)rd;
+                    overflowing = true;
                 }
             }
         } while (rd > 0);
 
         if (rd < 0) {
+            capture_error = rd;
+            capture_notify();
+            break;
+        }
+
+        capture_notify();
+    }
+}
+
+/* capture thread, while the source writes into the ring itself (see AudioSource::SetCaptureRing()).
+ * All that is left here is the anchor, counting overflows, and waking up the recording thread. */
+void Recorder::capture_thread_watch(AudioSource* alsa) {
+    unsigned long long dropped = capture_overflow_bytes.load();
+    unsigned long xruns = alsa->Xruns();
+    bool overflowing = false;
+    AudioTimestamp ts;
+    int rd;
+
+    while (!capture_stop.load() && !signal_to_die) {
+        if ((rd=alsa->WaitForData(100)) < 0) {
+            capture_error = rd;
+            capture_notify();
+            break;
+        }
+        if (rd == 0)
+            continue;
+
+        /* The ring counts frames as the recording thread reads them, and those don't count what
+         * the source dropped into a full ring. Check for that first, so that the drift is not
+         * measured across it. */
+        const unsigned long long d = capture_overflow_bytes.load();
+        if (d != dropped) {
+            if (!overflowing) capture_overflows++;
+            capture_drift_reset();
+            overflowing = true;
+            dropped = d;
+        }
+        else {
+            overflowing = false;
+        }
+
+        capture_xrun_check(alsa,xruns);
+
+        /* the frame the recording thread reads next, counted in the ring as it counts them */
+        if (alsa->ReadTimestamped(NULL,0,ts) >= 0)
+            capture_anchor_set(ts.frame,ts);
+
+        const size_t lvl = capture_ring.Level();
+        if (capture_ring_peak.load(std::memory_order_relaxed) < lvl)
+            capture_ring_peak.store(lvl,std::memory_order_relaxed);
+
+        capture_notify();
+    }
+}
+
+bool Recorder::capture_thread_start(AudioSource* alsa) {
+    size_t frames = (size_t)(ui_ring_seconds * (double)rec_fmt.sample_rate);
+
+    if (frames < 1024) frames = 1024;
+
+    /* ring length is a whole number of frames so that every span is frame aligned */
+    if (!capture_ring.Alloc(frames * (size_t)rec_fmt.bytes_per_frame)) {
+        fprintf(stderr,"Unable to allocate capture ring, recording without a capture thread\n");
+        return false;
+    }
+
+    capture_stop = false;
+    capture_error = 0;
+    capture_ring_peak = 0;
+    capture_overflows = 0;
+    capture_overflow_bytes = 0;
+    capture_overflows_reported = 0;
+    capture_overflows_at_open = 0;
+    capture_overflow_bytes_at_open = 0;
+
+    source = alsa;
+    if (pthread_create(&capture_thread,NULL,capture_thread_proc,(void*)this) != 0) {
+        fprintf(stderr,"Unable to start capture thread, recording without it\n");
+        capture_ring.Free();
+        return false;
+    }
+
+    capture_thread_running = true;
+    return true;
+}
+
+void Recorder::capture_thread_stop(void) {
+    if (capture_thread_running) {
+        capture_stop = true;
+        pthread_join(capture_thread,NULL);
+        capture_thread_running = false;
+    }
+}
+
+/* wait until the capture thread has something for us, or until it's time to check for signals */
+void Recorder::capture_wait(void) {
+    struct timespec ts;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_ring.Level() == 0 && capture_error == 0 && !signal_to_die) {
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_nsec += 100000000l; /* 100ms */
+        if (ts.tv_nsec >= 1000000000l) {
+            ts.tv_nsec -= 1000000000l;
+            ts.tv_sec++;
+        }
+
+        pthread_cond_timedwait(&capture_cond,&capture_mutex,&ts);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+bool Recorder::capture_drain(void) {
+    const unsigned char *p;
+    size_t len;
+
+    while ((len=capture_ring.ReadSpan(p)) != 0) {
+        if (!record_process(p,(unsigned int)len))
+            return false;
+
+        capture_ring.ReadCommit(len);
+    }
+
+    return true;
+}
+
+/* threaded loop: capture thread fills the ring, this thread meters and writes */
+void Recorder::record_loop_threaded(void) {
+    while (1) {
+        capture_wait();
+        if (signal_to_die) break;
+
+        record_check_auto_cut();
+
+        if (!capture_drain())
+            break;
+
+        ui_recording_draw();
+
+        if (capture_overflows_reported != capture_overflows.load()) {
+            capture_overflows_reported = capture_overflows.load();
+            fprintf(stderr,"\nCapture ring overflow, recording is falling behind (%llu bytes dropped so far)\n",
+                    capture_overflow_bytes.load());
+        }
+
+        if (capture_error != 0) {
             fprintf(stderr,"Problem with audio device\n");
             break;
         }
     }
 
+    capture_thread_stop();
+
+    /* write out whatever the capture thread collected before it stopped */
+    capture_drain();
+
+    if (capture_overflows.load() != 0ul)
+        fprintf(stderr,"\nCapture ring: %lu overflows, %llu bytes dropped\n",capture_overflows.load(),capture_overflow_bytes.load());
+}
+#endif
+
+bool Recorder::Run(AudioSource* alsa,const AudioFormat &fmt) {
+    int i;
+
+    for (i=0;i < VU_MAX_CHANNELS;i++) {
+        VU[i].clip = 0u;
+        VU[i].rms = 0u;
+        VU[i].peak = 0u;
+    }
+    framecount = 0;
+    capture_anchor_valid = false;
+    rec_fmt = fmt;
+    capture_drift.SetWindow(ui_drift_window);
+    capture_drift.SetNominalRate(rec_fmt.sample_rate);
+    capture_drift.Reset();
+    VU_init(fmt);
+
+#if defined(HAVE_PTHREADS)
+    segment_thread_start();
+
+    if (ui_ring_seconds > 0 && capture_thread_start(alsa)) {
+        if (!open_recording(0)) {
+            fprintf(stderr,"Unable to open recording\n");
+            capture_thread_stop();
+            capture_ring.Free();
+            segment_thread_stop();
+            return false;
+        }
+
+        record_loop_threaded();
+        close_recording();
+        capture_ring.Free();
+        segment_thread_stop();
+        if (draw) printf("\n");
+        return true;
+    }
+#endif
+
+    if (!open_recording(0)) {
+        fprintf(stderr,"Unable to open recording\n");
+#if defined(HAVE_PTHREADS)
+        segment_thread_stop();
+#endif
+        return false;
+    }
+
+    record_loop_direct(alsa);
+
     close_recording();
-    printf("\n");
+#if defined(HAVE_PTHREADS)
+    segment_thread_stop();
+#endif
+    if (draw) printf("\n");
     return true;
 }
 
+/* where it is recording and how loud, for one status line covering several devices */
+std::string Recorder::Status(void) const {
+    const unsigned int peak = shown_peak.load(std::memory_order_relaxed);
+    double d = peak != 0u ? dBFS_measure((double)peak / 65535) : -99;
+    char tmp[32];
+
+    if (d < -99) d = -99;
+    sprintf(tmp," %.0fdB%s",d,shown_clip.load(std::memory_order_relaxed) ? "!" : "");
+    return subdir + tmp;
+}
+
+/* seconds of audio recorded. after Run() */
+double Recorder::Seconds(void) const {
+    if (rec_fmt.sample_rate == 0) return 0;
+    return (double)framecount / (double)rec_fmt.sample_rate;
+}
+
+unsigned long Recorder::Files(void) const {
+    return files;
+}
+
+unsigned long Recorder::Overflows(void) const {
+#if defined(HAVE_PTHREADS)
+    return capture_overflows.load();
+#else
+    return 0;
+#endif
+}
+
+unsigned long long Recorder::OverflowBytes(void) const {
+#if defined(HAVE_PTHREADS)
+    return capture_overflow_bytes.load();
+#else
+    return 0;
+#endif
+}
+
+/* record one device on the calling thread, until signal_to_die */
+bool record_main(AudioSource* alsa,AudioFormat &fmt) {
+    Recorder *r = new Recorder();
+    bool ok;
+
+    r->SetSourceOptions(rec_source_options);
+    ok = r->Run(alsa,fmt);
+    delete r;
+
+    return ok;
+}
+
+#if defined(HAVE_PTHREADS) && !defined(TARGET_GUI)
+/* One of several devices recording at once */
+struct rec_input {
+    std::string         device;
+    AudioSource*        alsa;
+    AudioFormat         fmt;
+    std::string         source_options; /* as negotiated, for the sidecar */
+    Recorder*           rec;
+    pthread_t           thread;
+    bool                running;
+    bool                linked;         /* started together with the first one, once opened */
+    std::atomic<bool>   done;
+    bool                ok;
+
+    rec_input() : alsa(NULL), rec(NULL), running(false), linked(false), done(false), ok(false) { }
+};
+
+static void *rec_input_thread_proc(void *arg) {
+    rec_input *in = (rec_input*)arg;
+
+    in->ok = in->rec->Run(in->alsa,in->fmt);
+    in->done = true;
+    return NULL;
+}
+
+/* directory under PERMREC for a device, from its name, and not one of 'used' */
+static std::string ui_device_subdir(const std::string &device,const std::vector<std::string> &used) {
+    std::string b,r;
+    unsigned int n = 2;
+    size_t i;
+
+    for (i=0;i < device.size();i++) {
+        const char c = device[i];
+
+        if (isalnum((unsigned char)c) || c == '-' || c == '.')
+            b += c;
+        else
+            b += '_';
+    }
+    if (b.empty() || b[0] == '.')
+        b = "default" + b;
+
+    /* two devices whose names only differ in what was replaced above */
+    r = b;
+    do {
+        for (i=0;i < used.size() && used[i] != r;i++);
+        if (i == used.size()) break;
+
+        char tmp[16];
+        sprintf(tmp,"-%u",n++);
+        r = b + tmp;
+    } while (1);
+
+    return r;
+}
+
+/* Several devices in one process. Each gets a Recorder (with its capture and segment threads,
+ * as usual) running on a thread of its own and recording under PERMREC/<device>, while this
+ * thread draws one status line for all of them and adds up the totals at the end. */
+static bool record_multi(void) {
+    std::vector<std::string> subdirs;
+    std::vector<rec_input*> ins;
+    bool ok = true;
+    size_t i;
+
+    for (i=0;i < ui_inputs.size();i++) {
+        rec_input *in = new rec_input();
+
+        in->device = ui_inputs[i].device;
+        in->alsa = GetAudioSource(ui_inputs[i].source.c_str());
+        if (in->alsa == NULL) {
+            fprintf(stderr,"No such audio source '%s'\n",ui_inputs[i].source.c_str());
+            delete in;
+            ok = false;
+            break;
+        }
+
+        ins.push_back(in);
+    }
+
+    /* all of them start with the first one. that has to be set up before any are opened */
+    if (ok && ui_link) {
+        for (i=1;i < ins.size();i++) {
+            if (ins[i]->alsa->Link(ins[0]->alsa) < 0)
+                fprintf(stderr,"%s cannot be started together with %s, it will start on its own\n",ins[i]->device.c_str(),ins[0]->device.c_str());
+        }
+    }
+
+    for (i=0;i < ins.size() && ok;i++) {
+        rec_input *in = ins[i];
+
+        printf("Device %s:\n",in->device.c_str());
+        if (!ui_apply_options(in->alsa,in->fmt,in->device,ui_inputs[i].options,in->source_options)) {
+            ok = false;
+            break;
+        }
+
+        in->rec = new Recorder();
+        subdirs.push_back(ui_device_subdir(in->device,subdirs));
+        in->rec->SetSubdir(subdirs.back());
+        in->rec->SetSourceOptions(in->source_options);
+        in->rec->SetDraw(false);
+
+        /* the same frame is the same moment on both, so cut them on the same frame too.
+         * only if the device did link when opened, asking with Link() is not enough */
+        in->linked = (i != 0 && in->alsa->IsLinked());
+        if (in->linked && in->fmt.sample_rate == ins[0]->fmt.sample_rate)
+            in->rec->SetCutLeader(ins[0]->rec);
+    }
+
+    for (i=0;i < ins.size() && ok;i++) {
+        if (pthread_create(&ins[i]->thread,NULL,rec_input_thread_proc,(void*)ins[i]) != 0) {
+            fprintf(stderr,"Unable to start recording thread for %s\n",ins[i]->device.c_str());
+            signal_to_die = 1;
+            ok = false;
+            break;
+        }
+
+        ins[i]->running = true;
+    }
+
+    if (ok) {
+        const uint64_t t0 = monotonic_clock_us();
+
+        while (1) {
+            const unsigned int S = (unsigned int)((monotonic_clock_us() - t0) / (uint64_t)1000000u);
+            std::string line;
+            size_t running = 0;
+            char tmp[32];
+
+            for (i=0;i < ins.size();i++) {
+                if (ins[i]->done.load()) continue;
+
+                line += " " + ins[i]->rec->Status();
+                running++;
+            }
+            if (running == 0)
+                break;
+
+            sprintf(tmp,"%02u:%02u:%02u",S / 3600u,(S / 60u) % 60u,S % 60u);
+            printf("\x0D%s%s \x0D",tmp,line.c_str());
+            fflush(stdout);
+
+            usleep(100000);
+        }
+
+        printf("\n");
+    }
+
+    {
+        unsigned long long overflow_bytes = 0;
+        unsigned long overflows = 0,files = 0;
+        double seconds = 0;
+
+        for (i=0;i < ins.size();i++) {
+            rec_input *in = ins[i];
+
+            if (in->running) {
+                pthread_join(in->thread,NULL);
+                in->running = false;
+
+                if (!in->ok)
+                    fprintf(stderr,"Recording loop failed for %s\n",in->device.c_str());
+
+                printf("%s: %.3f seconds in %lu files, %lu capture overflows (%llu bytes dropped)\n",
+                    in->device.c_str(),in->rec->Seconds(),in->rec->Files(),in->rec->Overflows(),in->rec->OverflowBytes());
+
+                seconds += in->rec->Seconds();
+                files += in->rec->Files();
+                overflows += in->rec->Overflows();
+                overflow_bytes += in->rec->OverflowBytes();
+            }
+
+            delete in->rec;
+            in->alsa->Close();
+            delete in->alsa;
+            delete in;
+        }
+
+        if (ins.size() > 1)
+            printf("Total: %.3f seconds in %lu files from %lu devices, %lu capture overflows (%llu bytes dropped)\n",
+                seconds,files,(unsigned long)ins.size(),overflows,overflow_bytes);
+    }
+
+    return ok;
+}
+#endif
+
 #ifndef TARGET_GUI
 int main(int argc,char **argv) {
 #if defined(WIN32)
@@ -769,6 +2500,15 @@ int main(int argc,char **argv) {
         alsa->Close();
         delete alsa;
     }
+    else if (ui_command == "rec" && ui_inputs.size() > 1) {
+#if defined(HAVE_PTHREADS)
+        if (!record_multi())
+            return 1;
+#else
+        fprintf(stderr,"Recording several devices at once needs threads\n");
+        return 1;
+#endif
+    }
     else if (ui_command == "rec") {
         AudioSource* alsa = GetAudioSource(ui_source.c_str());
         AudioFormat fmt;
@@ -786,6 +2526,24 @@ int main(int argc,char **argv) {
         alsa->Close();
         delete alsa;
     }
+    else if (ui_command == "bench") {
+        AudioFormat fmt;
+
+        /* a big multichannel interface by default */
+        fmt.format_tag = AFMT_PCMS;
+        fmt.sample_rate = 192000;
+        fmt.channels = 8;
+        fmt.bits_per_sample = 16;
+        ui_apply_format(fmt);
+        fmt.updateFrameInfo();
+
+        VU_benchmark(fmt);
+        pcmconv_benchmark(fmt);
+    }
+    else if (ui_command == "iobench") {
+        asyncout_benchmark(ui_iobench_mb,ui_write_depth,ui_write_buffer_kb != 0ul ? (size_t)ui_write_buffer_kb * (size_t)1024u : (size_t)4096u,
+            (size_t)ui_writeback_mb * (size_t)1024u * (size_t)1024u);
+    }
     else if (ui_command == "listsrc") {
         size_t i;
 
@@ -33,8 +33,22 @@
 #include "as_alsa.h"
 
 std::string make_recording_path_now(void) {
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    return make_recording_path(time(NULL));
+}
+
+std::string make_recording_path(time_t when) {
+    return make_recording_path(when,std::string());
+}
+
+/* path (without extension) for a recording starting at 'when'. 'subdir', if given, is a
+ * directory under PERMREC of its own, for one of several devices recording at once */
+std::string make_recording_path(time_t when,const std::string &subdir) {
+#if defined(WIN32)
+    struct tm *tm = localtime(&when); /* per-thread in the MS C runtime */
+#else
+    struct tm tmbuf; /* may be called from the segment thread */
+    struct tm *tm = localtime_r(&when,&tmbuf);
+#endif
     if (tm == NULL) return std::string();
 
     std::string rec;
@@ -50,6 +64,18 @@ std::string make_recording_path_now(void) {
             return std::string();
     }
 
+    if (!subdir.empty()) {
+        rec += "/" + subdir;
+#if defined(WIN32)
+        if (mkdir(rec.c_str()) < 0) {
+#else
+        if (mkdir(rec.c_str(),0755) < 0) {
+#endif
+            if (errno != EEXIST)
+                return std::string();
+        }
+    }
+
     /* tm->tm_year + 1900 = current year
      * tm->tm_mon + 1     = current month (1=January)
      * tm->tm_mday        = current day of the month */
@@ -4,4 +4,6 @@
 #include <string>
 
 std::string make_recording_path_now(void);
+std::string make_recording_path(time_t when);
+std::string make_recording_path(time_t when,const std::string &subdir);
 
@@ -0,0 +1,124 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <new>
+
+#include "common.h"
+#include "splitwav.h"
+
+/* source piece plus planes, small enough to stay in L2 */
+static const unsigned int split_piece_bytes = 64u * 1024u;
+
+/* between planes, so that 32 or 64 of them don't all start on the same L1 cache set */
+static const unsigned int split_plane_pad = 64u;
+
+SplitWAVWriter::SplitWAVWriter() : FanoutWAVWriter(), split(NULL), bytes_per_sample(0), bytes_per_frame(0), plane_frames(0), plane_buf(NULL) {
+}
+
+SplitWAVWriter::~SplitWAVWriter() {
+    Close();
+    delete[] plane_buf;
+    plane_buf = NULL;
+}
+
+/* not until SetFormat() has found a splitter */
+bool SplitWAVWriter::Open(const std::string &path) {
+    if (!IsOpen() && split == NULL)
+        return false;
+
+    return FanoutWAVWriter::Open(path);
+}
+
+/* the format of the capture. there must be a writer for every channel, each is given mono */
+bool SplitWAVWriter::SetFormat(const AudioFormat &fmt) {
+    AudioFormat mono = fmt;
+    size_t i;
+
+    if (IsOpen() || outs.empty()) return false;
+    if (outs.size() != (size_t)fmt.channels) return false;
+
+    mono.channels = 1;
+    mono.updateFrameInfo();
+    for (i=0;i < outs.size();i++) {
+        if (!outs[i].w->SetFormat(mono))
+            return false;
+    }
+
+    split = pcmconv_get_split(fmt);
+    if (split == NULL)
+        return false;
+
+    bytes_per_sample = (unsigned int)fmt.bits_per_sample / 8u;
+    bytes_per_frame = bytes_per_sample * (unsigned int)fmt.channels;
+
+    /* a multiple of 8 frames, so that the SIMD splitter doesn't leave any for the C loop */
+    plane_frames = (split_piece_bytes / 2u / bytes_per_frame) & (~7u);
+    if (plane_frames < 8u) plane_frames = 8u;
+
+    const size_t plane_stride = ((size_t)plane_frames * (size_t)bytes_per_sample) + (size_t)split_plane_pad;
+
+    delete[] plane_buf;
+    plane_buf = new(std::nothrow) unsigned char[plane_stride * outs.size()];
+    if (plane_buf == NULL) {
+        split = NULL;
+        return false;
+    }
+
+    planes.resize(outs.size());
+    for (i=0;i < outs.size();i++)
+        planes[i] = plane_buf + (i * plane_stride);
+
+    return true;
+}
+
+/* whole frames only. an error from any of the outputs is returned, after the rest have been written */
+int SplitWAVWriter::Write(const void *buffer,unsigned int len) {
+    const unsigned char *s = (const unsigned char*)buffer;
+    unsigned int frames;
+    int r;
+
+    if (!IsOpen())
+        return -EINVAL;
+
+    len -= len % bytes_per_frame;
+    frames = len / bytes_per_frame;
+    r = (int)len;
+
+    while (frames > 0u) {
+        const unsigned int n = frames < plane_frames ? frames : plane_frames;
+        const unsigned int plen = n * bytes_per_sample;
+
+        split(&planes[0],s,n,(unsigned int)outs.size());
+
+        for (size_t i=0;i < outs.size();i++) {
+            const int wr = outs[i].w->Write(planes[i],plen);
+
+            if (wr != (int)plen && r == (int)len) {
+                fprintf(stderr,"Output %s: write error\n",outs[i].path.c_str());
+                r = wr < 0 ? wr : -EIO;
+            }
+        }
+
+        s += n * bytes_per_frame;
+        frames -= n;
+    }
+
+    return r;
+}
+
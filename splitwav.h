@@ -0,0 +1,38 @@
+#ifndef __SPLITWAV_H
+#define __SPLITWAV_H
+
+#include "config.h"
+#include "wavstruc.h"
+#include "wavwrite.h"
+#include "multiwav.h"
+#include "pcmconv.h"
+
+#include <string>
+#include <vector>
+
+/* One mono file per channel of one capture, for 32 and 64 channel interfaces where every input
+ * is a track of its own. Add() a writer for each channel, which SetFormat() sets up for mono.
+ * Each output adds its own extension to the path given to Open() (".CH01.WAV").
+ *
+ * Write() takes the interleaved audio apart with the pcmconv splitter in one pass, a piece at a
+ * time so that the piece and the planes it goes to stay in cache, and gives every writer its
+ * plane. Writers that encode should be wrapped in an AsyncWAVWriter first, as with MultiWAVWriter. */
+class SplitWAVWriter : public FanoutWAVWriter {
+public:
+    SplitWAVWriter();
+    virtual ~SplitWAVWriter();
+public:
+    virtual bool Open(const std::string &path);
+    virtual bool SetFormat(const AudioFormat &fmt);
+    virtual int Write(const void *buffer,unsigned int len);
+private:
+    pcmconv_split_t     split;
+    unsigned int        bytes_per_sample;
+    unsigned int        bytes_per_frame;
+    unsigned int        plane_frames;   /* frames per piece */
+    unsigned char*      plane_buf;      /* Count() planes of plane_frames samples */
+    std::vector<void*>  planes;
+};
+
+#endif //__SPLITWAV_H
+
@@ -1,4 +1,5 @@
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
@@ -9,6 +10,8 @@
 
 #include <string>
 
+#include "asyncout.h"
+
 #if !defined(_WIN32)/*NOT for Windows*/
 
 bool                    is_mpeg_ts = false;
@@ -37,6 +40,15 @@ off_t                   p_fd_replay = -1;
 
 int                     c_fd = -1;
 std::string             c_fd_name;
+AsyncOutput             c_out;
+
+int                     aio_backend = ASYNCOUT_SYNC;
+unsigned int            aio_depth = 4;
+unsigned long           aio_buffer_kb = 1024;
+unsigned int            aio_flush_ms = 2000;
+
+bool                    prealloc = true;
+double                  c_fd_rate = 0;      /* bytes/sec of the last fragment, to guess the size of the next */
 
 bool                    show_data_count = false;
 unsigned long long      data_count = 0;
@@ -276,13 +288,34 @@ bool open_c_fd(void) {
         c_fd_name = make_filename();
         c_fd = open(c_fd_name.c_str(),O_RDWR|O_CREAT|O_EXCL,0644); /* for archival reasons DO NOT overwrite existing files */
         if (c_fd < 0) return false;
+
+        if (aio_buffer_kb != 0ul && !c_out.Open(c_fd,0,(size_t)aio_buffer_kb * (size_t)1024u,aio_depth,aio_backend))
+            fprintf(stderr,"Unable to allocate write buffers, writing straight through\n");
+
+        /* reserve the space the fragment will probably need, so it isn't scattered over the disk */
+        if (prealloc && c_fd_rate > 0 && cut_time > now)
+            asyncout_preallocate(c_fd,0,(off_t)(c_fd_rate * (double)(cut_time - now) * 1.1));
     }
 
     return true;
 }
 
+/* append to the current fragment. the buffers are written out at least every aio_flush_ms */
+bool write_c_fd(const void *buf,size_t len) {
+    if (c_out.IsOpen()) {
+        if (c_out.Append(buf,len) < 0) return false;
+        if (c_out.SubmitIfOlder(aio_flush_ms) < 0) return false;
+        return true;
+    }
+
+    return (write(c_fd,buf,len) == (ssize_t)len);
+}
+
 void close_c_fd(void) {
     if (c_fd >= 0) {
+        c_out.Close();
+        if (prealloc) asyncout_preallocate_trim(c_fd);
+
         off_t sz = lseek(c_fd,0,SEEK_END);
         close(c_fd);
         c_fd = -1;
@@ -296,12 +329,20 @@ void close_c_fd(void) {
 
 void close_p_fd(void) {
     if (p_fd >= 0) {
+        if (prealloc) asyncout_preallocate_trim(p_fd);
         close(p_fd);
         p_fd = -1;
     }
 }
 
 void c_to_p_fd(void) {
+    c_out.Close(); /* everything on disk before it is read back for the replay */
+    if (c_fd >= 0 && now > start_time) {
+        struct stat st;
+
+        if (fstat(c_fd,&st) == 0)
+            c_fd_rate = (double)st.st_size / (double)(now - start_time);
+    }
     close_p_fd();
     p_fd = c_fd;
     c_fd = -1;
@@ -318,6 +359,11 @@ static void help(void) {
     fprintf(stderr,"-mts content is MPEG transport stream\n");
     fprintf(stderr,"-dt data timeout in seconds\n");
     fprintf(stderr,"-rt replay time interval (copy this much prev to current fragment)\n");
+    fprintf(stderr,"-wbuf write buffer size in KB (default 1024, 0 = write as it comes)\n");
+    fprintf(stderr,"-aio how to write the buffers: sync, thread, uring, mmap (default sync)\n");
+    fprintf(stderr,"-aio-depth buffers per file, the most writes in flight (default 4)\n");
+    fprintf(stderr,"-writeback MB write back and drop data from the page cache every MB (default 0 = off)\n");
+    fprintf(stderr,"-no-prealloc don't reserve disk space for a fragment based on the size of the last one\n");
     fprintf(stderr,"\n");
     fprintf(stderr,"NOTE: -w 500 is appropriate for curl and internet radio.\n");
     fprintf(stderr,"      -w 1 should be used for dvbsnoop and DVB/ATSC sources.\n");
@@ -383,6 +429,31 @@ int main(int argc,char **argv) {
                 else if (!strcmp(a,"s")) {
                     opt_suffix = argv[i++];
                 }
+                else if (!strcmp(a,"wbuf")) {
+                    a = argv[i++];
+                    aio_buffer_kb = strtoul(a,NULL,0);
+                    if (aio_buffer_kb > 65536ul)
+                        aio_buffer_kb = 65536ul;
+                }
+                else if (!strcmp(a,"aio")) {
+                    a = argv[i++];
+                    aio_backend = AsyncOutput::BackendParse(a);
+                    if (aio_backend < 0) {
+                        fprintf(stderr,"Unknown -aio %s\n",a);
+                        return 1;
+                    }
+                }
+                else if (!strcmp(a,"writeback")) {
+                    a = argv[i++];
+                    c_out.SetWriteback((size_t)strtoul(a,NULL,0) * (size_t)1024u * (size_t)1024u);
+                }
+                else if (!strcmp(a,"no-prealloc")) {
+                    prealloc = false;
+                }
+                else if (!strcmp(a,"aio-depth")) {
+                    a = argv[i++];
+                    aio_depth = (unsigned int)strtoul(a,NULL,0);
+                }
                 else if (!strcmp(a,"w")) {
                     a = argv[i++];
                     wait_delay = atoi(a);
@@ -449,7 +520,7 @@ int main(int argc,char **argv) {
         assert(cut_time != (time_t)0);
         if (replay_mark_time != 0 && now >= replay_mark_time) {
             if (c_fd >= 0) {
-                p_fd_replay = lseek(c_fd,0,SEEK_CUR);
+                p_fd_replay = c_out.IsOpen() ? c_out.Position() : lseek(c_fd,0,SEEK_CUR);
                 fprintf(stderr,"Replay mark now, at file offset %ld\n",(signed long)p_fd_replay);
             }
 
@@ -470,7 +541,7 @@ int main(int argc,char **argv) {
 
                 if (lseek(p_fd,p_fd_replay,SEEK_SET) == p_fd_replay) {
                     while ((rd=read(p_fd,copybuffer,sizeof(copybuffer))) > 0) {
-                        write(c_fd,copybuffer,(size_t)rd);
+                        write_c_fd(copybuffer,(size_t)rd);
                         count += (unsigned long)rd;
 
                         /* don't stop reading from stdin! */
@@ -491,7 +562,7 @@ int main(int argc,char **argv) {
                         if (rdbuf >= sizeof(readbuffer))
                             printf("WARNING: readbuf overrun while copying\n");
 
-                        if (write(c_fd,readbuffer,(size_t)rdbuf) != (int)rdbuf) {
+                        if (!write_c_fd(readbuffer,(size_t)rdbuf)) {
                             fprintf(stderr,"Write failure\n");
                             break;
                         }
@@ -523,7 +594,7 @@ read_again:
                 data_timeout_at = now + data_timeout;
                 proc_input(readbuffer,(size_t)rd);
                 data_count += (unsigned long long)rd;
-                if (write(c_fd,readbuffer,(size_t)rd) != rd) {
+                if (!write_c_fd(readbuffer,(size_t)rd)) {
                     fprintf(stderr,"Write failure\n");
                     break;
                 }
@@ -542,6 +613,10 @@ read_again:
             }
         }
 
+        /* don't let a quiet stream sit in the buffer */
+        if (c_out.IsOpen())
+            c_out.SubmitIfOlder(aio_flush_ms);
+
         now = time(NULL);
         if (show_data_count && now >= show_data_next) {
             show_data_next = now + (time_t)1;
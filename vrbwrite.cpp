@@ -28,6 +28,7 @@
 #include "dbfs.h"
 #include "autocut.h"
 #include "wavstruc.h"
+#include "pcmconv.h"
 #include "vrbwrite.h"
 
 #include "as_alsa.h"
@@ -43,7 +44,7 @@ VorbisWriter::~VorbisWriter() {
 bool VorbisWriter::Open(const std::string &path) {
     if (IsOpen())
         return true;
-    if (!setup_vorbis())
+    if (!enc_continue && !setup_vorbis())
         return false;
 
     fd = open(path.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_BINARY,0644);
@@ -52,27 +53,88 @@ bool VorbisWriter::Open(const std::string &path) {
         return false;
     }
 
-    /* header */
-    {
-        ogg_packet header={0},header_comm={0},header_code={0};
+    _output_open(fd,0);
 
-        vorbis_analysis_headerout(&vrb_vd,&vrb_vc,&header,&header_comm,&header_code);
+    if (vrb_stream && !_write_headers()) {
+        Close();
+        return false;
+    }
 
-        ogg_stream_packetin(&ogg_os, &header);
-        ogg_stream_packetin(&ogg_os, &header_comm);
-        ogg_stream_packetin(&ogg_os, &header_code);
+    return true;
+}
 
-        if (!_flush_ogg_os()) {
-            fprintf(stderr,"Failed to flush OGG output\n");
-            Close();
-            return false;
-        }
+bool VorbisWriter::_write_headers(void) {
+    ogg_packet header={0},header_comm={0},header_code={0};
+
+    vorbis_analysis_headerout(&vrb_vd,&vrb_vc,&header,&header_comm,&header_code);
+
+    ogg_stream_packetin(&ogg_os, &header);
+    ogg_stream_packetin(&ogg_os, &header_comm);
+    ogg_stream_packetin(&ogg_os, &header_code);
+
+    if (!_flush_ogg_os()) {
+        fprintf(stderr,"Failed to flush OGG output\n");
+        return false;
     }
 
-    vrb_write_pos = lseek(fd,0,SEEK_END);
     return true;
 }
 
+/* A Vorbis stream can't go on past its EOS, but the encoder setup can: the previous file's stream
+ * is ended there, and this file starts a new one (the next link of the chain, as it were) with
+ * the same vorbis_info, without going through vorbis_encode_init_vbr() again. */
+bool VorbisWriter::ContinueFrom(WAVWriter &p) {
+    VorbisWriter *prev = dynamic_cast<VorbisWriter*>(&p);
+
+    if (prev == NULL || !enc_continue || !IsOpen() || vrb_init || vrb_write_pos != (off_t)0)
+        return false;
+    if (!prev->vrb_init || !prev->IsOpen())
+        return false;
+    if (prev->source_rate != source_rate || prev->source_channels != source_channels)
+        return false;
+
+    prev->_end_stream();
+    prev->_stop_stream();
+
+    vrb_vi = prev->vrb_vi;
+    vrb_vc = prev->vrb_vc;
+    memset(&prev->vrb_vi,0,sizeof(prev->vrb_vi));
+    memset(&prev->vrb_vc,0,sizeof(prev->vrb_vc));
+    prev->vrb_init = false;
+    vrb_init = true;
+
+    _start_stream(prev->ogg_serial + 1);
+    return _write_headers();
+}
+
+/* the rest of the audio, through to the EOS page */
+void VorbisWriter::_end_stream(void) {
+    bool eos = false;
+
+    if (!vrb_stream || vrb_write_pos == (off_t)0)
+        return;
+
+    /* write closing page */
+    vorbis_analysis_wrote(&vrb_vd, 0);
+
+    /* write out until the EOS page */
+    while (vorbis_analysis_blockout(&vrb_vd, &vrb_vb) == 1) {
+        vorbis_analysis(&vrb_vb, NULL);
+        vorbis_bitrate_addblock(&vrb_vb);
+
+        while (vorbis_bitrate_flushpacket(&vrb_vd, &ogg_op)) {
+            ogg_stream_packetin(&ogg_os, &ogg_op);
+            if (!_flush_ogg_os()) break;
+            if (ogg_page_eos(&ogg_og)) {
+                eos = true;
+                break;
+            }
+        }
+    }
+
+    if (!eos) fprintf(stderr,"Ogg Vorbis warning, last page did not signal EOS\n");
+}
+
 bool VorbisWriter::_flush_ogg_os(void) {
     while (1) {
         if (fd < 0) return false;
@@ -81,8 +143,8 @@ bool VorbisWriter::_flush_ogg_os(void) {
         if (result == 0) break;
         if (result < 0) return false; // error condition, right?
 
-        if (write(fd, ogg_og.header, (size_t)ogg_og.header_len) != ogg_og.header_len) return false;
-        if (write(fd, ogg_og.body,   (size_t)ogg_og.body_len)   != ogg_og.body_len)   return false;
+        if (_output_write(fd, ogg_og.header, (size_t)ogg_og.header_len) != ogg_og.header_len) return false;
+        if (_output_write(fd, ogg_og.body,   (size_t)ogg_og.body_len)   != ogg_og.body_len)   return false;
 
         vrb_write_pos += (off_t)(ogg_og.header_len + ogg_og.body_len);
     }
@@ -92,30 +154,8 @@ bool VorbisWriter::_flush_ogg_os(void) {
 
 void VorbisWriter::Close(void) {
     if (fd >= 0) {
-        if (vrb_write_pos != (off_t)0 && vrb_init) {
-            bool eos = false;
-
-            /* write closing page */
-            vorbis_analysis_wrote(&vrb_vd, 0);
-
-            /* write out until the EOS page */
-            while (vorbis_analysis_blockout(&vrb_vd, &vrb_vb) == 1) {
-                vorbis_analysis(&vrb_vb, NULL);
-                vorbis_bitrate_addblock(&vrb_vb);
-
-                while (vorbis_bitrate_flushpacket(&vrb_vd, &ogg_op)) {
-                    ogg_stream_packetin(&ogg_os, &ogg_op);
-                    if (!_flush_ogg_os()) break;
-                    if (ogg_page_eos(&ogg_og)) {
-                        eos = true;
-                        break;
-                    }
-                }
-            }
-
-            if (!eos) fprintf(stderr,"Ogg Vorbis warning, last page did not signal EOS\n");
-        }
-
+        _end_stream();
+        _output_close();
         close(fd);
         fd = -1;
     }
@@ -137,10 +177,10 @@ bool VorbisWriter::SetFormat(const AudioFormat &fmt) {
             if (fmt.sample_rate < 1000 || fmt.sample_rate > 192000)
                 return false;
 
-            if (fmt.format_tag == AFMT_PCMS)
-                flip_sign = false;
-            else
-                flip_sign = true;
+            /* conversion for this exact format, chosen once here instead of per buffer */
+            convert = pcmconv_get_float_planar(fmt);
+            if (convert == NULL)
+                return false;
 
             source_rate = fmt.sample_rate;
             source_format = fmt.format_tag;
@@ -158,73 +198,18 @@ bool VorbisWriter::IsOpen(void) const {
     return (fd >= 0);
 }
 
-template <const bool flip_sign> static void _convert_type24(float **dst,const unsigned char* buffer,unsigned int tmp_len_samples,const unsigned int channels) {
-    const long half = 1u << (24u - 1u);
-    const float fhalf = float(half);
-    const uint32_t xorT = flip_sign ? half : 0u;
-
-    for (unsigned int c=0;c < channels;c++) {
-        assert(dst[c] != NULL);
-
-        const unsigned char* sp = buffer + c * 3u;
-        float *dp = dst[c];
-
-        for (unsigned int s=0;s < tmp_len_samples;s++,sp += channels*3u)
-            *dp++ = (float)__lesx24(__leu24(sp) ^ xorT) / fhalf;
-    }
-}
-
-template <typename T,typename sT,const bool flip_sign> static void _convert_type(float **dst,const T* buffer,unsigned int tmp_len_samples,const unsigned int channels) {
-    const long half = ((T)1u << ((T)((sizeof(T) * size_t(8u)) - size_t(1u))));
-    const float fhalf = float(half);
-    const T xorT = flip_sign ? half : (T)0;
-
-    for (unsigned int c=0;c < channels;c++) {
-        assert(dst[c] != NULL);
-
-        const T* sp = buffer + c;
-        float *dp = dst[c];
-
-        for (unsigned int s=0;s < tmp_len_samples;s++,sp += channels)
-            *dp++ = (float)((long)((sT)(*sp ^ xorT))) / fhalf;
-    }
-}
-
 bool VorbisWriter::_convert(const size_t bpf,const void* &buffer,unsigned int tmp_len_samples) {
     ogg_packet ogg_op = {0};
 
     assert(source_channels == 1u || source_channels == 2u);
     assert(bpf == ((unsigned int)source_channels * ((unsigned int)source_bits_per_sample >> 3u)));
 
-    if (!vrb_init) return false;
+    if (!vrb_stream) return false;
 
     float **dstp = vorbis_analysis_buffer(&vrb_vd, (int)tmp_len_samples);
     if (dstp == NULL) return false;
 
-    if (flip_sign) {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/true>(dstp,(const uint8_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/true>(dstp,(const uint16_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/true>(dstp,(const unsigned char*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/true>(dstp,(const uint32_t*)buffer,tmp_len_samples,source_channels);
-        else
-            abort();
-    }
-    else {
-        if (source_bits_per_sample == 8)
-            _convert_type<uint8_t,int8_t,/*flipsign*/false>(dstp,(const uint8_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 16)
-            _convert_type<uint16_t,int16_t,/*flipsign*/false>(dstp,(const uint16_t*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 24)
-            _convert_type24</*flipsign*/false>(dstp,(const unsigned char*)buffer,tmp_len_samples,source_channels);
-        else if (source_bits_per_sample == 32)
-            _convert_type<uint32_t,int32_t,/*flipsign*/false>(dstp,(const uint32_t*)buffer,tmp_len_samples,source_channels);
-        else
-            abort();
-    }
+    convert(dstp,buffer,tmp_len_samples,source_channels);
 
     buffer = (const void*)((const unsigned char*)buffer + (bpf * tmp_len_samples));
 
@@ -244,6 +229,10 @@ bool VorbisWriter::_convert(const size_t bpf,const void* &buffer,unsigned int tm
 
 int VorbisWriter::Write(const void *buffer,unsigned int len) {
     if (IsOpen()) {
+        /* nothing was taken over from the previous file */
+        if (!vrb_init && (!setup_vorbis() || !_write_headers()))
+            return -EINVAL;
+
         const size_t bpf = (size_t)((unsigned int)source_bits_per_sample >> 3u) * (size_t)source_channels;
         unsigned int samples = len / (unsigned int)bpf;
         constexpr unsigned int tmp_len = 4096;
@@ -264,14 +253,29 @@ int VorbisWriter::Write(const void *buffer,unsigned int len) {
 }
 
 void VorbisWriter::free_vorbis(void) {
+    _stop_stream();
     if (vrb_init) {
+        vorbis_comment_clear(&vrb_vc);
+        vorbis_info_clear(&vrb_vi);
+        vrb_init = false;
+    }
+}
+
+void VorbisWriter::_start_stream(int serial) {
+    vorbis_analysis_init(&vrb_vd,&vrb_vi);
+    vorbis_block_init(&vrb_vd,&vrb_vb);
+    ogg_serial = serial;
+    ogg_stream_init(&ogg_os,ogg_serial);
+    vrb_stream = true;
+}
+
+void VorbisWriter::_stop_stream(void) {
+    if (vrb_stream) {
         // ogg page and packet point to memory managed by libvorbis
         ogg_stream_clear(&ogg_os);
         vorbis_block_clear(&vrb_vb);
         vorbis_dsp_clear(&vrb_vd);
-        vorbis_comment_clear(&vrb_vc);
-        vorbis_info_clear(&vrb_vi);
-        vrb_init = false;
+        vrb_stream = false;
     }
 }
 
@@ -295,12 +299,8 @@ bool VorbisWriter::setup_vorbis(void) {
         vorbis_comment_init(&vrb_vc);
         vorbis_comment_add_tag(&vrb_vc, "ENCODER", "Permanent Record recorder");
 
-        vorbis_block_clear(&vrb_vb);
-
-        vorbis_analysis_init(&vrb_vd,&vrb_vi);
-        vorbis_block_init(&vrb_vd,&vrb_vb);
         srand((unsigned int)time(NULL));
-        ogg_stream_init(&ogg_os,rand());
+        _start_stream(rand());
     }
 
     return vrb_init;
@@ -19,9 +19,10 @@ public:
     virtual bool SetFormat(const AudioFormat &fmt);
     virtual bool IsOpen(void) const;
     virtual int Write(const void *buffer,unsigned int len);
+    virtual bool ContinueFrom(WAVWriter &prev);
 private:
     int             fd;
-    bool            flip_sign;
+    pcmconv_float_planar_t convert = NULL;
     off_t           vrb_write_pos;
     unsigned int    source_format = 0;
     uint32_t        source_rate = 0;
@@ -35,10 +36,16 @@ private:
     vorbis_comment          vrb_vc = {0};
     vorbis_dsp_state        vrb_vd = {0};
     vorbis_block            vrb_vb = {0};
-    bool                    vrb_init = false;
+    bool                    vrb_init = false;       /* vrb_vi, vrb_vc set up */
+    bool                    vrb_stream = false;     /* ogg_os, vrb_vd, vrb_vb set up */
+    int                     ogg_serial = 0;
 private:
     void free_vorbis(void);
     bool setup_vorbis(void);
+    void _start_stream(int serial);
+    void _stop_stream(void);
+    bool _write_headers(void);
+    void _end_stream(void);
     bool _convert(const size_t bpf,const void* &buffer,unsigned int tmp_len_samples);
     bool _flush_ogg_os(void);
 };
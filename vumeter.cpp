@@ -0,0 +1,599 @@
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include <new>
+
+#include "common.h"
+#include "monclock.h"
+#include "aufmt.h"
+#include "aufmtui.h"
+#include "pcmconv.h"
+#include "vumeter.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define VU_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
+/* AVX2 is compiled in with a function attribute and picked at runtime, so the rest of
+ * the program still runs on any x86. GCC before 4.9 can't include the intrinsics that way. */
+#if defined(VU_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define VU_HAVE_AVX2
+# include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <x86intrin.h>
+# define VU_HAVE_RDTSC
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <intrin.h>
+# define VU_HAVE_RDTSC
+#endif
+
+static int vu_kernel = -1;
+
+static inline void vu_accum(VUBlock &b,const unsigned int ch,const unsigned int val) {
+    if (b.peak[ch] < val)
+        b.peak[ch] = val;
+
+    b.sumsq[ch] += (uint64_t)val * (uint64_t)val;
+}
+
+/* Meter scale for one sample: 16-bit full scale comes out as 65536 */
+template <const unsigned int bytes> static inline unsigned int vu_level(const long x);
+template <> inline unsigned int vu_level<1u>(const long x) { return (unsigned int)labs(x) * 2u * 256u; }
+template <> inline unsigned int vu_level<2u>(const long x) { return (unsigned int)labs(x) * 2u; }
+template <> inline unsigned int vu_level<3u>(const long x) { return (unsigned int)labs(x / 128l); }
+template <> inline unsigned int vu_level<4u>(const long x) { return (unsigned int)labs(x / 32768l); }
+
+/* Any format, any channel count. The SIMD kernels hand their leftovers to this too.
+ * CH is the channel count, or 0 to take it from the stride, which is how 3..255 channels are metered. */
+template <const unsigned int bytes,const bool pcmu,const unsigned int CH> static void vu_scalar(VUBlock &b,const unsigned char *p,unsigned int frames,unsigned int stride) {
+    const unsigned int step = (CH != 0u ? CH : stride) * bytes;
+    const unsigned int channels = CH != 0u ? CH : (stride > VU_MAX_CHANNELS ? VU_MAX_CHANNELS : stride);
+    unsigned int ch;
+
+    while (frames-- > 0u) {
+        for (ch=0;ch < channels;ch++)
+            vu_accum(b,ch,vu_level<bytes>((long)pcm_sample<bytes,pcmu>::get(p + (ch * bytes))));
+
+        p += step;
+    }
+}
+
+/* The SIMD kernels keep a running max and sum of squares per lane and fold the lanes into
+ * channels at the end. That only works if every lane always sees the same channel, so they
+ * are only used when the channel count divides the number of samples per step (1/2/4/8),
+ * or (the _wide kernels) is a multiple of it.
+ * They return how many samples they did, the caller does the rest with vu_scalar(). */
+static void vu_fold_peak(VUBlock &b,const unsigned int *pk,unsigned int lanes,unsigned int channels,unsigned int scale) {
+    unsigned int i;
+
+    for (i=0;i < lanes;i++) {
+        const unsigned int ch = i % channels;
+
+        if (b.peak[ch] < pk[i] * scale)
+            b.peak[ch] = pk[i] * scale;
+    }
+}
+
+/* lane[] says which sample of the step each sum belongs to */
+static void vu_fold_sumsq(VUBlock &b,const uint64_t *sq,const unsigned char *lane,unsigned int lanes,unsigned int channels,unsigned int scale) {
+    unsigned int i;
+
+    for (i=0;i < lanes;i++)
+        b.sumsq[(unsigned int)lane[i] % channels] += sq[i] * (uint64_t)scale;
+}
+
+#if defined(VU_HAVE_SSE2)
+/* 16-bit, 8 samples per step. mx is biased by 0x8000 so that signed max works as unsigned max */
+template <const bool pcmu> static inline void vu_sse2_16_step(const unsigned char *p,__m128i &mx,__m128i *q) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p),_mm_set1_epi16(pcmu ? (short)0x8000 : (short)0));
+    const __m128i s = _mm_srai_epi16(x,15);
+
+    x = _mm_sub_epi16(_mm_xor_si128(x,s),s); /* |x|, -32768 comes out as unsigned 32768 */
+    mx = _mm_max_epi16(mx,_mm_xor_si128(x,bias));
+
+    /* square each lane to 32 bits (pair every sample with a zero for madd), widen to 64 to add up */
+    const __m128i lo = _mm_unpacklo_epi16(x,zero);
+    const __m128i hi = _mm_unpackhi_epi16(x,zero);
+    const __m128i sqlo = _mm_madd_epi16(lo,lo);
+    const __m128i sqhi = _mm_madd_epi16(hi,hi);
+
+    q[0] = _mm_add_epi64(q[0],_mm_unpacklo_epi32(sqlo,zero));
+    q[1] = _mm_add_epi64(q[1],_mm_unpackhi_epi32(sqlo,zero));
+    q[2] = _mm_add_epi64(q[2],_mm_unpacklo_epi32(sqhi,zero));
+    q[3] = _mm_add_epi64(q[3],_mm_unpackhi_epi32(sqhi,zero));
+}
+
+/* lanes in sample order */
+static inline void vu_sse2_16_store(unsigned int *pk,uint64_t *sq,const __m128i mx,const __m128i *q) {
+    uint16_t mv[8];
+    unsigned int j;
+
+    _mm_storeu_si128((__m128i*)mv,_mm_xor_si128(mx,_mm_set1_epi16((short)0x8000)));
+    _mm_storeu_si128((__m128i*)(sq+0),q[0]);
+    _mm_storeu_si128((__m128i*)(sq+2),q[1]);
+    _mm_storeu_si128((__m128i*)(sq+4),q[2]);
+    _mm_storeu_si128((__m128i*)(sq+6),q[3]);
+    for (j=0;j < 8u;j++) pk[j] = mv[j];
+}
+
+template <const bool pcmu> static unsigned int vu_sse2_16(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    static const unsigned char sq_lane[8] = { 0,1, 2,3, 4,5, 6,7 };
+    const __m128i zero = _mm_setzero_si128();
+    __m128i mx = _mm_set1_epi16((short)0x8000);
+    __m128i q[4] = { zero, zero, zero, zero };
+    unsigned int i;
+
+    for (i=0;(i+8u) <= samples;i += 8u)
+        vu_sse2_16_step<pcmu>(p + (i * 2u),mx,q);
+
+    if (i != 0u) {
+        unsigned int pk[8];
+        uint64_t sq[8];
+
+        vu_sse2_16_store(pk,sq,mx,q);
+        vu_fold_peak(b,pk,8,channels,2u);
+        vu_fold_sumsq(b,sq,sq_lane,8,channels,4u);
+    }
+
+    return i;
+}
+
+/* 32-bit, 8 samples (two vectors) per step. m[] are running maxima, q[] sums of squares */
+template <const bool pcmu> static inline void vu_sse2_32_step(const unsigned char *p,__m128i *m,__m128i *q) {
+    const __m128i flip = _mm_set1_epi32(pcmu ? (int)0x80000000u : 0);
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p),flip);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + 16u)),flip);
+    const __m128i s0 = _mm_srai_epi32(x0,31);
+    const __m128i s1 = _mm_srai_epi32(x1,31);
+
+    /* |x| / 32768, which fits in 17 bits */
+    x0 = _mm_srli_epi32(_mm_sub_epi32(_mm_xor_si128(x0,s0),s0),15);
+    x1 = _mm_srli_epi32(_mm_sub_epi32(_mm_xor_si128(x1,s1),s1),15);
+
+    /* no 32-bit max before SSE4.1 */
+    const __m128i g0 = _mm_cmpgt_epi32(x0,m[0]);
+    const __m128i g1 = _mm_cmpgt_epi32(x1,m[1]);
+    m[0] = _mm_or_si128(_mm_and_si128(g0,x0),_mm_andnot_si128(g0,m[0]));
+    m[1] = _mm_or_si128(_mm_and_si128(g1,x1),_mm_andnot_si128(g1,m[1]));
+
+    /* even lanes, then odd lanes, squared to 64 bits */
+    q[0] = _mm_add_epi64(q[0],_mm_mul_epu32(x0,x0));
+    q[1] = _mm_add_epi64(q[1],_mm_mul_epu32(_mm_srli_epi64(x0,32),_mm_srli_epi64(x0,32)));
+    q[2] = _mm_add_epi64(q[2],_mm_mul_epu32(x1,x1));
+    q[3] = _mm_add_epi64(q[3],_mm_mul_epu32(_mm_srli_epi64(x1,32),_mm_srli_epi64(x1,32)));
+}
+
+/* which sample of the step each sum of squares belongs to: even lanes first */
+static const unsigned char vu_sse2_32_lane[8] = { 0,2, 1,3, 4,6, 5,7 };
+
+static inline void vu_sse2_32_store(unsigned int *pk,uint64_t *sq,const __m128i *m,const __m128i *q) {
+    _mm_storeu_si128((__m128i*)(pk+0),m[0]);
+    _mm_storeu_si128((__m128i*)(pk+4),m[1]);
+    _mm_storeu_si128((__m128i*)(sq+0),q[0]);
+    _mm_storeu_si128((__m128i*)(sq+2),q[1]);
+    _mm_storeu_si128((__m128i*)(sq+4),q[2]);
+    _mm_storeu_si128((__m128i*)(sq+6),q[3]);
+}
+
+template <const bool pcmu> static unsigned int vu_sse2_32(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i m[2] = { zero, zero };
+    __m128i q[4] = { zero, zero, zero, zero };
+    unsigned int i;
+
+    for (i=0;(i+8u) <= samples;i += 8u)
+        vu_sse2_32_step<pcmu>(p + (i * 4u),m,q);
+
+    if (i != 0u) {
+        unsigned int pk[8];
+        uint64_t sq[8];
+
+        vu_sse2_32_store(pk,sq,m,q);
+        vu_fold_peak(b,pk,8,channels,1u);
+        vu_fold_sumsq(b,sq,vu_sse2_32_lane,8,channels,1u);
+    }
+
+    return i;
+}
+
+/* 16, 24, 32... channels. A step of 8 samples no longer sees the same channels every time, so
+ * each group of 8 channels gets its own set of lanes, kept in a small array (a few KB at most,
+ * which stays in L1) instead of registers, and the block is done a frame at a time. */
+template <const bool pcmu> static unsigned int vu_sse2_16_wide(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    const unsigned int groups = channels / 8u;
+    const unsigned int frames = samples / channels;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i mx[VU_MAX_CHANNELS / 8u],q[VU_MAX_CHANNELS / 8u][4];
+    unsigned int f,g,j;
+
+    for (g=0;g < groups;g++) {
+        mx[g] = _mm_set1_epi16((short)0x8000);
+        q[g][0] = q[g][1] = q[g][2] = q[g][3] = zero;
+    }
+
+    for (f=0;f < frames;f++,p += channels * 2u) {
+        for (g=0;g < groups;g++)
+            vu_sse2_16_step<pcmu>(p + (g * 16u),mx[g],q[g]);
+    }
+
+    for (g=0;g < groups && frames != 0u;g++) {
+        unsigned int pk[8];
+        uint64_t sq[8];
+
+        vu_sse2_16_store(pk,sq,mx[g],q[g]);
+        for (j=0;j < 8u;j++) {
+            b.peak[(g * 8u) + j] = pk[j] * 2u;
+            b.sumsq[(g * 8u) + j] = sq[j] * 4u;
+        }
+    }
+
+    return frames * channels;
+}
+
+template <const bool pcmu> static unsigned int vu_sse2_32_wide(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    const unsigned int groups = channels / 8u;
+    const unsigned int frames = samples / channels;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i m[VU_MAX_CHANNELS / 8u][2],q[VU_MAX_CHANNELS / 8u][4];
+    unsigned int f,g,j;
+
+    for (g=0;g < groups;g++) {
+        m[g][0] = m[g][1] = zero;
+        q[g][0] = q[g][1] = q[g][2] = q[g][3] = zero;
+    }
+
+    for (f=0;f < frames;f++,p += channels * 4u) {
+        for (g=0;g < groups;g++)
+            vu_sse2_32_step<pcmu>(p + (g * 32u),m[g],q[g]);
+    }
+
+    for (g=0;g < groups && frames != 0u;g++) {
+        unsigned int pk[8];
+        uint64_t sq[8];
+
+        vu_sse2_32_store(pk,sq,m[g],q[g]);
+        for (j=0;j < 8u;j++) {
+            b.peak[(g * 8u) + j] = pk[j];
+            b.sumsq[(g * 8u) + vu_sse2_32_lane[j]] = sq[j];
+        }
+    }
+
+    return frames * channels;
+}
+#endif
+
+#if defined(VU_HAVE_AVX2)
+/* 16-bit, 16 samples per step. 256-bit unpacks work within each 128-bit half, hence the lane order */
+template <const bool pcmu> __attribute__((target("avx2"))) static unsigned int vu_avx2_16(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    static const unsigned char sq_lane[16] = { 0,1,8,9, 2,3,10,11, 4,5,12,13, 6,7,14,15 };
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi16(pcmu ? (short)0x8000 : (short)0);
+    __m256i mx = zero;
+    __m256i q0 = zero,q1 = zero,q2 = zero,q3 = zero;
+    unsigned int i;
+
+    for (i=0;(i+16u) <= samples;i += 16u) {
+        const __m256i x = _mm256_abs_epi16(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + (i * 2u))),flip));
+
+        mx = _mm256_max_epu16(mx,x);
+
+        const __m256i lo = _mm256_unpacklo_epi16(x,zero);
+        const __m256i hi = _mm256_unpackhi_epi16(x,zero);
+        const __m256i sqlo = _mm256_madd_epi16(lo,lo);
+        const __m256i sqhi = _mm256_madd_epi16(hi,hi);
+
+        q0 = _mm256_add_epi64(q0,_mm256_unpacklo_epi32(sqlo,zero));
+        q1 = _mm256_add_epi64(q1,_mm256_unpackhi_epi32(sqlo,zero));
+        q2 = _mm256_add_epi64(q2,_mm256_unpacklo_epi32(sqhi,zero));
+        q3 = _mm256_add_epi64(q3,_mm256_unpackhi_epi32(sqhi,zero));
+    }
+
+    if (i != 0u) {
+        uint16_t mv[16];
+        unsigned int pk[16],j;
+        uint64_t sq[16];
+
+        _mm256_storeu_si256((__m256i*)mv,mx);
+        _mm256_storeu_si256((__m256i*)(sq+0),q0);
+        _mm256_storeu_si256((__m256i*)(sq+4),q1);
+        _mm256_storeu_si256((__m256i*)(sq+8),q2);
+        _mm256_storeu_si256((__m256i*)(sq+12),q3);
+        for (j=0;j < 16u;j++) pk[j] = mv[j];
+
+        vu_fold_peak(b,pk,16,channels,2u);
+        vu_fold_sumsq(b,sq,sq_lane,16,channels,4u);
+    }
+
+    return i;
+}
+
+/* 32-bit, 8 samples per step */
+template <const bool pcmu> __attribute__((target("avx2"))) static unsigned int vu_avx2_32(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels) {
+    static const unsigned char sq_lane[8] = { 0,2,4,6, 1,3,5,7 };
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i flip = _mm256_set1_epi32(pcmu ? (int)0x80000000u : 0);
+    __m256i mx = zero,q0 = zero,q1 = zero;
+    unsigned int i;
+
+    for (i=0;(i+8u) <= samples;i += 8u) {
+        /* |x| / 32768. abs() leaves -2^31 as 0x80000000, which the logical shift turns into 65536 */
+        const __m256i x = _mm256_srli_epi32(_mm256_abs_epi32(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + (i * 4u))),flip)),15);
+        const __m256i xo = _mm256_srli_epi64(x,32);
+
+        mx = _mm256_max_epi32(mx,x);
+        q0 = _mm256_add_epi64(q0,_mm256_mul_epu32(x,x));
+        q1 = _mm256_add_epi64(q1,_mm256_mul_epu32(xo,xo));
+    }
+
+    if (i != 0u) {
+        unsigned int pk[8];
+        uint64_t sq[8];
+
+        _mm256_storeu_si256((__m256i*)pk,mx);
+        _mm256_storeu_si256((__m256i*)(sq+0),q0);
+        _mm256_storeu_si256((__m256i*)(sq+4),q1);
+
+        vu_fold_peak(b,pk,8,channels,1u);
+        vu_fold_sumsq(b,sq,sq_lane,8,channels,1u);
+    }
+
+    return i;
+}
+#endif
+
+int VU_kernel_best(void) {
+#if defined(VU_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return VU_KERNEL_AVX2;
+#endif
+#if defined(VU_HAVE_SSE2)
+    return VU_KERNEL_SSE2;
+#else
+    return VU_KERNEL_SCALAR;
+#endif
+}
+
+int VU_kernel_get(void) {
+    if (vu_kernel < 0)
+        vu_kernel = VU_kernel_best();
+
+    return vu_kernel;
+}
+
+bool VU_kernel_set(int k) {
+    if (k < 0 || k > VU_kernel_best())
+        return false;
+
+    vu_kernel = k;
+    return true;
+}
+
+const char *VU_kernel_name(int k) {
+    switch (k) {
+        case VU_KERNEL_SCALAR:  return "scalar";
+        case VU_KERNEL_SSE2:    return "sse2";
+        case VU_KERNEL_AVX2:    return "avx2";
+        default:                break;
+    }
+
+    return "?";
+}
+
+/* [pcmu][bytes-1][channel class] */
+#define VU_SCALAR_CHANNELS(b,u) { &vu_scalar<b,u,0u>, &vu_scalar<b,u,1u>, &vu_scalar<b,u,2u>, &vu_scalar<b,u,8u> }
+#define VU_SCALAR_WIDTHS(u) { VU_SCALAR_CHANNELS(1u,u), VU_SCALAR_CHANNELS(2u,u), VU_SCALAR_CHANNELS(3u,u), VU_SCALAR_CHANNELS(4u,u) }
+
+static const VUScalarKernel vu_scalar_table[2][4][4] = { VU_SCALAR_WIDTHS(false), VU_SCALAR_WIDTHS(true) };
+
+#undef VU_SCALAR_WIDTHS
+#undef VU_SCALAR_CHANNELS
+
+/* pick the kernels for this format and the current VU_kernel_get() setting */
+bool VU_kernel_for(VUKernel &k,const AudioFormat &fmt) {
+    const int level = VU_kernel_get();
+    unsigned int u,c;
+
+    k.simd = NULL;
+    k.scalar = NULL;
+    k.channels = 0;
+    k.bytes_per_sample = 0;
+
+    if (!(fmt.format_tag == AFMT_PCMU || fmt.format_tag == AFMT_PCMS))
+        return false;
+    if (!(fmt.bits_per_sample == 8 || fmt.bits_per_sample == 16 || fmt.bits_per_sample == 24 || fmt.bits_per_sample == 32))
+        return false;
+    if (fmt.channels == 0)
+        return false;
+
+    u = (fmt.format_tag == AFMT_PCMU) ? 1u : 0u;
+    switch (fmt.channels) {
+        case 1:     c = 1; break;
+        case 2:     c = 2; break;
+        case 8:     c = 3; break;
+        default:    c = 0; break;
+    }
+
+    k.channels = fmt.channels;
+    k.bytes_per_sample = (unsigned int)fmt.bits_per_sample / 8u;
+    k.scalar = vu_scalar_table[u][k.bytes_per_sample - 1u][c];
+
+    /* lanes have to line up with channels, see above */
+    if (level != VU_KERNEL_SCALAR && (8u % (unsigned int)fmt.channels) == 0u) {
+#if defined(VU_HAVE_AVX2)
+        if (k.simd == NULL && level >= VU_KERNEL_AVX2) {
+            if (fmt.bits_per_sample == 16)
+                k.simd = u ? &vu_avx2_16<true> : &vu_avx2_16<false>;
+            else if (fmt.bits_per_sample == 32)
+                k.simd = u ? &vu_avx2_32<true> : &vu_avx2_32<false>;
+        }
+#endif
+#if defined(VU_HAVE_SSE2)
+        if (k.simd == NULL && level >= VU_KERNEL_SSE2) {
+            if (fmt.bits_per_sample == 16)
+                k.simd = u ? &vu_sse2_16<true> : &vu_sse2_16<false>;
+            else if (fmt.bits_per_sample == 32)
+                k.simd = u ? &vu_sse2_32<true> : &vu_sse2_32<false>;
+        }
+#endif
+    }
+#if defined(VU_HAVE_SSE2)
+    /* a set of lanes per 8 channels. SSE2 on AVX2 machines too, there is no AVX2 version */
+    else if (level != VU_KERNEL_SCALAR && ((unsigned int)fmt.channels % 8u) == 0u) {
+        if (fmt.bits_per_sample == 16)
+            k.simd = u ? &vu_sse2_16_wide<true> : &vu_sse2_16_wide<false>;
+        else if (fmt.bits_per_sample == 32)
+            k.simd = u ? &vu_sse2_32_wide<true> : &vu_sse2_32_wide<false>;
+    }
+#endif
+
+    return true;
+}
+
+void VU_measure_block(VUBlock &b,const void *audio,unsigned int frames,const VUKernel &k) {
+    const unsigned char *p = (const unsigned char*)audio;
+    const unsigned int samples = frames * k.channels;
+    unsigned int done = 0;
+
+    memset(b.peak,0,sizeof(b.peak[0]) * k.channels);
+    memset(b.sumsq,0,sizeof(b.sumsq[0]) * k.channels);
+    b.frames = frames;
+
+    if (k.scalar == NULL)
+        return;
+
+    if (k.simd != NULL)
+        done = k.simd(b,p,samples,k.channels);
+
+    if (done < samples)
+        k.scalar(b,p + (done * k.bytes_per_sample),(samples - done) / k.channels,k.channels);
+}
+
+static inline uint64_t vu_cycles(void) {
+#if defined(VU_HAVE_RDTSC)
+    return (uint64_t)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Time every kernel this CPU can run on one second of noise in the given format, and check
+ * each one gets exactly the same answer as the scalar code. Reads come in blocks of about
+ * this many frames, so measure that way too. */
+void VU_benchmark(const AudioFormat &fmt) {
+    const unsigned int block = 1024;
+    const unsigned int frames = fmt.sample_rate;
+    const int best = VU_kernel_best();
+    const int prev = VU_kernel_get();
+    unsigned int blocks,i,j;
+    unsigned char *buf;
+    VUBlock *ref;
+    uint32_t lcg = 0x12345678u;
+    VUKernel kern;
+    int k;
+
+    if (fmt.bytes_per_frame == 0 || frames < block || !VU_kernel_for(kern,fmt)) {
+        fprintf(stderr,"Unsupported format for VU benchmark\n");
+        return;
+    }
+
+    blocks = frames / block;
+    buf = new(std::nothrow) unsigned char[(size_t)blocks * (size_t)block * (size_t)fmt.bytes_per_frame];
+    ref = new(std::nothrow) VUBlock[blocks];
+    if (buf == NULL || ref == NULL) {
+        fprintf(stderr,"Out of memory\n");
+        delete[] buf;
+        delete[] ref;
+        return;
+    }
+
+    /* noise, including the full-scale extremes now and then */
+    for (i=0;i < (blocks * block * fmt.bytes_per_frame);i++) {
+        lcg = (lcg * 1103515245u) + 12345u;
+        buf[i] = (unsigned char)(lcg >> 16u);
+        if ((lcg & 0xFFF000u) == 0u) buf[i] = (lcg & 0x1000000u) ? 0x80 : 0x7F;
+    }
+
+    VU_kernel_set(VU_KERNEL_SCALAR);
+    VU_kernel_for(kern,fmt);
+    for (i=0;i < blocks;i++)
+        VU_measure_block(ref[i],buf + ((size_t)i * block * fmt.bytes_per_frame),block,kern);
+
+    {
+        AudioFormat pf = fmt;
+        printf("VU meter benchmark: %s, %u frame blocks\n",ui_print_format(pf).c_str(),block);
+    }
+
+    for (k=VU_KERNEL_SCALAR;k <= best;k++) {
+        unsigned long long sink = 0,passes = 0;
+        uint64_t t0,t1,c0,c1;
+        bool match = true;
+        VUBlock vb;
+
+        VU_kernel_set(k);
+        VU_kernel_for(kern,fmt);
+
+        for (i=0;i < blocks;i++) {
+            VU_measure_block(vb,buf + ((size_t)i * block * fmt.bytes_per_frame),block,kern);
+            for (j=0;j < fmt.channels;j++) {
+                if (vb.peak[j] != ref[i].peak[j] || vb.sumsq[j] != ref[i].sumsq[j])
+                    match = false;
+            }
+        }
+
+        t0 = monotonic_clock_us();
+        c0 = vu_cycles();
+        do {
+            for (i=0;i < blocks;i++) {
+                VU_measure_block(vb,buf + ((size_t)i * block * fmt.bytes_per_frame),block,kern);
+                sink += vb.peak[0];
+            }
+            passes++;
+            t1 = monotonic_clock_us();
+        } while ((t1 - t0) < (uint64_t)500000u);
+        c1 = vu_cycles();
+
+        const double total = (double)passes * (double)blocks * (double)block;
+        const double ns = ((double)(t1 - t0) * 1000.0) / total;
+
+        printf("    %-8s",VU_kernel_name(k));
+#if defined(VU_HAVE_RDTSC)
+        printf(" %8.3f cycles/frame",(double)(c1 - c0) / total);
+#else
+        (void)c0;
+        (void)c1;
+#endif
+        printf(" %8.3f ns/frame %10.0fx realtime%s\n",
+                ns,1000000000.0 / (ns * (double)fmt.sample_rate),
+                match ? "" : "  MISMATCH with scalar");
+
+        if (sink == 0) printf("\n"); /* keep the work from being optimized away */
+    }
+
+    VU_kernel_set(prev);
+    delete[] buf;
+    delete[] ref;
+}
+
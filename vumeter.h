@@ -0,0 +1,52 @@
+#ifndef __VUMETER_H
+#define __VUMETER_H
+
+#include "config.h"
+#include "aufmt.h"
+
+#include <stdint.h>
+
+/* as many as AudioFormat can describe (uint8_t) */
+#define VU_MAX_CHANNELS         255
+
+/* Peak and energy of each channel over one block of audio, on the 0..65535 scale the meters use.
+ * Measuring a whole block at once, instead of stepping the meter ballistics per sample, is what
+ * lets the kernels below run through interleaved audio with SIMD. Only the first 'channels'
+ * entries are used (and cleared), so a block of stereo doesn't pay for 255 channels. */
+struct VUBlock {
+    unsigned int        peak[VU_MAX_CHANNELS];
+    uint64_t            sumsq[VU_MAX_CHANNELS];
+    unsigned int        frames;
+};
+
+enum {
+    VU_KERNEL_SCALAR=0,
+    VU_KERNEL_SSE2,
+    VU_KERNEL_AVX2,
+
+    VU_KERNEL_MAX
+};
+
+/* The kernels for one format, picked once by VU_kernel_for() when the format is known, so that
+ * measuring a block doesn't have to look at the format again. The SIMD kernel (if any) does as
+ * many samples as it can and returns how many, the scalar kernel does the rest. */
+typedef unsigned int (*VUSimdKernel)(VUBlock &b,const unsigned char *p,unsigned int samples,unsigned int channels);
+typedef void (*VUScalarKernel)(VUBlock &b,const unsigned char *p,unsigned int frames,unsigned int stride);
+
+struct VUKernel {
+    VUSimdKernel        simd;
+    VUScalarKernel      scalar;
+    unsigned int        channels;
+    unsigned int        bytes_per_sample;
+};
+
+bool VU_kernel_for(VUKernel &k,const AudioFormat &fmt);
+void VU_measure_block(VUBlock &b,const void *audio,unsigned int frames,const VUKernel &k);
+int VU_kernel_best(void);
+int VU_kernel_get(void);
+bool VU_kernel_set(int k);
+const char *VU_kernel_name(int k);
+void VU_benchmark(const AudioFormat &fmt);
+
+#endif //__VUMETER_H
+
@@ -19,6 +19,16 @@ typedef struct {
     uint32_t            fourcc;         /* ASCII 4-char ident such as 'WAVE' */
 } RIFF_LIST_chunk;
 
+typedef struct {                        /* RF64/BW64 'ds64' chunk (EBU Tech 3306), without the table */
+    uint32_t            riffSizeLow;    /* 64-bit sizes for the 'RF64' and 'data' chunks whose own */
+    uint32_t            riffSizeHigh;   /* length fields say 0xFFFFFFFF */
+    uint32_t            dataSizeLow;
+    uint32_t            dataSizeHigh;
+    uint32_t            sampleCountLow;
+    uint32_t            sampleCountHigh;
+    uint32_t            tableLength;    /* entries for other oversized chunks, none here */
+} RIFF_ds64;                            /* (28) */
+
 typedef struct {                        /* (sizeof) (offset hex) (offset dec) */
     uint32_t            a;              /* (4)   +0x00 +0 */
     uint16_t            b,c;            /* (2,2) +0x04 +4 */
@@ -73,12 +83,24 @@ typedef struct {                                            /* (sizeof) (offset
 
 static const uint32_t _RIFF_listcc_RIFF = 0x52494646;       /* 'RIFF' */
 #define RIFF_listcc_RIFF            be32toh(_RIFF_listcc_RIFF)
+static const uint32_t _RIFF_listcc_LIST = 0x4C495354;       /* 'LIST' */
+#define RIFF_listcc_LIST            be32toh(_RIFF_listcc_LIST)
+static const uint32_t _RIFF_listcc_RF64 = 0x52463634;       /* 'RF64' */
+#define RIFF_listcc_RF64            be32toh(_RIFF_listcc_RF64)
 static const uint32_t _RIFF_fourcc_WAVE = 0x57415645;       /* 'WAVE' */
 #define RIFF_fourcc_WAVE            be32toh(_RIFF_fourcc_WAVE)
 static const uint32_t _RIFF_fourcc_fmt  = 0x666D7420;       /* 'fmt ' */
 #define RIFF_fourcc_fmt             be32toh(_RIFF_fourcc_fmt)
 static const uint32_t _RIFF_fourcc_data = 0x64617461;       /* 'data' */
 #define RIFF_fourcc_data            be32toh(_RIFF_fourcc_data)
+static const uint32_t _RIFF_fourcc_JUNK = 0x4A554E4B;       /* 'JUNK' */
+#define RIFF_fourcc_JUNK            be32toh(_RIFF_fourcc_JUNK)
+static const uint32_t _RIFF_fourcc_ds64 = 0x64733634;       /* 'ds64' */
+#define RIFF_fourcc_ds64            be32toh(_RIFF_fourcc_ds64)
+static const uint32_t _RIFF_fourcc_INFO = 0x494E464F;       /* 'INFO' */
+#define RIFF_fourcc_INFO            be32toh(_RIFF_fourcc_INFO)
+static const uint32_t _RIFF_fourcc_ICMT = 0x49434D54;       /* 'ICMT' */
+#define RIFF_fourcc_ICMT            be32toh(_RIFF_fourcc_ICMT)
 
 const windows_GUID windows_KSDATAFORMAT_SUBTYPE_PCM = /* 00000001-0000-0010-8000-00aa00389b71 */
 	{htole32(0x00000001),htole16(0x0000),htole16(0x0010),{0x80,0x00},{0x00,0xaa,0x00,0x38,0x9b,0x71}};
@@ -28,20 +28,152 @@
 #include "dbfs.h"
 #include "autocut.h"
 #include "wavstruc.h"
+#include "pcmconv.h"
 #include "wavwrite.h"
 
 #include "as_alsa.h"
 
-WAVWriter::WAVWriter() : fd(-1), fmt_size(0), wav_data_start(0), wav_data_limit((uint32_t)0x7F000000ul) {
+/* A plain RIFF WAV file can't go past 4GB, and plenty of software still treats the lengths as
+ * signed, so past 2GB the file becomes RF64 (EBU Tech 3306) when it is closed, if allowed,
+ * instead of having to be split. Room for the 'ds64' chunk that needs is reserved at the start
+ * as a 'JUNK' chunk, which readers skip if it stays a plain WAV file. */
+#define WAV_DATA_LIMIT              ((uint64_t)0x7F000000ul)
+#define WAV_RF64_DATA_LIMIT         ((uint64_t)1u << (uint64_t)44u) /* 16TB, ext4's file size limit */
+
+/* Audio is collected in page aligned buffers (see asyncout.h) and written out in big page aligned
+ * pieces, instead of one write() (plus an lseek()) per 4KB the source hands us. It is also written
+ * out after wbuf_flush_ms even if not full, so that what is on disk never lags far behind. */
+
+WAVWriter::WAVWriter() : enc_continue(false), fd(-1), fmt_size(0), need_xlat(false), xlat(NULL), channels(0), wav_data_start(0), wav_data_limit(WAV_DATA_LIMIT), wav_write_pos(0), wav_ds64_pos(0), rf64(true),
+    wbuf_size((size_t)1024u * (size_t)1024u), wbuf_flush_ms(2000), out_backend(ASYNCOUT_SYNC), out_depth(4), writeback(0), prealloc(0), xlat_buf(NULL), xlat_size(0) {
 }
 
 WAVWriter::~WAVWriter() {
     Close();
+    delete[] xlat_buf;
+    xlat_buf = NULL;
+}
+
+/* size of each write buffer (0 = none, write straight through) and how long audio may sit in
+ * one before being written anyway. Only takes effect before Open(). */
+void WAVWriter::SetWriteBuffer(size_t size,unsigned int flush_ms) {
+    if (IsOpen()) return;
+
+    wbuf_size = size;
+    wbuf_flush_ms = flush_ms;
+}
+
+/* how the buffers get to the file (ASYNCOUT_*) and how many there are. Only takes effect before Open(). */
+void WAVWriter::SetOutput(int backend,unsigned int depth) {
+    if (IsOpen()) return;
+
+    out_backend = backend;
+    out_depth = depth;
+}
+
+/* write back and drop from the page cache every this many bytes (0 = leave it to the kernel).
+ * Only takes effect before Open(), and only with a write buffer. */
+void WAVWriter::SetWriteback(size_t every) {
+    if (IsOpen()) return;
+
+    writeback = every;
+}
+
+/* whether the file may become RF64 if it gets too big for WAV, or else Write() returns -ENOSPC.
+ * Only takes effect before Open(). */
+void WAVWriter::SetRF64(bool en) {
+    if (IsOpen()) return;
+
+    rf64 = en;
+}
+
+/* Encoders only: don't set up the encoder at Open(), so that the one writing the previous file
+ * can be taken over with ContinueFrom() instead of starting over at every cut. If nothing is
+ * taken over, it is set up on the first Write(). Only takes effect before Open(). */
+void WAVWriter::SetContinue(bool en) {
+    if (IsOpen()) return;
+
+    enc_continue = en;
+}
+
+/* Take over the encoder of 'prev', the writer of the file just before this one, which is ended
+ * there. Only right after Open(), before anything is written. PCM has nothing to carry over. */
+bool WAVWriter::ContinueFrom(WAVWriter &prev) {
+    (void)prev;
+    return false;
+}
+
+/* true while an encoder given away with ContinueFrom() still owes this file data, which it
+ * writes as part of the next file's Write() calls. Don't Close() until it isn't. */
+bool WAVWriter::Finishing(void) const {
+    return false;
+}
+
+/* how big the file is expected to get (0 = no idea), so that the space can be reserved when it is
+ * opened and the file does not fragment as it grows. whatever is not used is given back at Close() */
+void WAVWriter::SetPreallocate(uint64_t bytes) {
+    if (IsOpen()) return;
+
+    prealloc = bytes;
+}
+
+/* how the output went, for the last file written. empty if it did not go through the buffers */
+std::string WAVWriter::OutputStats(void) const {
+    if (out.Stats().writes == 0ull)
+        return std::string();
+
+    return out.StatsString();
+}
+
+/* for this and subclasses: start buffering output to 'fd', which is at file offset 'pos' */
+void WAVWriter::_output_open(int fd,off_t pos) {
+    if (wbuf_size == 0)
+        return;
+
+    out.SetWriteback(writeback);
+    if (!out.Open(fd,pos,wbuf_size,out_depth,out_backend))
+        fprintf(stderr,"Unable to allocate write buffers, writing straight through\n");
+}
+
+/* append to the file, through the buffers if there are any. returns len or -errno */
+int WAVWriter::_output_write(int fd,const void *buffer,size_t len) {
+    const unsigned char *s = (const unsigned char*)buffer;
+    size_t done = 0;
+    int r;
+
+    if (out.IsOpen()) {
+        if ((r=out.Append(buffer,len)) < 0)
+            return r;
+        if ((r=out.SubmitIfOlder(wbuf_flush_ms)) < 0)
+            return r;
+
+        return (int)len;
+    }
+
+    while (done < len) {
+        const int wd = (int)write(fd,s + done,(unsigned int)(len - done));
+        if (wd < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (wd == 0)
+            return -ENOSPC;
+
+        done += (size_t)wd;
+    }
+
+    return (int)done;
+}
+
+/* write out and wait for everything buffered, before the file is touched any other way */
+int WAVWriter::_output_close(void) {
+    return out.Close();
 }
 
 bool WAVWriter::Open(const std::string &path) {
     RIFF_LIST_chunk lchk;
     RIFF_chunk chk;
+    uint64_t hdr;
 
     if (IsOpen())
         return true;
@@ -61,6 +193,24 @@ bool WAVWriter::Open(const std::string &path) {
         Close();
         return false;
     }
+    hdr = sizeof(lchk);
+
+    /* 'ds64' has to be the first chunk in an RF64 file */
+    wav_ds64_pos = 0;
+    if (rf64) {
+        RIFF_ds64 ds;
+
+        memset(&ds,0,sizeof(ds));
+        chk.fourcc = RIFF_fourcc_JUNK;
+        chk.length = htole32((uint32_t)sizeof(ds));
+        if (write(fd,&chk,sizeof(chk)) != sizeof(chk) || write(fd,&ds,sizeof(ds)) != sizeof(ds)) {
+            Close();
+            return false;
+        }
+
+        wav_ds64_pos = (uint32_t)hdr;
+        hdr += sizeof(chk) + sizeof(ds);
+    }
 
     /* within the 'RIFF:WAVE' chunk write 'fmt ' */
     chk.fourcc = RIFF_fourcc_fmt;
@@ -74,46 +224,162 @@ bool WAVWriter::Open(const std::string &path) {
         return false;
     }
 
+    hdr += sizeof(chk) + fmt_size;
+
     /* then start the 'data' chunk. WAVE output will follow. */
     chk.fourcc = RIFF_fourcc_data;
-    chk.length = (uint32_t)(0xFFFFFFFFul + 1ul - 12ul - 8ul - (unsigned long)fmt_size); /* placeholder until finalized */
+    chk.length = (uint32_t)(0x100000000ull - (hdr + sizeof(chk) - 8ull)); /* placeholder until finalized */
     if (write(fd,&chk,sizeof(chk)) != sizeof(chk)) {
         Close();
         return false;
     }
+    hdr += sizeof(chk);
 
-    wav_data_start = wav_write_pos = (uint32_t)lseek(fd,0,SEEK_CUR);
+    wav_data_limit = rf64 ? WAV_RF64_DATA_LIMIT : WAV_DATA_LIMIT;
+    wav_data_start = wav_write_pos = hdr;
+    if (prealloc != 0ull) {
+        uint64_t len = prealloc;
+
+        if (len > (uint64_t)(wav_data_limit - wav_data_start))
+            len = (uint64_t)(wav_data_limit - wav_data_start);
+
+        asyncout_preallocate(fd,(off_t)wav_data_start,(off_t)len);
+    }
+    _output_open(fd,(off_t)wav_data_start);
     return true;
 }
 
 void WAVWriter::Close(void) {
     if (fd >= 0) {
+        _output_close();
+
         if (wav_data_start != 0) {
-            uint32_t length = (uint32_t)lseek(fd,0,SEEK_END);
+            uint64_t length = (uint64_t)lseek(fd,0,SEEK_END);
+            uint64_t data_length;
             uint32_t v;
 
             if (length < wav_data_start)
                 length = wav_data_start;
 
-            /* finalize the WAV file by updating chunk lengths */
+            data_length = length - wav_data_start;
+
+            /* anything else we know about the recording goes after the audio */
+            if (!info_comment.empty()) {
+                lseek(fd,(off_t)length,SEEK_SET);
+                if (_write_info())
+                    length = (uint64_t)lseek(fd,0,SEEK_END);
+            }
 
-            /* RIFF:WAVE length */
-            v = length - 8;
-            v = htole32(v);
-            lseek(fd,4,SEEK_SET); // length field of RIFF:WAVE
-            write(fd,&v,4);
-
-            /* data length */
-            v = length - wav_data_start;
-            v = htole32(v);
-            lseek(fd,(off_t)(wav_data_start - 4ul),SEEK_SET); // length field of 'data'
-            write(fd,&v,4);
+            /* finalize the WAV file by updating chunk lengths */
+            if (wav_ds64_pos != 0 && (data_length > WAV_DATA_LIMIT || (length - 8u) > (uint64_t)0xFFFFFFFFul)) {
+                RIFF_LIST_chunk lchk;
+                RIFF_chunk chk;
+                RIFF_ds64 ds;
+
+                /* RF64:WAVE, with the real lengths in 'ds64' and 0xFFFFFFFF where they would have been */
+                lchk.listcc = RIFF_listcc_RF64;
+                lchk.length = 0xFFFFFFFFul;
+                lchk.fourcc = RIFF_fourcc_WAVE;
+                lseek(fd,0,SEEK_SET);
+                write(fd,&lchk,sizeof(lchk));
+
+                chk.fourcc = RIFF_fourcc_ds64;
+                chk.length = htole32((uint32_t)sizeof(ds));
+                ds.riffSizeLow = htole32((uint32_t)(length - 8u));
+                ds.riffSizeHigh = htole32((uint32_t)((length - 8u) >> 32u));
+                ds.dataSizeLow = htole32((uint32_t)data_length);
+                ds.dataSizeHigh = htole32((uint32_t)(data_length >> 32u));
+                ds.sampleCountLow = htole32((uint32_t)(data_length / block_align));
+                ds.sampleCountHigh = htole32((uint32_t)((data_length / block_align) >> 32u));
+                ds.tableLength = 0;
+                lseek(fd,(off_t)wav_ds64_pos,SEEK_SET);
+                write(fd,&chk,sizeof(chk));
+                write(fd,&ds,sizeof(ds));
+
+                v = 0xFFFFFFFFul;
+                lseek(fd,(off_t)(wav_data_start - 4u),SEEK_SET); // length field of 'data'
+                write(fd,&v,4);
+            }
+            else {
+                /* RIFF:WAVE length */
+                v = (uint32_t)(length - 8u);
+                v = htole32(v);
+                lseek(fd,4,SEEK_SET); // length field of RIFF:WAVE
+                write(fd,&v,4);
+
+                /* data length */
+                v = (uint32_t)data_length;
+                v = htole32(v);
+                lseek(fd,(off_t)(wav_data_start - 4u),SEEK_SET); // length field of 'data'
+                write(fd,&v,4);
+            }
         }
 
+        if (prealloc != 0ull)
+            asyncout_preallocate_trim(fd);
+
         close(fd);
         fd = -1;
     }
     wav_data_start = wav_write_pos = 0;
+    info_comment.clear();
+}
+
+/* how the encoding went, for writers that report on it. empty if not */
+std::string WAVWriter::EncoderStats(void) const {
+    return std::string();
+}
+
+/* how far behind the writer is, in percent of however much it can be. 0 if it never is */
+unsigned int WAVWriter::Backlog(void) const {
+    return 0;
+}
+
+/* write out whatever is buffered, and wait for it */
+int WAVWriter::Flush(void) {
+    if (!IsOpen()) return -EINVAL;
+    if (!out.IsOpen()) return 0;
+    return out.Drain();
+}
+
+/* free-form text to put in a LIST:INFO 'ICMT' chunk when the file is closed */
+void WAVWriter::SetComment(const std::string &str) {
+    info_comment = str;
+}
+
+/* LIST:INFO chunk at the current file position, which must be the end of the 'data' chunk */
+bool WAVWriter::_write_info(void) {
+    const uint32_t slen = (uint32_t)info_comment.length() + 1u; /* including the NUL */
+    const unsigned char zero[2] = {0,0};
+    RIFF_LIST_chunk lchk;
+    RIFF_chunk chk;
+    off_t pos;
+
+    /* RIFF chunks start on an even offset. the 'data' chunk length itself stays odd */
+    pos = lseek(fd,0,SEEK_CUR);
+    if (pos & 1) {
+        if (write(fd,zero,1) != 1)
+            return false;
+    }
+
+    lchk.listcc = RIFF_listcc_LIST;
+    lchk.length = htole32((uint32_t)(4u + sizeof(chk) + ((slen + 1u) & (~1u))));
+    lchk.fourcc = RIFF_fourcc_INFO;
+    if (write(fd,&lchk,sizeof(lchk)) != sizeof(lchk))
+        return false;
+
+    chk.fourcc = RIFF_fourcc_ICMT;
+    chk.length = htole32(slen);
+    if (write(fd,&chk,sizeof(chk)) != sizeof(chk))
+        return false;
+    if ((uint32_t)write(fd,info_comment.c_str(),slen) != slen)
+        return false;
+    if (slen & 1u) {
+        if (write(fd,zero,1) != 1)
+            return false;
+    }
+
+    return true;
 }
 
 bool WAVWriter::SetFormat(const AudioFormat &fmt) {
@@ -125,18 +391,17 @@ bool WAVWriter::SetFormat(const AudioFormat &fmt) {
         case AFMT_PCMS:
             if (!(fmt.bits_per_sample == 8 || fmt.bits_per_sample == 16 || fmt.bits_per_sample == 24 || fmt.bits_per_sample == 32))
                 return false;
-            if (fmt.channels < 1 || fmt.channels > 8)
+            if (fmt.channels < 1) /* up to 255, WAVEFORMATEXTENSIBLE has room for more */
                 return false;
             if (fmt.sample_rate < 1000 || fmt.sample_rate > 192000)
                 return false;
 
-            /* WAV only supports 8-bit unsigned or 16/24/32-bit signed PCM */
-            if (fmt.bits_per_sample == 8 && fmt.format_tag == AFMT_PCMS)
-                flip_sign = true;
-            else if (fmt.bits_per_sample != 8 && fmt.format_tag == AFMT_PCMU)
-                flip_sign = true;
-            else
-                flip_sign = false;
+            /* WAV only supports 8-bit unsigned or 16/24/32-bit signed little endian PCM.
+             * pick the conversion now rather than per buffer. */
+            need_xlat = pcmconv_wav_needs_xlat(fmt);
+            xlat = pcmconv_get_wav(fmt);
+            if (xlat == NULL)
+                return false;
 
             {
                 windows_WAVEFORMAT *w = waveformat();
@@ -157,7 +422,9 @@ bool WAVWriter::SetFormat(const AudioFormat &fmt) {
 
                     wx->Samples.wValidBitsPerSample = htole16(fmt.bits_per_sample);
 
-                    wx->dwChannelMask = (1u << fmt.channels) - 1u; /*FIXME*/
+                    /* the first so many speaker positions, while there are any (18). a 32 or 64 channel
+                     * interface is just inputs, say so with no positions at all (KSAUDIO_SPEAKER_DIRECTOUT) */
+                    wx->dwChannelMask = fmt.channels <= 18 ? ((1u << fmt.channels) - 1u) : 0u;
                     wx->dwChannelMask = htole32(wx->dwChannelMask);
 
                     wx->SubFormat = windows_KSDATAFORMAT_SUBTYPE_PCM;
@@ -167,6 +434,7 @@ bool WAVWriter::SetFormat(const AudioFormat &fmt) {
                 w->nSamplesPerSec = htole32(fmt.sample_rate);
 
                 bytes_per_sample = (fmt.bits_per_sample + 7u) / 8u;
+                channels = fmt.channels;
                 w->nBlockAlign = (uint16_t)(((fmt.bits_per_sample + 7u) / 8u) * fmt.channels);
                 w->nAvgBytesPerSec = ((uint32_t)w->nBlockAlign * (uint32_t)fmt.sample_rate);
                 block_align = w->nBlockAlign;
@@ -189,7 +457,7 @@ bool WAVWriter::IsOpen(void) const {
 
 int WAVWriter::Write(const void *buffer,unsigned int len) {
     if (IsOpen()) {
-        if (flip_sign)
+        if (need_xlat)
             return _write_xlat(buffer,len);
         else
             return _write_raw(buffer,len);
@@ -198,94 +466,91 @@ int WAVWriter::Write(const void *buffer,unsigned int len) {
     return -EINVAL;
 }
 
-void WAVWriter::_xlat(unsigned char *d,const unsigned char *s,unsigned int len) {
-    if (bytes_per_sample == 1) {
-        unsigned char x = flip_sign ? 0x80u : 0x00u;
-        while (len >= bytes_per_sample) {
-            *d++ = (*s++ ^ x);
-            len -= bytes_per_sample;
-        }
-    }
-    else if (bytes_per_sample == 2) {
-        uint16_t x = flip_sign ? 0x8000u : 0x0000u;
-        const uint16_t *s16 = (const uint16_t*)s;
-        uint16_t *d16 = (uint16_t*)d;
-
-        while (len >= bytes_per_sample) {
-            *d16++ = htole16(*s16++ ^ x);
-            len -= bytes_per_sample;
-        }
-    }
-    else if (bytes_per_sample == 4) {
-        uint32_t x = flip_sign ? 0x80000000ul : 0x00000000ul;
-        const uint32_t *s32 = (const uint32_t*)s;
-        uint32_t *d32 = (uint32_t*)d;
-
-        while (len >= bytes_per_sample) {
-            *d32++ = htole32(*s32++ ^ x);
-            len -= bytes_per_sample;
-        }
-    }
-    else {
-        abort();
-    }
-}
-
+/* convert straight into the output buffer, or through a scratch buffer if there is none */
 int WAVWriter::_write_xlat(const void *buffer,unsigned int len) {
+    const unsigned char *s = (const unsigned char*)buffer;
     int wd = 0,swd;
 
-    unsigned int tmpsz = 4096;
-    tmpsz -= tmpsz % block_align;
-    const unsigned char *s = (const unsigned char*)buffer;
-    unsigned char *tmp = new(std::nothrow) unsigned char [tmpsz];
-    if (tmp == NULL) return -ENOMEM;
-
-    while (len >= tmpsz) {
-        _xlat(tmp,s,tmpsz);
-        swd = _write_raw(tmp,tmpsz);
-        if (swd < 0) {
-            delete[] tmp;
-            return swd;
+    len -= len % block_align;
+    if (len == 0)
+        return 0;
+    if ((wav_write_pos+(uint64_t)len) > wav_data_limit)
+        return -ENOSPC;
+
+    if (out.IsOpen()) {
+        while (len > 0) {
+            size_t space;
+            unsigned char *d = out.Reserve(space,block_align);
+
+            if (d == NULL) return out.Error() != 0 ? out.Error() : -EIO;
+
+            /* whole sample frames only. Reserve() makes room for at least one, unless the
+             * buffer itself is smaller than a frame */
+            space -= space % block_align;
+            if (space == 0) return -EIO;
+            if (space > (size_t)len)
+                space = (size_t)len;
+
+            xlat(d,s,(unsigned int)space / block_align,channels);
+            out.Commit(space);
+            wav_write_pos += (uint64_t)space;
+            wd += (int)space;
+            len -= (unsigned int)space;
+            s += space;
         }
-        wd += swd;
-        if ((unsigned int)swd != tmpsz) break;
-        len -= tmpsz;
-        s += tmpsz;
+
+        return _write_check_flush(wd);
     }
 
-    if (len > 0) {
-        _xlat(tmp,s,len);
-        swd = _write_raw(tmp,len);
-        if (swd < 0) {
-            delete[] tmp;
-            return swd;
-        }
+    if (xlat_buf == NULL) {
+        xlat_size = 65536u - (65536u % block_align);
+        xlat_buf = new(std::nothrow) unsigned char[xlat_size];
+        if (xlat_buf == NULL) return -ENOMEM;
+    }
+
+    while (len > 0) {
+        const unsigned int n = len > (unsigned int)xlat_size ? (unsigned int)xlat_size : len;
+
+        xlat(xlat_buf,s,n / block_align,channels);
+        swd = _write_raw(xlat_buf,n);
+        if (swd < 0) return swd;
         wd += swd;
-        len -= len;
-        s += len;
+        if ((unsigned int)swd != n) break;
+        len -= n;
+        s += n;
     }
 
-    delete[] tmp;
     return wd;
 }
 
 int WAVWriter::_write_raw(const void *buffer,unsigned int len) {
-    int wd = 0;
+    const unsigned char *s = (const unsigned char*)buffer;
+    int wd = 0,swd;
 
     /* for simplicity sake require nBlockAlign alignment */
     len -= len % block_align;
+    if (len == 0)
+        return 0;
+    if ((wav_write_pos+(uint64_t)len) > wav_data_limit)
+        return -ENOSPC;
+
+    if (out.IsOpen()) {
+        if ((swd=out.Append(s,len)) < 0) return swd;
+        wav_write_pos += (uint64_t)len;
+        return _write_check_flush((int)len);
+    }
 
-    if (len > 0) {
-        wav_write_pos = (uint32_t)lseek(fd,0,SEEK_CUR);
-
-        if ((wav_write_pos+(uint32_t)len) > wav_data_limit)
-            return -ENOSPC;
+    wd = (int)write(fd,buffer,len);
+    if (wd < 0) return -errno;
 
-        wd = (int)write(fd,buffer,len);
-        if (wd < 0) return -errno;
+    wav_write_pos += (uint64_t)wd;
+    return wd;
+}
 
-        wav_write_pos += (uint32_t)wd;
-    }
+/* after buffering: write out the buffer if it has been sitting there too long */
+int WAVWriter::_write_check_flush(int wd) {
+    const int r = out.SubmitIfOlder(wbuf_flush_ms);
+    if (r < 0) return r;
 
     return wd;
 }
@@ -4,6 +4,8 @@
 
 #include "config.h"
 #include "wavstruc.h"
+#include "pcmconv.h"
+#include "asyncout.h"
 
 class WAVWriter {
 public:
@@ -15,8 +17,29 @@ public:
     virtual bool SetFormat(const AudioFormat &fmt);
     virtual bool IsOpen(void) const;
     virtual int Write(const void *buffer,unsigned int len);
+    virtual void SetComment(const std::string &str);
+    void SetWriteBuffer(size_t size,unsigned int flush_ms);
+    void SetOutput(int backend,unsigned int depth);
+    void SetPreallocate(uint64_t bytes);
+    void SetWriteback(size_t every);
+    void SetRF64(bool en);
+    void SetContinue(bool en);
+    virtual bool ContinueFrom(WAVWriter &prev);
+    virtual bool Finishing(void) const;
+    int Flush(void);
+    virtual std::string OutputStats(void) const;
+    virtual std::string EncoderStats(void) const;
+    virtual unsigned int Backlog(void) const;
+protected:
+    void _output_open(int fd,off_t pos);
+    int _output_write(int fd,const void *buffer,size_t len);
+    int _output_close(void);
+protected:
+    AsyncOutput     out;            /* file output, unless the write buffer size is 0 */
+    bool            enc_continue;   /* encoder left out of Open(), see SetContinue() */
 private:
-    void _xlat(unsigned char *d,const unsigned char *s,unsigned int len);
+    bool _write_info(void);
+    int _write_check_flush(int wd);
     int _write_xlat(const void *buffer,unsigned int len);
     int _write_raw(const void *buffer,unsigned int len);
 private:
@@ -27,12 +50,25 @@ private:
     int             fd;
     unsigned char   fmt[64];
     size_t          fmt_size;
-    bool            flip_sign;
-    uint32_t        wav_data_start;
-    uint32_t        wav_data_limit;
-    uint32_t        wav_write_pos;
+    bool            need_xlat;
+    pcmconv_wav_t   xlat;
+    unsigned int    channels;
+    uint64_t        wav_data_start;
+    uint64_t        wav_data_limit;
+    uint64_t        wav_write_pos;
+    uint32_t        wav_ds64_pos;   /* 'JUNK' chunk that becomes 'ds64' if the file needs RF64, 0 if none */
+    bool            rf64;
     unsigned int    bytes_per_sample;
     unsigned int    block_align;
+    std::string     info_comment;
+    size_t          wbuf_size;      /* 0 to write straight through */
+    unsigned int    wbuf_flush_ms;
+    int             out_backend;
+    unsigned int    out_depth;
+    size_t          writeback;      /* see AsyncOutput::SetWriteback() */
+    uint64_t        prealloc;       /* expected amount of audio, to reserve on disk at Open() */
+    unsigned char*  xlat_buf;       /* conversion scratch when there is no write-behind buffer */
+    size_t          xlat_size;
 };
 
 #endif // __WAV_WRITER_H